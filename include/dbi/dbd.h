@@ -32,6 +32,7 @@ extern "C" {
 #include <dbi/dbi-dev.h>
 
 /* FUNCTIONS EXPORTED BY EACH DRIVER */
+const dbi_functions_t *dbd_get_functions(unsigned int abi_version);
 void dbd_register_driver(const dbi_info_t **_driver_info, const char ***_custom_functions, const char ***_reserved_words);
 int dbd_initialize(dbi_driver_t *driver);
 int dbd_connect(dbi_conn_t *conn);
@@ -57,7 +58,28 @@ unsigned long long dbd_get_seq_last(dbi_conn_t *conn, const char *sequence);
 unsigned long long dbd_get_seq_next(dbi_conn_t *conn, const char *sequence);
 int dbd_ping(dbi_conn_t *conn);
 
+/* OPTIONAL FUNCTIONS, libdbi emulates them if a driver does not export them */
+int dbd_prepare(dbi_stmt_t *stmt);
+dbi_result_t *dbd_stmt_execute(dbi_stmt_t *stmt);
+int dbd_stmt_free(dbi_stmt_t *stmt);
+dbi_result_t *dbd_insert_batch(dbi_conn_t *conn, const char *table, const char **columns, unsigned int numcolumns, dbi_param_t *values, unsigned int numrows);
+int dbd_copy_begin(dbi_copy_t *copy);
+int dbd_copy_put(dbi_copy_t *copy, const char *data, size_t length);
+unsigned long long dbd_copy_end(dbi_copy_t *copy);
+int dbd_send_query(dbi_conn_t *conn, const char *statement);
+int dbd_consume_input(dbi_conn_t *conn);
+int dbd_is_busy(dbi_conn_t *conn);
+dbi_result_t *dbd_get_result(dbi_conn_t *conn);
+int dbd_pipeline_begin(dbi_conn_t *conn);
+int dbd_pipeline_sync(dbi_conn_t *conn);
+int dbd_pipeline_end(dbi_conn_t *conn);
+
 /* _DBD_* DRIVER AUTHORS HELPER FUNCTIONS */
+
+/* literal styles for _dbd_quote_binary_hex() */
+#define DBD_HEX_SQL92 0 /* X'0a1b' */
+#define DBD_HEX_BYTEA 1 /* '\x0a1b' */
+
 dbi_result_t *_dbd_result_create(dbi_conn_t *conn, void *handle, unsigned long long numrows_matched, unsigned long long numrows_affected);
 void _dbd_result_set_numfields(dbi_result_t *result, unsigned int numfields);
 void _dbd_result_add_field(dbi_result_t *result, unsigned int fieldidx, char *name, unsigned short type, unsigned int attribs);
@@ -72,6 +94,13 @@ time_t _dbd_parse_datetime(const char *raw, unsigned int attribs);
 size_t _dbd_escape_chars(char *dest, const char *orig, size_t orig_size, const char *toescape);
 size_t _dbd_encode_binary(const unsigned char *in, size_t n, unsigned char *out);
 size_t _dbd_decode_binary(const unsigned char *in, unsigned char *out);
+size_t _dbd_encode_hex(const unsigned char *in, size_t n, char *out);
+size_t _dbd_decode_hex(const char *in, size_t n, unsigned char *out);
+size_t _dbd_quote_binary_hex(const unsigned char *in, size_t n, char *out, int style);
+size_t _dbd_encode_base64(const unsigned char *in, size_t n, char *out);
+size_t _dbd_decode_base64(const char *in, size_t n, unsigned char *out);
+size_t _dbd_parse_longlong(const char *str, size_t len, long long *value);
+size_t _dbd_parse_double(const char *str, size_t len, double *value);
 
 #ifdef __cplusplus
 }
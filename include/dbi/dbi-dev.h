@@ -37,6 +37,12 @@ extern "C" {
 typedef struct dbi_driver_s *dbi_driver_t_pointer;
 typedef struct dbi_inst_s *dbi_inst_t_pointer;
 typedef struct dbi_conn_s *dbi_conn_t_pointer;
+typedef struct dbi_stmt_s *dbi_stmt_t_pointer;
+typedef struct dbi_template_s *dbi_template_t_pointer;
+typedef struct dbi_param_s *dbi_param_t_pointer;
+typedef struct dbi_batch_s *dbi_batch_t_pointer;
+typedef struct dbi_copy_s *dbi_copy_t_pointer;
+typedef struct dbi_pending_s *dbi_pending_t_pointer;
 typedef struct _field_binding_s *_field_binding_t_pointer;
 
 typedef union dbi_data_u {
@@ -71,6 +77,7 @@ typedef struct dbi_result_s {
 	enum { NOTHING_RETURNED, ROWS_RETURNED } result_state;
 	dbi_row_t **rows; /* array of filled rows, elements set to NULL if not fetched yet */
 	unsigned long long currowidx;
+	int conn_slot; /* index in conn->results, -1 if not registered */
 } dbi_result_t;
 
 typedef struct _field_binding_s {
@@ -98,16 +105,40 @@ typedef struct _capability_s {
 	char *name;
 	int value;
 	struct _capability_s *next;
+	struct _capability_s *hash_next; /* capabilities in the same bucket */
+	unsigned int hash;
 } _capability_t;
 
+#define DBI_CAP_BUCKETS 8
+
+/* capabilities which libdbi checks itself. Registering them also sets
+   these bits in cap_flags if the value is positive */
+#define DBI_CAP_SAFE_DLCLOSE	0x01
+#define DBI_CAP_BULK_INSERT	0x02
+#define DBI_CAP_PIPELINING	0x04
+#define DBI_CAP_BACKSLASH_ESCAPES	0x08
+
 typedef struct dbi_option_s {
 	char *key;
 	char *string_value;
 	int numeric_value; /* use this for port and other numeric settings */
-	struct dbi_option_s *next;
+	struct dbi_option_s *next; /* in the order the options were set */
+	struct dbi_option_s *hash_next; /* options in the same bucket */
+	unsigned int hash;
 } dbi_option_t;
 
+/* options are few, a fixed number of buckets is enough */
+#define DBI_OPTION_BUCKETS 16
+
+/* statement templates, twice the default StatementCacheSize */
+#define DBI_TEMPLATE_BUCKETS 64
+
+/* layout of dbi_functions_t. Functions are only ever appended to it,
+   and each addition raises the version */
+#define DBI_DRIVER_ABI_VERSION 1
+
 typedef struct dbi_functions_s {
+	unsigned int abi_version; /* DBI_DRIVER_ABI_VERSION the table was built with */
 	void (*register_driver)(const dbi_info_t **, const char ***, const char ***);
 	int (*initialize)(dbi_driver_t_pointer);
 	int (*connect)(dbi_conn_t_pointer);
@@ -132,14 +163,46 @@ typedef struct dbi_functions_s {
 	unsigned long long (*get_seq_last)(dbi_conn_t_pointer, const char *);
 	unsigned long long (*get_seq_next)(dbi_conn_t_pointer, const char *);
 	int (*ping)(dbi_conn_t_pointer);
+	/* optional, NULL if the driver does not implement them */
+	int (*prepare)(dbi_stmt_t_pointer);
+	dbi_result_t *(*stmt_execute)(dbi_stmt_t_pointer);
+	int (*stmt_free)(dbi_stmt_t_pointer);
+	dbi_result_t *(*insert_batch)(dbi_conn_t_pointer, const char *, const char **, unsigned int, dbi_param_t_pointer, unsigned int);
+	int (*copy_begin)(dbi_copy_t_pointer);
+	int (*copy_put)(dbi_copy_t_pointer, const char *, size_t);
+	unsigned long long (*copy_end)(dbi_copy_t_pointer);
+	int (*send_query)(dbi_conn_t_pointer, const char *);
+	int (*consume_input)(dbi_conn_t_pointer);
+	int (*is_busy)(dbi_conn_t_pointer);
+	dbi_result_t *(*get_result)(dbi_conn_t_pointer);
+	int (*pipeline_begin)(dbi_conn_t_pointer);
+	int (*pipeline_sync)(dbi_conn_t_pointer);
+	int (*pipeline_end)(dbi_conn_t_pointer);
 } dbi_functions_t;
 
+/* the statistics of a connection are written only by the thread using
+   it, but may be read by any other. Relaxed atomic loads and stores keep
+   the values whole without the cost of a locked add */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define DBI_STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define DBI_STAT_SET(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+#define DBI_ATOMICS 1
+#else
+#define DBI_STAT_GET(counter) (counter)
+#define DBI_STAT_SET(counter, value) ((counter) = (value))
+#endif
+#define DBI_STAT_ADD(counter, n) DBI_STAT_SET(counter, DBI_STAT_GET(counter)+(n))
+
 typedef struct dbi_custom_function_s {
 	const char *name;
 	void *function_pointer;
 	struct dbi_custom_function_s *next;
+	struct dbi_custom_function_s *hash_next; /* functions in the same bucket */
+	unsigned int hash;
 } dbi_custom_function_t;
 
+#define DBI_CUSTOM_FUNCTION_BUCKETS 16
+
 typedef struct dbi_driver_s {
 	void *dlhandle;
 	char *filename; /* full pathname */
@@ -150,6 +213,14 @@ typedef struct dbi_driver_s {
 	_capability_t *caps;
 	dbi_inst_t_pointer dbi_inst; /* engine instance we are called from */
 	struct dbi_driver_s *next;
+	/* compiled drivers read the members above at their offsets, new
+	   members go below */
+	struct dbi_module_s *module; /* the loaded driver this one shares */
+	dbi_custom_function_t *custom_function_buckets[DBI_CUSTOM_FUNCTION_BUCKETS];
+	const char **reserved_word_table; /* open addressing, NULL if not built */
+	unsigned int reserved_word_mask; /* table size minus one */
+	_capability_t *cap_buckets[DBI_CAP_BUCKETS];
+	unsigned int cap_flags; /* DBI_CAP_* with a positive value */
 } dbi_driver_t;
 	
 typedef struct dbi_conn_s {
@@ -167,8 +238,155 @@ typedef struct dbi_conn_s {
 	int results_used;
 	int results_size;
 	struct dbi_conn_s *next; /* so libdbi can unload all conns at exit */
+	/* compiled drivers read the members above at their offsets, new
+	   members go below */
+	struct dbi_conn_s *prev;
+	dbi_stmt_t_pointer stmts; /* prepared statements, detached on close */
+	dbi_template_t_pointer templates; /* parsed statements, most recently used first */
+	dbi_template_t_pointer templates_tail;
+	dbi_template_t_pointer template_buckets[DBI_TEMPLATE_BUCKETS];
+	unsigned int templates_used;
+	char *render_buffer; /* reused to render emulated prepared statements */
+	size_t render_size;
+	dbi_pending_t_pointer pending; /* asynchronous queries, oldest first */
+	dbi_pending_t_pointer pending_tail;
+	int pipelining; /* queries are sent without waiting for earlier ones */
+	int pipeline_unsynced; /* queries were sent since the last sync */
+	unsigned int pending_done; /* asynchronous queries with a result to collect */
+	int worker_active; /* queued for or served by a worker thread */
+	dbi_pending_t_pointer worker_pending; /* query a worker thread runs */
+	struct dbi_conn_s *next_runnable; /* queue of the worker threads */
+	struct dbi_pool_s *pool; /* pool the connection belongs to, if any */
+	long long pool_idle_since;
+	struct dbi_conn_s *pool_next; /* idle connections of the pool */
+	dbi_conn_stats stats; /* written with DBI_STAT_ADD() only */
+	dbi_option_t *options_tail;
+	dbi_option_t *option_buckets[DBI_OPTION_BUCKETS];
+	int log_queries; /* options used on every query, cached when they are set */
+	int verbosity;
+	int user_error_callback;
+	int template_cache_size; /* -1 if not set */
+	_capability_t *cap_buckets[DBI_CAP_BUCKETS];
+	unsigned int cap_flags; /* DBI_CAP_* with a positive value */
+	unsigned int cap_mask; /* DBI_CAP_* registered, others are the driver's */
+	int latency_histograms;
+	int timed; /* see DBI_CONN_TIMED() */
+	dbi_trace_callbacks *trace; /* NULL unless queries are traced */
+	void *trace_argument;
+	int slow_query_ms; /* -1 unless SlowQueryMs is set */
+	int slow_query_fd;
+	dbi_batch_t_pointer batches; /* detached on close like stmts */
+	dbi_copy_t_pointer copies;
 } dbi_conn_t;
 
+/* the clock is read around the queries of a connection if anything
+   needs their duration */
+#define DBI_CONN_TIMED(conn) ((conn)->latency_histograms || (conn)->trace || (conn)->slow_query_ms >= 0)
+
+/****************************
+ * PREPARED STATEMENT TYPES *
+ ****************************/
+
+typedef struct dbi_param_s {
+	unsigned short type; /* DBI_TYPE_*, or 0 if not bound yet */
+	unsigned int attribs; /* size attributes as used in result fields */
+	unsigned char flags; /* DBI_VALUE_NULL */
+	dbi_data_t value; /* d_string points to copy for strings and binaries */
+	size_t length; /* length of strings and binaries */
+	char *copy; /* private copy of the last string or binary, zero-terminated */
+	size_t capacity; /* allocated size of copy */
+} dbi_param_t;
+
+/* a statement split into literal SQL segments and parameter slots,
+   shared by all statements of a connection with the same SQL text */
+typedef struct dbi_template_s {
+	char *statement;
+	size_t length;
+	unsigned long hash;
+	unsigned int numparams;
+	size_t *placeholders; /* offsets of the placeholders in statement */
+	unsigned int refcount; /* one for the cache, one for each statement */
+	struct dbi_template_s *prev;
+	struct dbi_template_s *next;
+	struct dbi_template_s *hash_next; /* cached templates in the same bucket */
+} dbi_template_t;
+
+typedef struct dbi_stmt_s {
+	dbi_conn_t *conn;
+	void *stmt_handle; /* will be typecast into driver-specific type, NULL if emulated */
+	const char *statement; /* the SQL text with '?' placeholders */
+	unsigned int numparams;
+	dbi_param_t *params;
+	const size_t *placeholders; /* offsets of the placeholders in statement */
+	dbi_template_t *tmpl; /* owns statement and placeholders */
+	struct dbi_stmt_s *prev; /* statements of the connection */
+	struct dbi_stmt_s *next;
+} dbi_stmt_t;
+
+typedef struct dbi_batch_s {
+	dbi_conn_t *conn;
+	char *table;
+	char **columns;
+	unsigned int numcolumns;
+	size_t maxbytes; /* flush before a statement grows larger than this */
+	unsigned int maxrows; /* flush when this many rows are pending */
+	unsigned int numrows; /* complete rows which were not sent yet */
+	unsigned int curcolumn; /* values appended to the current row so far */
+	int native; /* rows are kept in values for the driver's insert_batch */
+	char *buffer; /* the INSERT statement being built if not native */
+	size_t size;
+	size_t used;
+	size_t headerlen; /* length of "INSERT INTO ... VALUES " */
+	size_t rowstart; /* offset of the current row in buffer */
+	dbi_param_t *values; /* numcolumns values per row if native */
+	unsigned int values_rows; /* rows allocated in values */
+	size_t native_bytes; /* estimated size of the values */
+	unsigned long long numrows_affected; /* sum over all flushed statements */
+	struct dbi_batch_s *prev; /* batches of the connection */
+	struct dbi_batch_s *next;
+} dbi_batch_t;
+
+typedef struct dbi_copy_s {
+	dbi_conn_t *conn;
+	void *copy_handle; /* will be typecast into driver-specific type, NULL if emulated */
+	char *table;
+	char **columns;
+	unsigned int numcolumns;
+	char *buffer; /* encoded rows not passed on yet */
+	size_t size;
+	size_t used;
+	dbi_batch_t *batch; /* inserts the rows if the driver cannot copy */
+	unsigned long long numrows; /* rows put so far */
+	int failed;
+	struct dbi_copy_s *prev; /* loads of the connection */
+	struct dbi_copy_s *next;
+	unsigned long long numrows_rejected; /* lines with the wrong number of fields */
+} dbi_copy_t;
+
+/****************************
+ * ASYNCHRONOUS QUERY TYPES *
+ ****************************/
+
+typedef enum { DBI_PENDING_SENT, DBI_PENDING_DONE, DBI_PENDING_FAILED } dbi_pending_state;
+
+typedef struct dbi_pending_s {
+	dbi_conn_t *conn;
+	dbi_pending_state state;
+	dbi_result_t *result; /* set once the query is done */
+	char *statement; /* copy for the worker threads and the slow query log */
+	size_t length;
+	struct dbi_workers_s *workers; /* threads running the query, if any */
+	long long start; /* clock when it was submitted, -1 if not timed */
+	long long finished; /* clock when a worker completed it */
+	unsigned long long prefetched; /* rows a worker fetched ahead */
+	long long prefetch_us;
+	int error_number; /* saved by a worker for the thread getting the result */
+	char *error_message;
+	dbi_query_callback callback;
+	void *user_argument;
+	struct dbi_pending_s *next; /* queue of the connection */
+} dbi_pending_t;
+
 unsigned int _isolate_attrib(unsigned int attribs, unsigned int rangemin, unsigned int rangemax);
 void _error_handler(dbi_conn_t *conn, dbi_error_flag errflag);
 void _reset_conn_error(dbi_conn_t *conn);
@@ -178,17 +396,98 @@ void _logquery_null(dbi_conn_t *conn, const char* statement, size_t st_length);
 int _disjoin_from_conn(dbi_result_t *result);
 void _set_field_flag(dbi_row_t *row, unsigned int fieldidx, unsigned char flag, unsigned char value);
 int _get_field_flag(dbi_row_t *row, unsigned int fieldidx, unsigned char flag);
+void _free_template_cache(dbi_conn_t *conn);
+void _detach_stmts(dbi_conn_t *conn);
+void _pool_release(struct dbi_pool_s *pool, dbi_conn_t *conn);
+void _free_pools(dbi_inst_t_pointer inst);
+unsigned int _count_placeholders(const char *statement, size_t *placeholders, int backslash_escapes);
+int _buffer_reserve(char **buffer, size_t *size, size_t used, size_t extra);
+int _render_param(dbi_conn_t *conn, const dbi_param_t *param, char **buffer, size_t *size, size_t *used);
+void _drop_batch_row(dbi_batch_t *batch);
+void _detach_batches(dbi_conn_t *conn);
+void _detach_copies(dbi_conn_t *conn);
+const char *_copy_decode_field(char **read, char *end);
+void _free_pending_queries(dbi_conn_t *conn);
+int _start_workers(dbi_inst_t_pointer inst, unsigned int numthreads);
+int _stop_workers(dbi_inst_t_pointer inst);
+int _worker_runs(dbi_conn_t *conn);
+long long _now_ms(void);
+long long _now_us(void);
+long long _stats_clock(dbi_conn_t *conn);
+void _stats_count_connect(dbi_conn_t *conn, long long start);
+dbi_result_t *_conn_query(dbi_conn_t *conn, const char *statement, size_t length);
+void _stats_count_query(dbi_conn_t *conn, size_t length, dbi_result_t *result, long long start);
+void _stats_count_row(dbi_result_t *result, unsigned long long rowidx, long long start);
+void _stats_add(dbi_conn_stats *total, const dbi_conn_stats *stats);
+void _trace_query_start(dbi_conn_t *conn, const char *statement, size_t length);
+void _trace_query_end(dbi_conn_t *conn, dbi_result_t *result, long long start);
+void _trace_fetch(dbi_result_t *result, unsigned long long numrows, long long start);
+void _trace_result_free(dbi_result_t *result);
+int _start_slowlog(dbi_inst_t_pointer inst);
+void _stop_slowlog(dbi_inst_t_pointer inst);
+void _slowlog_query(dbi_conn_t *conn, const char *statement, size_t length, dbi_result_t *result, long long start);
+unsigned int _name_hash(const char *name);
+dbi_option_t *_find_option_node(dbi_conn_t *conn, const char *key);
+_capability_t *_find_cap(_capability_t **buckets, const char *capname);
+int _conn_has_cap(dbi_conn_t *conn, unsigned int cap);
 
 
 /******************************
  * DBI INSTANCE RELATED TYPES *
  ******************************/
+
+#ifdef __MINGW32__
+#define DBI_PATH_SEPARATOR "\\"
+#else
+#define DBI_PATH_SEPARATOR "/"
+#endif
+
+/* a driver found in the driver directory but not loaded yet */
+typedef struct dbi_driver_file_s {
+	char *filename;
+	char *name; /* guessed from the filename, NULL if unknown or the
+		       manifest lists the file as not loadable */
+	char *version; /* the rest is only set if read from the manifest */
+	long mtime; /* of the file when the manifest was written */
+	unsigned long size;
+	int from_manifest; /* then name is exact */
+	struct dbi_driver_file_s *next;
+} dbi_driver_file_t;
+
+/* a driver loaded once for all instances of the process. The drivers
+   of the instances are copies of driver which point back here */
+typedef struct dbi_module_s {
+	dbi_driver_t *driver; /* as loaded and initialized, without instance */
+	const dbi_functions_t *static_functions; /* table of a static driver */
+	unsigned int refcount; /* drivers of instances using it */
+	struct dbi_module_s *next;
+} dbi_module_t;
+
 typedef struct dbi_inst_s {
 	dbi_driver_t *rootdriver;
 	dbi_conn_t *rootconn;
 	int dbi_verbosity;
+	struct dbi_workers_s *workers; /* threads running asynchronous queries */
+	unsigned int async_queued; /* queries the workers may run, see dbi_set_async_workers_r() */
+	struct dbi_slowlog_s *slowlog; /* writer of the slow query log, started on first use */
+	dbi_conn_stats closed_stats; /* of the connections closed so far */
+	dbi_driver_file_t *driver_files; /* drivers to load on first use */
+	dbi_driver_file_t *failed_files; /* which did not load, kept for the manifest */
+	char *driverdir; /* of the driver files, NULL if all were loaded */
+	int manifest_stale; /* a file loaded on first use did not match it */
+	struct dbi_pool_s *pools; /* freed by dbi_shutdown_r() */
+	struct dbi_inst_lock_s *lock; /* guards rootdriver, rootconn and the driver files */
 } dbi_inst_t;
 
+/* makes a driver linked into the program known to all instances
+   created afterwards */
+int dbi_register_static_driver(const dbi_functions_t *functions);
+
+void _free_driver_file(dbi_driver_file_t *file);
+int _read_driver_manifest(dbi_inst_t *inst, const char *driverdir);
+void _write_driver_manifest(dbi_inst_t *inst, const char *driverdir, dbi_driver_file_t *failed);
+int _driver_file_changed(dbi_driver_file_t *file, dbi_driver_t *driver);
+
 
 #ifdef __cplusplus
 }
@@ -31,29 +31,44 @@
 #include <unistd.h>
 #include <math.h>
 #include <limits.h>
+#include <ctype.h>
+#include <float.h>
+#include <locale.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <dbi/dbi.h>
 #include <dbi/dbi-dev.h>
+#include <dbi/dbd.h>
 
 #ifndef HAVE_TIMEGM
 time_t timegm(struct tm *tm);
 #endif
 
-static _capability_t *_find_or_create_driver_cap(dbi_driver_t *driver, const char *capname);
-static _capability_t *_find_or_create_conn_cap(dbi_conn_t *conn, const char *capname);
+static _capability_t *_find_or_create_cap(_capability_t **caps, _capability_t **buckets, const char *capname);
+static unsigned int _cap_flag(const char *capname);
 
 int _dbd_result_add_to_conn(dbi_result_t *result) {
 	dbi_conn_t *conn = result->conn;
 	
+	if (_worker_runs(conn)) {
+		/* added by the thread which gets the result */
+		return 1;
+	}
 	if (conn->results_size < conn->results_used+1) {
-		dbi_result_t **results = (dbi_result_t **) realloc(conn->results, sizeof(dbi_result_t *) * (conn->results_size+1));
+		/* grow geometrically, connections may hold many results */
+		int newsize = conn->results_size ? conn->results_size*2 : 8;
+		dbi_result_t **results = (dbi_result_t **) realloc(conn->results, sizeof(dbi_result_t *) * newsize);
 		if (!results) {
 			return 0;
 		}
 		conn->results = results;
-		conn->results_size++;
+		conn->results_size = newsize;
 	}
 
+	result->conn_slot = conn->results_used;
 	conn->results[conn->results_used] = result;
 	conn->results_used++;
 	return 1;
@@ -74,6 +89,7 @@ dbi_result_t *_dbd_result_create(dbi_conn_t *conn, void *handle, unsigned long l
 	result->result_state = (numrows_matched > 0) ? ROWS_RETURNED : NOTHING_RETURNED;
 	result->rows = calloc(numrows_matched+1, sizeof(dbi_row_t *));
 	result->currowidx = 0;
+	result->conn_slot = -1;
 
 	if (!_dbd_result_add_to_conn(result)) {
 		dbi_result_free((dbi_result)result);
@@ -150,6 +166,9 @@ void _dbd_internal_error_handler(dbi_conn_t *conn, const char *errmsg, const int
   int errstatus;
   char *my_errmsg = NULL;
 
+  if (_worker_runs(conn)) {
+    return;
+  }
   if (conn->error_message) {
     free(conn->error_message);
   }
@@ -206,6 +225,7 @@ dbi_result_t *_dbd_result_create_from_stringarray(dbi_conn_t *conn, unsigned lon
 	result->result_state = (numrows_matched > 0) ? ROWS_RETURNED : NOTHING_RETURNED;
 	result->rows = calloc(numrows_matched+1, sizeof(dbi_row_t *));
 	result->currowidx = 0;
+	result->conn_slot = -1;
 
 
 	/* then set numfields */
@@ -229,69 +249,62 @@ dbi_result_t *_dbd_result_create_from_stringarray(dbi_conn_t *conn, unsigned lon
 }
 
 void _dbd_register_driver_cap(dbi_driver_t *driver, const char *capname, int value) {
-	_capability_t *cap = _find_or_create_driver_cap(driver, capname);
+	_capability_t *cap = _find_or_create_cap(&driver->caps, driver->cap_buckets, capname);
+	unsigned int flag = _cap_flag(capname);
 	if (!cap) return;
 	cap->value = value;
+	driver->cap_flags = value > 0 ? driver->cap_flags | flag : driver->cap_flags & ~flag;
 	return;
 }
 
 void _dbd_register_conn_cap(dbi_conn_t *conn, const char *capname, int value) {
-	_capability_t *cap = _find_or_create_conn_cap(conn, capname);
+	_capability_t *cap = _find_or_create_cap(&conn->caps, conn->cap_buckets, capname);
+	unsigned int flag = _cap_flag(capname);
 	if (!cap) return;
 	cap->value = value;
+	conn->cap_flags = value > 0 ? conn->cap_flags | flag : conn->cap_flags & ~flag;
+	conn->cap_mask |= flag;
 	return;
 }
 
-static _capability_t *_find_or_create_driver_cap(dbi_driver_t *driver, const char *capname) {
-	_capability_t *prevcap = NULL;
-	_capability_t *cap = driver->caps;
-
-	while (cap && strcmp(capname, cap->name)) {
-		prevcap = cap;
-		cap = cap->next;
-	}
+static _capability_t *_find_or_create_cap(_capability_t **caps, _capability_t **buckets, const char *capname) {
+	_capability_t *cap = _find_cap(buckets, capname);
 
 	if (cap == NULL) {
 		/* allocate a new node */
 		cap = malloc(sizeof(_capability_t));
 		if (!cap) return NULL;
 		cap->name = strdup(capname);
-		cap->next = NULL;
-		if (driver->caps == NULL) {
-		    driver->caps = cap;
-		}
-		else {
-		    prevcap->next = cap;
+		if (!cap->name) {
+			free(cap);
+			return NULL;
 		}
+		cap->next = *caps;
+		*caps = cap;
+		cap->hash = _name_hash(capname);
+		cap->hash_next = buckets[cap->hash % DBI_CAP_BUCKETS];
+		buckets[cap->hash % DBI_CAP_BUCKETS] = cap;
 	}
 
 	return cap;
 }
 
-static _capability_t *_find_or_create_conn_cap(dbi_conn_t *conn, const char *capname) {
-	_capability_t *prevcap = NULL;
-	_capability_t *cap = conn->caps;
-
-	while (cap && strcmp(capname, cap->name)) {
-		prevcap = cap;
-		cap = cap->next;
+/* the DBI_CAP_* bit of the capabilities libdbi checks itself, 0 for
+   all others */
+static unsigned int _cap_flag(const char *capname) {
+	if (!strcmp(capname, "safe_dlclose")) {
+		return DBI_CAP_SAFE_DLCLOSE;
 	}
-
-	if (cap == NULL) {
-		/* allocate a new node */
-		cap = malloc(sizeof(_capability_t));
-		if (!cap) return NULL;
-		cap->next = NULL;
-		cap->name = strdup(capname);
-		if (conn->caps == NULL) {
-		    conn->caps = cap;
-		}
-		else {
-		    prevcap->next = cap;
-		}
+	if (!strcmp(capname, "bulk_insert")) {
+		return DBI_CAP_BULK_INSERT;
 	}
-
-	return cap;
+	if (!strcmp(capname, "pipelining")) {
+		return DBI_CAP_PIPELINING;
+	}
+	if (!strcmp(capname, "backslash_escapes")) {
+		return DBI_CAP_BACKSLASH_ESCAPES;
+	}
+	return 0;
 }
 
 time_t _dbd_parse_datetime(const char *raw, unsigned int attribs) {
@@ -576,3 +589,660 @@ size_t _dbd_decode_binary(const unsigned char *in, unsigned char *out){
   }
   return (size_t)i;
 }
+
+/* hex and base64 encoding/decoding of binary strings. Unlike the
+   SQLite-style encoding above, these produce formats which most
+   database engines understand natively: X'0a1b' is the SQL-92 binary
+   literal accepted by MySQL, SQLite, Firebird and others, '\x0a1b' is
+   the PostgreSQL bytea hex format, and base64 is handy for engines
+   which store binary data as text. All encoders write into a
+   caller-supplied buffer and follow the _dbd_encode_binary()
+   convention: if out==NULL, nothing is written but the number of
+   characters that would have been generated is still returned */
+
+static const char _dbd_hex_digits[] = "0123456789abcdef";
+
+static const char _dbd_base64_chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* maps an ASCII character to its hex or base64 value, 0xff if the
+   character is not part of the alphabet. Constant, so that decoding
+   needs no initialization shared between threads */
+static const unsigned char _dbd_hex_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static const unsigned char _dbd_base64_values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/*
+** Encode a binary buffer "in" of size n bytes as lowercase hex
+** digits, two per input byte. "out" must be able to hold at least
+** 2*n+1 bytes. The output is null-terminated; the return value is
+** the number of characters excluding the terminator.
+*/
+size_t _dbd_encode_hex(const unsigned char *in, size_t n, char *out) {
+  size_t i = 0;
+
+  if (!out) {
+    return 2*n;
+  }
+
+#ifdef __SSE2__
+  {
+    /* 16 input bytes per step: split each byte into its nibbles,
+       turn the nibbles into ASCII digits ('0'+n, plus 39 more for
+       a-f) and interleave high and low nibbles */
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8('a'-'0'-10);
+
+    for (; i+16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(in+i));
+      __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+      __m128i lo = _mm_and_si128(v, mask);
+
+      hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+      lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+      _mm_storeu_si128((__m128i *)(out+2*i), _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128((__m128i *)(out+2*i+16), _mm_unpackhi_epi8(hi, lo));
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    out[2*i] = _dbd_hex_digits[in[i] >> 4];
+    out[2*i+1] = _dbd_hex_digits[in[i] & 0x0f];
+  }
+  out[2*n] = '\0';
+  return 2*n;
+}
+
+/*
+** Decode n hex digits (upper or lower case) from "in" into "out",
+** which must be able to hold at least n/2 bytes. Returns the number
+** of bytes written, or DBI_LENGTH_ERROR if n is odd or "in"
+** contains a character which is not a hex digit. The output is not
+** null-terminated.
+*/
+size_t _dbd_decode_hex(const char *in, size_t n, unsigned char *out) {
+  size_t i = 0;
+
+  if (n % 2) {
+    return DBI_LENGTH_ERROR;
+  }
+
+#ifdef __SSE2__
+  {
+    /* 32 input characters per step. Only ASCII digits and letters
+       pass the range checks below, as bytes >= 0x80 are negative in
+       signed comparisons. Invalid blocks are left to the scalar loop
+       which reports the error */
+    const __m128i below_digits = _mm_set1_epi8('0'-1);
+    const __m128i above_digits = _mm_set1_epi8('9'+1);
+    const __m128i below_alpha = _mm_set1_epi8('a'-1);
+    const __m128i above_alpha = _mm_set1_epi8('f'+1);
+    const __m128i lowercase = _mm_set1_epi8(0x20);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8('a'-10);
+    const __m128i lowbyte = _mm_set1_epi16(0x00ff);
+
+    for (; i+32 <= n; i += 32) {
+      __m128i v[2];
+      int k;
+
+      for (k = 0; k < 2; k++) {
+	__m128i c = _mm_loadu_si128((const __m128i *)(in+i+16*k));
+	__m128i l = _mm_or_si128(c, lowercase);
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_digits), _mm_cmplt_epi8(c, above_digits));
+	__m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(l, below_alpha), _mm_cmplt_epi8(l, above_alpha));
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+	  break;
+	}
+	/* nibble values; each 16-bit lane now holds hi | lo << 8 */
+	v[k] = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(c, zero)),
+			    _mm_andnot_si128(is_digit, _mm_sub_epi8(l, alpha)));
+	v[k] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v[k], lowbyte), 4), _mm_srli_epi16(v[k], 8));
+      }
+      if (k < 2) {
+	break;
+      }
+      _mm_storeu_si128((__m128i *)(out+i/2), _mm_packus_epi16(v[0], v[1]));
+    }
+  }
+#endif
+
+  for (; i < n; i += 2) {
+    unsigned char hi = _dbd_hex_values[(unsigned char)in[i]];
+    unsigned char lo = _dbd_hex_values[(unsigned char)in[i+1]];
+
+    if ((hi | lo) == 0xff) {
+      return DBI_LENGTH_ERROR;
+    }
+    out[i/2] = (hi << 4) | lo;
+  }
+  return n/2;
+}
+
+/*
+** Quote a binary buffer "in" of size n bytes as a hex literal which
+** can be used as a value in an INSERT or UPDATE statement. "style"
+** selects the literal syntax: DBD_HEX_SQL92 produces X'0a1b',
+** DBD_HEX_BYTEA produces '\x0a1b'. "out" must be able to hold at
+** least 2*n+5 bytes. Returns the number of characters in the literal,
+** excluding the terminating null byte.
+*/
+size_t _dbd_quote_binary_hex(const unsigned char *in, size_t n, char *out, int style) {
+  size_t prefix_len = (style == DBD_HEX_BYTEA) ? 3 : 2;
+
+  if (out) {
+    if (style == DBD_HEX_BYTEA) {
+      memcpy(out, "'\\x", 3);
+    }
+    else {
+      memcpy(out, "X'", 2);
+    }
+    _dbd_encode_hex(in, n, out+prefix_len);
+    out[prefix_len+2*n] = '\'';
+    out[prefix_len+2*n+1] = '\0';
+  }
+  return prefix_len+2*n+1;
+}
+
+/*
+** Encode a binary buffer "in" of size n bytes as base64 (RFC 4648,
+** with padding, no line breaks). "out" must be able to hold at least
+** 4*((n+2)/3)+1 bytes. The output is null-terminated; the return
+** value is the number of characters excluding the terminator.
+*/
+size_t _dbd_encode_base64(const unsigned char *in, size_t n, char *out) {
+  size_t i = 0;
+  size_t j = 0;
+  unsigned long long bits;
+
+  if (!out) {
+    return 4*((n+2)/3);
+  }
+
+#ifdef __SSE2__
+  {
+    /* 12 input bytes per step. SSE2 cannot shuffle bytes, so the
+       groups of 3 bytes are put into the 32-bit lanes one by one;
+       splitting them into sextets and mapping those to the alphabet
+       (an offset chosen by range compares instead of a table lookup)
+       is done on all 16 characters at once */
+    const __m128i sextet = _mm_set1_epi32(0x3f);
+    const __m128i upper_end = _mm_set1_epi8(25);
+    const __m128i lower_end = _mm_set1_epi8(51);
+    const __m128i digit_end = _mm_set1_epi8(61);
+    const __m128i plus = _mm_set1_epi8(62);
+
+    for (; i+12 <= n; i += 12, j += 16) {
+      __m128i v = _mm_set_epi32((in[i+9] << 16) | (in[i+10] << 8) | in[i+11],
+				(in[i+6] << 16) | (in[i+7] << 8) | in[i+8],
+				(in[i+3] << 16) | (in[i+4] << 8) | in[i+5],
+				(in[i] << 16) | (in[i+1] << 8) | in[i+2]);
+      __m128i idx;
+      __m128i offset;
+
+      /* the first sextet goes into the lowest byte of each lane */
+      idx = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 18), sextet),
+				      _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 12), sextet), 8)),
+			 _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 6), sextet), 16),
+				      _mm_slli_epi32(_mm_and_si128(v, sextet), 24)));
+      /* 'A'-0, then 'a'-26, '0'-52, '+'-62 and '/'-63 */
+      offset = _mm_add_epi8(_mm_set1_epi8('A'), _mm_and_si128(_mm_cmpgt_epi8(idx, upper_end), _mm_set1_epi8(6)));
+      offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(idx, lower_end), _mm_set1_epi8(-75)));
+      offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(idx, digit_end), _mm_set1_epi8(-15)));
+      offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(idx, plus), _mm_set1_epi8(3)));
+      _mm_storeu_si128((__m128i *)(out+j), _mm_add_epi8(idx, offset));
+    }
+  }
+#else
+  /* 12 input bytes per step, assembled into 3 * 24 bits at once */
+  for (; i+12 <= n; i += 12, j += 16) {
+    int k;
+    for (k = 0; k < 4; k++) {
+      bits = ((unsigned long long)in[i+3*k] << 16) | (in[i+3*k+1] << 8) | in[i+3*k+2];
+      out[j+4*k] = _dbd_base64_chars[(bits >> 18) & 0x3f];
+      out[j+4*k+1] = _dbd_base64_chars[(bits >> 12) & 0x3f];
+      out[j+4*k+2] = _dbd_base64_chars[(bits >> 6) & 0x3f];
+      out[j+4*k+3] = _dbd_base64_chars[bits & 0x3f];
+    }
+  }
+#endif
+
+  for (; i+3 <= n; i += 3, j += 4) {
+    bits = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+    out[j] = _dbd_base64_chars[(bits >> 18) & 0x3f];
+    out[j+1] = _dbd_base64_chars[(bits >> 12) & 0x3f];
+    out[j+2] = _dbd_base64_chars[(bits >> 6) & 0x3f];
+    out[j+3] = _dbd_base64_chars[bits & 0x3f];
+  }
+
+  if (i < n) {
+    bits = in[i] << 16;
+    if (i+1 < n) {
+      bits |= in[i+1] << 8;
+    }
+    out[j] = _dbd_base64_chars[(bits >> 18) & 0x3f];
+    out[j+1] = _dbd_base64_chars[(bits >> 12) & 0x3f];
+    out[j+2] = (i+1 < n) ? _dbd_base64_chars[(bits >> 6) & 0x3f] : '=';
+    out[j+3] = '=';
+    j += 4;
+  }
+
+  out[j] = '\0';
+  return j;
+}
+
+/*
+** Decode n base64 characters from "in" into "out", which must be able
+** to hold at least 3*(n/4)+2 bytes. Trailing padding is optional.
+** Returns the number of bytes written, or DBI_LENGTH_ERROR if "in" is
+** not well-formed base64. The output is not null-terminated.
+*/
+size_t _dbd_decode_base64(const char *in, size_t n, unsigned char *out) {
+  size_t i = 0;
+  size_t j = 0;
+  unsigned long bits;
+  unsigned char c0, c1, c2, c3;
+
+  /* strip the padding */
+  if (n > 0 && in[n-1] == '=') n--;
+  if (n > 0 && in[n-1] == '=') n--;
+  if (n % 4 == 1) {
+    return DBI_LENGTH_ERROR;
+  }
+
+#ifdef __SSE2__
+  {
+    /* 16 input characters per step, mapped to their sextets by range
+       compares like in _dbd_decode_hex(). Invalid blocks are left to
+       the scalar loop which reports the error. The sextets are joined
+       into 3 bytes per 32-bit lane and the lanes closed up with 64-bit
+       shifts, as SSE2 cannot shuffle bytes. The two 6-byte halves are
+       stored with 8-byte writes, which stay within the 3*(n/4)+2 bytes
+       of out */
+    const __m128i below_upper = _mm_set1_epi8('A'-1);
+    const __m128i above_upper = _mm_set1_epi8('Z'+1);
+    const __m128i below_lower = _mm_set1_epi8('a'-1);
+    const __m128i above_lower = _mm_set1_epi8('z'+1);
+    const __m128i below_digits = _mm_set1_epi8('0'-1);
+    const __m128i above_digits = _mm_set1_epi8('9'+1);
+    const __m128i lowbyte = _mm_set1_epi16(0x00ff);
+    const __m128i lowword = _mm_set1_epi32(0x0000ffff);
+    const __m128i lane_byte0 = _mm_set1_epi32(0x000000ff);
+    const __m128i lane_byte1 = _mm_set1_epi32(0x0000ff00);
+    const __m128i lane_byte2 = _mm_set1_epi32(0x00ff0000);
+    const __m128i low_lane = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+    const __m128i high_lane = _mm_set_epi32(0x0000ffff, 0xff000000, 0x0000ffff, 0xff000000);
+
+    for (; i+16 <= n; i += 16, j += 12) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(in+i));
+      __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(c, below_upper), _mm_cmplt_epi8(c, above_upper));
+      __m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(c, below_lower), _mm_cmplt_epi8(c, above_lower));
+      __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_digits), _mm_cmplt_epi8(c, above_digits));
+      __m128i is_plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+      __m128i is_slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+      __m128i v;
+
+      if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(is_upper, is_lower),
+					 _mm_or_si128(is_digit, _mm_or_si128(is_plus, is_slash)))) != 0xffff) {
+	break;
+      }
+      v = _mm_or_si128(_mm_or_si128(_mm_and_si128(is_upper, _mm_set1_epi8(-'A')),
+				    _mm_and_si128(is_lower, _mm_set1_epi8(26-'a'))),
+		       _mm_or_si128(_mm_and_si128(is_digit, _mm_set1_epi8(52-'0')),
+				    _mm_or_si128(_mm_and_si128(is_plus, _mm_set1_epi8(62-'+')),
+						 _mm_and_si128(is_slash, _mm_set1_epi8(63-'/')))));
+      v = _mm_add_epi8(c, v);
+      /* 12 bits per 16-bit lane, then 24 bits per 32-bit lane */
+      v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lowbyte), 6), _mm_srli_epi16(v, 8));
+      v = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, lowword), 12), _mm_srli_epi32(v, 16));
+      /* the most significant byte comes first */
+      v = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lane_byte0),
+				    _mm_and_si128(v, lane_byte1)),
+		       _mm_and_si128(_mm_slli_epi32(v, 16), lane_byte2));
+      v = _mm_or_si128(_mm_and_si128(v, low_lane), _mm_and_si128(_mm_srli_epi64(v, 8), high_lane));
+      _mm_storel_epi64((__m128i *)(out+j), v);
+      _mm_storel_epi64((__m128i *)(out+j+6), _mm_srli_si128(v, 8));
+    }
+  }
+#endif
+
+  for (; i+4 <= n; i += 4, j += 3) {
+    c0 = _dbd_base64_values[(unsigned char)in[i]];
+    c1 = _dbd_base64_values[(unsigned char)in[i+1]];
+    c2 = _dbd_base64_values[(unsigned char)in[i+2]];
+    c3 = _dbd_base64_values[(unsigned char)in[i+3]];
+    /* any invalid character sets the high bit */
+    if ((c0 | c1 | c2 | c3) & 0x80) {
+      return DBI_LENGTH_ERROR;
+    }
+    bits = ((unsigned long)c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+    out[j] = (bits >> 16) & 0xff;
+    out[j+1] = (bits >> 8) & 0xff;
+    out[j+2] = bits & 0xff;
+  }
+
+  if (i < n) {
+    /* two or three characters left, yielding one or two bytes */
+    c0 = _dbd_base64_values[(unsigned char)in[i]];
+    c1 = _dbd_base64_values[(unsigned char)in[i+1]];
+    c2 = (i+2 < n) ? _dbd_base64_values[(unsigned char)in[i+2]] : 0;
+    if ((c0 | c1 | c2) & 0x80) {
+      return DBI_LENGTH_ERROR;
+    }
+    bits = ((unsigned long)c0 << 18) | (c1 << 12) | (c2 << 6);
+    out[j++] = (bits >> 16) & 0xff;
+    if (i+2 < n) {
+      out[j++] = (bits >> 8) & 0xff;
+    }
+  }
+
+  return j;
+}
+
+/* fast conversion of numeric strings as returned by text-protocol
+   client libraries. Both functions take an explicit length, as the
+   digits are consumed up to eight at a time and the buffers usually
+   are not null-terminated at a convenient boundary anyway */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DBD_SWAR_DIGITS 1
+
+/* nonzero if all eight bytes are ASCII digits */
+static int _dbd_is_eight_digits(unsigned long long v) {
+  return (((v & 0xf0f0f0f0f0f0f0f0ULL)
+	   | (((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4))
+	  == 0x3333333333333333ULL);
+}
+
+/* converts eight ASCII digits, first digit in the lowest byte, using
+   three multiplications instead of eight */
+static unsigned long long _dbd_parse_eight_digits(unsigned long long v) {
+  const unsigned long long mask = 0x000000ff000000ffULL;
+  const unsigned long long mul1 = 100 + (1000000ULL << 32);
+  const unsigned long long mul2 = 1 + (10000ULL << 32);
+
+  v -= 0x3030303030303030ULL;
+  v = (v * 10) + (v >> 8);
+  return (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+}
+#endif
+
+/* accumulates up to maxdigits decimal digits starting at *cur. Returns
+   the number of digits consumed */
+static size_t _dbd_scan_digits(const char **cur, const char *end, size_t maxdigits, unsigned long long *acc) {
+  const char *p = *cur;
+  unsigned long long v = *acc;
+
+#ifdef DBD_SWAR_DIGITS
+  while (end-p >= 8 && (size_t)(p-*cur)+8 <= maxdigits) {
+    unsigned long long chunk;
+    memcpy(&chunk, p, 8);
+    if (!_dbd_is_eight_digits(chunk)) {
+      break;
+    }
+    v = v * 100000000ULL + _dbd_parse_eight_digits(chunk);
+    p += 8;
+  }
+#endif
+
+  while (p < end && (size_t)(p-*cur) < maxdigits && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+
+  *acc = v;
+  maxdigits = p-*cur;
+  *cur = p;
+  return maxdigits;
+}
+
+/*
+** Convert the decimal integer at the start of "str" (at most len
+** characters) to a long long. Leading whitespace and a sign are
+** accepted as with strtoll(). Values out of range are clamped to
+** LLONG_MIN or LLONG_MAX. Returns the number of characters consumed,
+** or 0 if no digits were found, in which case *value is set to 0.
+*/
+size_t _dbd_parse_longlong(const char *str, size_t len, long long *value) {
+  const char *p = str;
+  const char *end = str+len;
+  const char *digits;
+  unsigned long long acc = 0;
+  unsigned long long limit;
+  size_t numdigits;
+  int negative = 0;
+
+  *value = 0;
+
+  while (p < end && isspace((unsigned char)*p)) p++;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  digits = p;
+  while (p < end && *p == '0') p++;
+
+  /* 19 digits always fit into an unsigned long long */
+  numdigits = _dbd_scan_digits(&p, end, 19, &acc);
+  if (numdigits == 0 && p == digits) {
+    return 0;
+  }
+
+  limit = negative ? (unsigned long long)LLONG_MAX + 1 : (unsigned long long)LLONG_MAX;
+  if (acc > limit || (p < end && *p >= '0' && *p <= '9')) {
+    /* overflow, skip the remaining digits */
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    *value = negative ? LLONG_MIN : LLONG_MAX;
+  }
+  else {
+    *value = negative ? (long long)(0 - acc) : (long long)acc;
+  }
+  return p-str;
+}
+
+/* powers of ten which are exactly representable as doubles */
+static const double _dbd_exact_powers_of_ten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* the largest integer which is exactly representable as a double */
+#define DBD_MAX_EXACT_MANTISSA (1ULL << 53)
+
+/*
+** Convert the decimal floating point number at the start of "str"
+** (at most len characters) to a double. The result is correctly
+** rounded: numbers with at most 19 significant digits whose mantissa
+** and power of ten are both exactly representable are converted with
+** a single floating point operation (Clinger's fast path), which
+** covers nearly all values stored by databases. Anything else
+** (including inf, nan and hex notation) is handed to strtod(), with
+** the '.' the database sends swapped for the decimal point of the
+** locale. Returns the number of characters consumed, or 0 if no
+** number was found, in which case *value is set to 0.
+*/
+size_t _dbd_parse_double(const char *str, size_t len, double *value) {
+  const char *p = str;
+  const char *end = str+len;
+  const char *start;
+  unsigned long long mantissa = 0;
+  size_t intdigits = 0;
+  size_t fracdigits = 0;
+  long exponent = 0;
+  int negative = 0;
+  int have_digits = 0;
+  char buffer[64];
+  char *copy;
+  char *endptr;
+  char *dot;
+  const char *point;
+  size_t pointlen;
+  size_t consumed;
+
+  *value = 0.0;
+
+  while (p < end && isspace((unsigned char)*p)) p++;
+  start = p;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  if (end-p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    goto slow_path; /* hex notation */
+  }
+
+  /* leading zeros are not significant */
+  while (p < end && *p == '0') {
+    p++;
+    have_digits = 1;
+  }
+  intdigits = _dbd_scan_digits(&p, end, 19, &mantissa);
+  if (p < end && *p >= '0' && *p <= '9') {
+    goto slow_path; /* too many significant digits */
+  }
+
+  if (p < end && *p == '.') {
+    p++;
+    if (intdigits == 0) {
+      /* zeros right after the point only shift the exponent */
+      while (p < end && *p == '0') {
+	p++;
+	exponent--;
+	have_digits = 1;
+      }
+    }
+    fracdigits = _dbd_scan_digits(&p, end, 19-intdigits, &mantissa);
+    exponent -= fracdigits;
+    if (p < end && *p >= '0' && *p <= '9') {
+      goto slow_path;
+    }
+  }
+
+  if (!have_digits && intdigits == 0 && fracdigits == 0) {
+    goto slow_path; /* inf, nan, or no number at all */
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *exp_start = p;
+    long long exp_value;
+    size_t exp_len;
+
+    p++;
+    exp_len = _dbd_parse_longlong(p, end-p, &exp_value);
+    if (exp_len == 0 || isspace((unsigned char)*p)) {
+      p = exp_start; /* not an exponent, e.g. "1e" */
+    }
+    else if (exp_value > 1000 || exp_value < -1000) {
+      goto slow_path;
+    }
+    else {
+      p += exp_len;
+      exponent += exp_value;
+    }
+  }
+
+  if (mantissa == 0) {
+    if (negative) {
+      /* let strtod() get the sign of zero right, -ffast-math may not */
+      goto slow_path;
+    }
+    *value = 0.0;
+    return p-str;
+  }
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  /* without extended precision intermediates (x87) a single
+     multiplication or division of exact operands is correctly
+     rounded */
+  if (mantissa <= DBD_MAX_EXACT_MANTISSA) {
+    if (exponent < 0 && exponent >= -22) {
+      *value = (double)mantissa / _dbd_exact_powers_of_ten[-exponent];
+      if (negative) *value = -*value;
+      return p-str;
+    }
+    if (exponent >= 0 && exponent <= 22+15) {
+      /* move excess powers of ten into the mantissa while it stays exact */
+      while (exponent > 22 && mantissa <= DBD_MAX_EXACT_MANTISSA/10) {
+	mantissa *= 10;
+	exponent--;
+      }
+      if (exponent <= 22) {
+	*value = (double)mantissa * _dbd_exact_powers_of_ten[exponent];
+	if (negative) *value = -*value;
+	return p-str;
+      }
+    }
+  }
+#endif
+
+ slow_path:
+  /* strtod() wants a null-terminated string with the decimal point of
+     the locale. A character of that point ends the number, SQL does
+     not use it */
+  point = localeconv()->decimal_point;
+  pointlen = (point[0] == '.' && point[1] == '\0') ? 0 : strlen(point);
+  len = end-start;
+  if (pointlen && (dot = memchr(start, point[0], len)) != NULL) {
+    len = dot-start;
+  }
+  copy = (len+pointlen < sizeof(buffer)) ? buffer : malloc(len+pointlen+1);
+  if (!copy) {
+    return 0;
+  }
+  memcpy(copy, start, len);
+  copy[len] = '\0';
+  dot = pointlen ? memchr(copy, '.', len) : NULL;
+  if (dot) {
+    memmove(dot+pointlen, dot+1, len-(dot-copy));
+    memcpy(dot, point, pointlen);
+  }
+  *value = strtod(copy, &endptr);
+  consumed = endptr-copy;
+  if (dot && endptr > dot) {
+    consumed = consumed+1-pointlen; /* count the '.' of the original */
+  }
+  consumed = (endptr == copy) ? 0 : (size_t)(start-str) + consumed;
+  if (copy != buffer) {
+    free(copy);
+  }
+  return consumed;
+}
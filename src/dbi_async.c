@@ -0,0 +1,1035 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (asynchronous queries and pipelines. Queries of drivers without
+ * non-blocking functions are run by the worker threads of the instance,
+ * or right away if there are none)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+#include <dbi/dbd.h>
+
+// cast the opaque parameter to our struct pointer
+#define PENDING ((dbi_pending_t*)Pending)
+
+#define ASYNC_CAPABLE(conn) ((conn)->driver->functions->send_query != NULL)
+
+/* connections without a socket are checked at least this often (ms) */
+#define DBI_WAIT_SLICE 10
+
+#ifndef HAVE_POLL_H
+struct pollfd {
+  int fd;
+  short events;
+  short revents;
+};
+#define POLLIN 1
+#endif
+
+typedef struct dbi_workers_s dbi_workers_t;
+
+#ifdef HAVE_PTHREAD_H
+struct dbi_workers_s {
+  pthread_mutex_t lock; /* also protects the query queues of the connections */
+  pthread_cond_t wakeup; /* work was queued or the pool is stopping */
+  pthread_cond_t done; /* a worker completed a query */
+  pthread_t *threads;
+  unsigned int numthreads;
+  dbi_conn_t *runnable; /* connections with queries to run, in turn */
+  dbi_conn_t *runnable_tail;
+  int stopping;
+};
+
+/* guards the workers of all instances against being replaced while
+   a thread looks them up */
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set in a worker thread to the connection whose query it runs */
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void *_worker_main(void *arg);
+static void _create_worker_key(void);
+static void _join_workers(dbi_workers_t *workers);
+static void _schedule(dbi_workers_t *workers, dbi_conn_t *conn);
+static void _unschedule(dbi_workers_t *workers, dbi_conn_t *conn);
+static void _prefetch_rows(dbi_pending_t *pending, dbi_result_t *result);
+static void _save_error(dbi_pending_t *pending);
+#endif
+
+static void _enqueue_pending(dbi_conn_t *conn, dbi_pending_t *pending);
+static void _dequeue_pending(dbi_conn_t *conn, dbi_pending_t *pending);
+static int _in_flight(dbi_conn_t *conn, dbi_pending_t **oldest);
+static void _collect_result(dbi_pending_t *pending, dbi_result_t *result);
+static int _pipeline_sync(dbi_conn_t *conn);
+static int _advance(dbi_conn_t *conn);
+static int _wait_sockets(struct pollfd *fds, unsigned int numfds, int timeout);
+static int _submit(dbi_conn_t *conn, const char *statement, dbi_query_callback callback, void *user_argument, dbi_pending_t **pending_dest);
+static void _report_query(dbi_pending_t *pending, dbi_result_t *result);
+static void _report_error(dbi_pending_t *pending);
+static dbi_workers_t *_acquire_workers(dbi_inst_t *inst, int count);
+static void _lock(dbi_workers_t *workers);
+static void _unlock(dbi_workers_t *workers);
+static void _wait_done(dbi_workers_t *workers);
+static void _free_pending(dbi_pending_t *pending);
+
+dbi_pending dbi_conn_query_async(dbi_conn Conn, const char *statement) {
+  dbi_pending_t *pending;
+
+  if (!Conn) return NULL;
+
+  if (_submit(Conn, statement, NULL, NULL, &pending) < 0) {
+    return NULL;
+  }
+  return (dbi_pending)pending;
+}
+
+int dbi_conn_query_callback(dbi_conn Conn, const char *statement, dbi_query_callback callback, void *user_argument) {
+  dbi_pending_t *pending;
+
+  if (!Conn) return -1;
+
+  if (!callback) {
+    _reset_conn_error(Conn);
+    _error_handler(Conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+  return _submit(Conn, statement, callback, user_argument, &pending);
+}
+
+int dbi_conn_poll_result(dbi_pending Pending) {
+  dbi_conn_t *conn;
+  dbi_pending_state state;
+
+  if (!PENDING) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  conn = PENDING->conn;
+  _reset_conn_error(conn);
+
+  if (PENDING->workers) {
+    _lock(PENDING->workers);
+    state = PENDING->state;
+    _unlock(PENDING->workers);
+  }
+  else {
+    /* read whatever arrived without blocking */
+    if (PENDING->state == DBI_PENDING_SENT
+	&& (_pipeline_sync(conn) < 0 || _advance(conn) < 0)) {
+      return -1;
+    }
+    state = PENDING->state;
+  }
+
+  /* a failed query is reported the same way however it was run */
+  if (state == DBI_PENDING_FAILED) {
+    _report_error(PENDING);
+    return -1;
+  }
+  return (state == DBI_PENDING_DONE);
+}
+
+dbi_result dbi_conn_get_async_result(dbi_pending Pending) {
+  dbi_conn_t *conn;
+  dbi_pending_t *oldest;
+  dbi_workers_t *workers;
+  dbi_result_t *result;
+
+  if (!PENDING) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  conn = PENDING->conn;
+  workers = PENDING->workers;
+  _reset_conn_error(conn);
+
+  if (workers) {
+    _lock(workers);
+    while (PENDING->state == DBI_PENDING_SENT) {
+      _wait_done(workers);
+    }
+    _dequeue_pending(conn, PENDING);
+    conn->pending_done--;
+    _unlock(workers);
+
+    /* the worker left the result to this thread */
+    result = PENDING->result;
+    if (result && !_dbd_result_add_to_conn(result)) {
+      dbi_result_free((dbi_result)result);
+      _free_pending(PENDING);
+      _error_handler(conn, DBI_ERROR_NOMEM);
+      return NULL;
+    }
+    _report_query(PENDING, result);
+  }
+  else {
+    /* results arrive in the order the queries were sent */
+    _pipeline_sync(conn);
+    while (PENDING->state == DBI_PENDING_SENT && _in_flight(conn, &oldest)) {
+      _collect_result(oldest, conn->driver->functions->get_result(conn));
+    }
+    _dequeue_pending(conn, PENDING);
+    conn->pending_done--;
+    result = PENDING->result;
+  }
+
+  if (PENDING->state == DBI_PENDING_FAILED) {
+    _report_error(PENDING);
+  }
+  _free_pending(PENDING);
+  return (dbi_result)result;
+}
+
+int dbi_conn_pipeline_begin(dbi_conn Conn) {
+  dbi_conn_t *conn = Conn;
+  dbi_pending_t *oldest;
+
+  if (!conn) return -1;
+
+  _reset_conn_error(conn);
+
+  if (conn->pipelining
+      || !conn->driver->functions->pipeline_begin
+      || !_conn_has_cap(conn, DBI_CAP_PIPELINING)) {
+    /* without driver support the queries run one after the other */
+    return 0;
+  }
+
+  /* the connection cannot switch modes while a query is in flight */
+  while (_in_flight(conn, &oldest)) {
+    _collect_result(oldest, conn->driver->functions->get_result(conn));
+  }
+
+  if (conn->driver->functions->pipeline_begin(conn) < 0) {
+    _error_handler(conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  conn->pipelining = 1;
+  conn->pipeline_unsynced = 0;
+  return 0;
+}
+
+int dbi_conn_pipeline_end(dbi_conn Conn) {
+  dbi_conn_t *conn = Conn;
+  dbi_pending_t *oldest;
+  int retval = 0;
+
+  if (!conn) return -1;
+
+  _reset_conn_error(conn);
+
+  if (!conn->pipelining) {
+    return 0;
+  }
+
+  /* the results are kept until the application collects them */
+  if (_pipeline_sync(conn) < 0) {
+    retval = -1;
+  }
+  while (_in_flight(conn, &oldest)) {
+    _collect_result(oldest, conn->driver->functions->get_result(conn));
+  }
+
+  conn->pipelining = 0;
+  if (conn->driver->functions->pipeline_end(conn) < 0) {
+    _error_handler(conn, DBI_ERROR_DBD);
+    retval = -1;
+  }
+  return retval;
+}
+
+int dbi_conn_wait_any(dbi_conn *Conns, unsigned int numconns, int timeout, int *ready) {
+  dbi_conn_t *conn;
+  dbi_pending_t *oldest;
+  dbi_workers_t *workers;
+  struct pollfd *fds;
+  unsigned int *fdconns;
+  unsigned int numfds;
+  unsigned int idx;
+  int numready;
+  int waiting;
+  int socketless;
+  int wait;
+  int fd;
+  long long deadline = 0;
+
+  if (!Conns || !ready) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  fds = malloc(numconns*sizeof(struct pollfd));
+  fdconns = malloc(numconns*sizeof(unsigned int));
+  if (numconns && (!fds || !fdconns)) {
+    free(fds);
+    free(fdconns);
+    _error_handler(NULL, DBI_ERROR_NOMEM);
+    return -1;
+  }
+
+  if (timeout >= 0) {
+    deadline = _now_ms()+timeout;
+  }
+
+  for (;;) {
+    numready = waiting = socketless = 0;
+    numfds = 0;
+
+    for (idx = 0; idx < numconns; idx++) {
+      ready[idx] = 0;
+      conn = Conns[idx];
+      if (!conn) {
+	continue;
+      }
+      workers = ASYNC_CAPABLE(conn) ? NULL : _acquire_workers(conn->driver->dbi_inst, 0);
+      if (!conn->pending_done && workers) {
+	/* the workers do not tell, look again soon */
+	socketless = 1;
+      }
+      else if (!conn->pending_done && ASYNC_CAPABLE(conn) && _in_flight(conn, &oldest)) {
+	_pipeline_sync(conn);
+	fd = conn->driver->functions->get_socket(conn);
+	if (fd > 0) {
+	  fds[numfds].fd = fd;
+	  fds[numfds].events = POLLIN;
+	  fds[numfds].revents = 0;
+	  fdconns[numfds++] = idx;
+	}
+	else {
+	  /* nothing to wait on, just look whether it is done */
+	  _advance(conn);
+	  socketless = 1;
+	}
+      }
+
+      /* queries of drivers without non-blocking functions only set
+	 this counter when they complete */
+      if (conn->pending_done) {
+	ready[idx] = 1;
+	numready++;
+      }
+      else if (_in_flight(conn, &oldest)) {
+	waiting++;
+      }
+      _unlock(workers);
+    }
+
+    if (numready || !waiting) {
+      break;
+    }
+
+    wait = -1;
+    if (timeout >= 0) {
+      wait = (int)(deadline-_now_ms());
+      if (wait <= 0) {
+	break;
+      }
+    }
+    if (socketless && (wait < 0 || wait > DBI_WAIT_SLICE)) {
+      wait = DBI_WAIT_SLICE;
+    }
+
+    if (_wait_sockets(fds, numfds, wait) < 0) {
+      free(fds);
+      free(fdconns);
+      _error_handler(NULL, DBI_ERROR_CLIENT);
+      return -1;
+    }
+    for (idx = 0; idx < numfds; idx++) {
+      if (fds[idx].revents) {
+	_advance(Conns[fdconns[idx]]);
+      }
+    }
+  }
+
+  free(fds);
+  free(fdconns);
+  return numready;
+}
+
+/* PRIVATE */
+
+static void _enqueue_pending(dbi_conn_t *conn, dbi_pending_t *pending) {
+  pending->next = NULL;
+  if (conn->pending_tail) {
+    conn->pending_tail->next = pending;
+  }
+  else {
+    conn->pending = pending;
+  }
+  conn->pending_tail = pending;
+}
+
+static void _dequeue_pending(dbi_conn_t *conn, dbi_pending_t *pending) {
+  dbi_pending_t *prev = NULL;
+  dbi_pending_t *cur = conn->pending;
+
+  while (cur && cur != pending) {
+    prev = cur;
+    cur = cur->next;
+  }
+  if (!cur) {
+    return;
+  }
+  if (prev) {
+    prev->next = cur->next;
+  }
+  else {
+    conn->pending = cur->next;
+  }
+  if (conn->pending_tail == cur) {
+    conn->pending_tail = prev;
+  }
+}
+
+/* finds the oldest query which still waits for its result */
+static int _in_flight(dbi_conn_t *conn, dbi_pending_t **oldest) {
+  dbi_pending_t *cur;
+
+  for (cur = conn->pending; cur; cur = cur->next) {
+    if (cur->state == DBI_PENDING_SENT) {
+      *oldest = cur;
+      return 1;
+    }
+  }
+  *oldest = NULL;
+  return 0;
+}
+
+/* stores the result of a query. Queries submitted with a callback are
+   removed from the queue and handed to it */
+static void _collect_result(dbi_pending_t *pending, dbi_result_t *result) {
+  dbi_conn_t *conn;
+  dbi_workers_t *workers;
+  dbi_query_callback callback;
+  void *user_argument;
+
+  if (!pending) {
+    return;
+  }
+  conn = pending->conn;
+  workers = pending->workers;
+  pending->result = result;
+  pending->state = result ? DBI_PENDING_DONE : DBI_PENDING_FAILED;
+  conn->pending_done++;
+
+  if (!workers) {
+    /* this is the thread using the connection */
+    _report_query(pending, result);
+  }
+  if (!pending->callback) {
+    return;
+  }
+  callback = pending->callback;
+  user_argument = pending->user_argument;
+  _dequeue_pending(conn, pending);
+  conn->pending_done--;
+
+  /* the callback may submit further queries */
+  _unlock(workers);
+  if (workers) {
+    /* the callback runs in this worker thread, the result is reported
+       and registered with the connection here */
+    _report_query(pending, result);
+    if (result && !_dbd_result_add_to_conn(result)) {
+      dbi_result_free((dbi_result)result);
+      result = NULL;
+      _error_handler(conn, DBI_ERROR_NOMEM);
+    }
+    else if (!result) {
+      _report_error(pending);
+    }
+  }
+  else if (!result) {
+    _report_error(pending);
+  }
+  /* the error is kept by the connection for the callback */
+  _free_pending(pending);
+  callback((dbi_conn)conn, (dbi_result)result, user_argument);
+  _lock(workers);
+}
+
+/* asks the driver to send the queued queries and to deliver their
+   results. If this fails, no results will arrive */
+static int _pipeline_sync(dbi_conn_t *conn) {
+  dbi_pending_t *oldest;
+
+  if (!conn->pipeline_unsynced) {
+    return 0;
+  }
+  conn->pipeline_unsynced = 0;
+  if (conn->driver->functions->pipeline_sync(conn) < 0) {
+    while (_in_flight(conn, &oldest)) {
+      _collect_result(oldest, NULL);
+    }
+    _error_handler(conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  return 0;
+}
+
+/* reads the data which has arrived and collects the results of all
+   queries which are done, without blocking */
+static int _advance(dbi_conn_t *conn) {
+  dbi_pending_t *oldest;
+
+  if (conn->driver->functions->consume_input(conn) < 0) {
+    if (_in_flight(conn, &oldest)) {
+      _collect_result(oldest, NULL);
+    }
+    _error_handler(conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  while (_in_flight(conn, &oldest) && !conn->driver->functions->is_busy(conn)) {
+    _collect_result(oldest, conn->driver->functions->get_result(conn));
+  }
+  return 0;
+}
+
+/* waits until one of the sockets is readable or the timeout (ms)
+   expires. Interrupted waits count as expired */
+static int _wait_sockets(struct pollfd *fds, unsigned int numfds, int timeout) {
+#ifdef HAVE_POLL_H
+  if (poll(fds, numfds, timeout) < 0 && errno != EINTR) {
+    return -1;
+  }
+  return 0;
+#else
+  unsigned int idx;
+
+  /* without poll() all sockets are checked after a short sleep */
+#ifdef _WIN32
+  Sleep((timeout < 0 || timeout > DBI_WAIT_SLICE) ? DBI_WAIT_SLICE : timeout);
+#endif
+  for (idx = 0; idx < numfds; idx++) {
+    fds[idx].revents = POLLIN;
+  }
+  return 0;
+#endif
+}
+
+/* milliseconds of the clock of _now_us(), which is not set back, for
+   timeouts */
+long long _now_ms(void) {
+  return _now_us()/1000;
+}
+
+/* called when the connection is closed */
+void _free_pending_queries(dbi_conn_t *conn) {
+  dbi_workers_t *workers;
+  dbi_pending_t *cur;
+  dbi_pending_t *next;
+
+  workers = ASYNC_CAPABLE(conn) ? NULL : _acquire_workers(conn->driver->dbi_inst, 0);
+#ifdef HAVE_PTHREAD_H
+  if (workers) {
+    /* the query a worker runs is finished, the others are dropped */
+    while (conn->worker_pending) {
+      _wait_done(workers);
+    }
+    _unschedule(workers, conn);
+  }
+#endif
+  cur = conn->pending;
+  conn->pending = conn->pending_tail = NULL;
+  conn->pending_done = 0;
+  _unlock(workers);
+
+  while (cur) {
+    next = cur->next;
+    if (cur->result) {
+      /* never handed out to the application */
+      dbi_result_free((dbi_result)cur->result);
+    }
+    _free_pending(cur);
+    cur = next;
+  }
+}
+
+int _start_workers(dbi_inst_t *inst, unsigned int numthreads) {
+#ifdef HAVE_PTHREAD_H
+  dbi_workers_t *workers;
+
+  pthread_once(&worker_key_once, _create_worker_key);
+  workers = calloc(1, sizeof(dbi_workers_t));
+  if (!workers) {
+    return -1;
+  }
+  workers->threads = calloc(numthreads, sizeof(pthread_t));
+  if (!workers->threads) {
+    free(workers);
+    return -1;
+  }
+  pthread_mutex_init(&workers->lock, NULL);
+  pthread_cond_init(&workers->wakeup, NULL);
+  pthread_cond_init(&workers->done, NULL);
+
+  for (workers->numthreads = 0; workers->numthreads < numthreads; workers->numthreads++) {
+    if (pthread_create(&workers->threads[workers->numthreads], NULL, _worker_main, workers) != 0) {
+      break;
+    }
+  }
+  if (workers->numthreads < numthreads) {
+    _join_workers(workers);
+    return -1;
+  }
+
+  pthread_mutex_lock(&workers_lock);
+  if (inst->workers || inst->async_queued) {
+    /* another thread started workers or submitted queries meanwhile */
+    pthread_mutex_unlock(&workers_lock);
+    _join_workers(workers);
+    return -1;
+  }
+  inst->workers = workers;
+  pthread_mutex_unlock(&workers_lock);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* fails while queries which the workers may run are outstanding */
+int _stop_workers(dbi_inst_t *inst) {
+#ifdef HAVE_PTHREAD_H
+  dbi_workers_t *workers;
+
+  pthread_mutex_lock(&workers_lock);
+  workers = inst->workers;
+  if (workers && inst->async_queued) {
+    pthread_mutex_unlock(&workers_lock);
+    return -1;
+  }
+  inst->workers = NULL;
+  pthread_mutex_unlock(&workers_lock);
+
+  if (workers) {
+    _join_workers(workers);
+  }
+#endif
+  return 0;
+}
+
+/* 1 if the calling thread is a worker running a query of conn. Its
+   errors and results are left to the thread which gets the result */
+int _worker_runs(dbi_conn_t *conn) {
+#ifdef HAVE_PTHREAD_H
+  pthread_once(&worker_key_once, _create_worker_key);
+  return conn && pthread_getspecific(worker_key) == conn;
+#else
+  return 0;
+#endif
+}
+
+static int _submit(dbi_conn_t *conn, const char *statement, dbi_query_callback callback, void *user_argument, dbi_pending_t **pending_dest) {
+  dbi_pending_t *pending;
+  dbi_pending_t *oldest;
+  dbi_workers_t *workers = NULL;
+
+  _reset_conn_error(conn);
+
+  if (!statement) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  pending = calloc(1, sizeof(dbi_pending_t));
+  if (!pending) {
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return -1;
+  }
+  pending->conn = conn;
+  pending->callback = callback;
+  pending->user_argument = user_argument;
+  pending->length = strlen(statement);
+  *pending_dest = pending;
+
+  if (!ASYNC_CAPABLE(conn) || conn->slow_query_ms >= 0) {
+    /* the caller's string may be gone when a worker or the slow
+       query log gets to it */
+    pending->statement = strdup(statement);
+    if (!pending->statement) {
+      free(pending);
+      _error_handler(conn, DBI_ERROR_NOMEM);
+      return -1;
+    }
+  }
+
+  _logquery(conn, "[async] %s\n", statement);
+  pending->start = _stats_clock(conn);
+  if (conn->trace) _trace_query_start(conn, statement, pending->length);
+
+  if (!ASYNC_CAPABLE(conn)) {
+    workers = _acquire_workers(conn->driver->dbi_inst, 1);
+  }
+#ifdef HAVE_PTHREAD_H
+  if (workers) {
+    pending->workers = workers;
+    pending->state = DBI_PENDING_SENT;
+    _enqueue_pending(conn, pending);
+    if (!conn->worker_active) {
+      _schedule(workers, conn);
+    }
+    _unlock(workers);
+    return 0;
+  }
+#endif
+
+  if (!ASYNC_CAPABLE(conn)) {
+    /* no way to send without waiting for the reply */
+    pending->state = DBI_PENDING_SENT;
+    _enqueue_pending(conn, pending);
+    _collect_result(pending, conn->driver->functions->query(conn, statement));
+    return 0;
+  }
+
+  if (!conn->pipelining) {
+    /* outside of a pipeline a connection has at most one query in
+       flight, finish the previous one first */
+    while (_in_flight(conn, &oldest)) {
+      _collect_result(oldest, conn->driver->functions->get_result(conn));
+    }
+  }
+
+  if (conn->driver->functions->send_query(conn, statement) < 0) {
+    _report_query(pending, NULL);
+    _free_pending(pending);
+    _error_handler(conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  pending->state = DBI_PENDING_SENT;
+  _enqueue_pending(conn, pending);
+  if (conn->pipelining) {
+    conn->pipeline_unsynced = 1;
+  }
+  return 0;
+}
+
+/* counts a completed query in the statistics, the trace and the slow
+   query log of its connection */
+static void _report_query(dbi_pending_t *pending, dbi_result_t *result) {
+  dbi_conn_t *conn = pending->conn;
+  long long start = pending->start;
+  long long fetchstart = -1;
+  unsigned long long rowidx;
+  unsigned long long numrows = 0;
+
+  if (start >= 0 && pending->workers) {
+    /* the time is measured up to now, so leave out how long the
+       result waited to be retrieved */
+    start += _now_us()-pending->finished;
+  }
+  _stats_count_query(conn, pending->length, result, start);
+  if (conn->trace) _trace_query_end(conn, result, start);
+  if (conn->slow_query_ms >= 0 && pending->statement) {
+    _slowlog_query(conn, pending->statement, pending->length, result, start);
+  }
+
+  if (!result || !pending->prefetched) {
+    return;
+  }
+  /* each row a worker fetched ahead takes the average time */
+  if (pending->start >= 0) {
+    fetchstart = _now_us()-pending->prefetch_us/(long long)pending->prefetched;
+  }
+  for (rowidx = 1; rowidx <= result->numrows_matched && numrows < pending->prefetched; rowidx++) {
+    if (result->rows[rowidx]) {
+      _stats_count_row(result, rowidx, fetchstart);
+      numrows++;
+    }
+  }
+  if (conn->trace) {
+    _trace_fetch(result, pending->prefetched, (pending->start >= 0) ? _now_us()-pending->prefetch_us : -1);
+  }
+}
+
+/* sets the error of a failed query on its connection */
+static void _report_error(dbi_pending_t *pending) {
+  dbi_conn_t *conn = pending->conn;
+
+  if (!pending->workers) {
+    _error_handler(conn, DBI_ERROR_DBD);
+    return;
+  }
+
+  /* the driver may run the next query meanwhile, so the worker saved
+     the error when this one failed */
+  if (conn->error_message) free(conn->error_message);
+  conn->error_flag = DBI_ERROR_DBD;
+  conn->error_number = pending->error_number;
+  conn->error_message = pending->error_message;
+  pending->error_message = NULL; /* owned by the connection now */
+  if (conn->error_handler != NULL) {
+    conn->error_handler((dbi_conn)conn, conn->error_handler_argument);
+  }
+}
+
+/* returns the workers of the instance locked, or NULL if there are
+   none. Queries counted here keep the workers from being replaced
+   until they are freed */
+static dbi_workers_t *_acquire_workers(dbi_inst_t *inst, int count) {
+#ifdef HAVE_PTHREAD_H
+  dbi_workers_t *workers;
+
+  pthread_mutex_lock(&workers_lock);
+  if (count) {
+    inst->async_queued++;
+  }
+  workers = inst->workers;
+  if (workers) {
+    pthread_mutex_lock(&workers->lock);
+  }
+  pthread_mutex_unlock(&workers_lock);
+  return workers;
+#else
+  return NULL;
+#endif
+}
+
+/* the queues of connections served by workers are shared with them */
+static void _lock(dbi_workers_t *workers) {
+#ifdef HAVE_PTHREAD_H
+  if (workers) {
+    pthread_mutex_lock(&workers->lock);
+  }
+#endif
+}
+
+static void _unlock(dbi_workers_t *workers) {
+#ifdef HAVE_PTHREAD_H
+  if (workers) {
+    pthread_mutex_unlock(&workers->lock);
+  }
+#endif
+}
+
+/* waits until a worker completes a query. The lock must be held */
+static void _wait_done(dbi_workers_t *workers) {
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_wait(&workers->done, &workers->lock);
+#endif
+}
+
+/* must not be called with the lock of the workers held */
+static void _free_pending(dbi_pending_t *pending) {
+#ifdef HAVE_PTHREAD_H
+  if (!ASYNC_CAPABLE(pending->conn)) {
+    /* counted by _acquire_workers() */
+    pthread_mutex_lock(&workers_lock);
+    pending->conn->driver->dbi_inst->async_queued--;
+    pthread_mutex_unlock(&workers_lock);
+  }
+#endif
+  free(pending->statement);
+  free(pending->error_message);
+  free(pending);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *_worker_main(void *arg) {
+  dbi_workers_t *workers = arg;
+  dbi_conn_t *conn;
+  dbi_pending_t *pending;
+  dbi_result_t *result;
+
+  pthread_mutex_lock(&workers->lock);
+  for (;;) {
+    conn = workers->runnable;
+    if (!conn) {
+      if (workers->stopping) {
+	break;
+      }
+      pthread_cond_wait(&workers->wakeup, &workers->lock);
+      continue;
+    }
+    workers->runnable = conn->next_runnable;
+    if (!workers->runnable) {
+      workers->runnable_tail = NULL;
+    }
+    conn->next_runnable = NULL;
+
+    if (!_in_flight(conn, &pending)) {
+      conn->worker_active = 0;
+      continue;
+    }
+
+    /* a connection is never used by two threads at a time, as it is
+       only scheduled once */
+    conn->worker_pending = pending;
+    pthread_mutex_unlock(&workers->lock);
+
+    pthread_setspecific(worker_key, conn);
+    result = conn->driver->functions->query(conn, pending->statement);
+    if (result) {
+      _prefetch_rows(pending, result);
+    }
+    else {
+      _save_error(pending);
+    }
+    pthread_setspecific(worker_key, NULL);
+    if (pending->start >= 0) {
+      pending->finished = _now_us();
+    }
+
+    pthread_mutex_lock(&workers->lock);
+    _collect_result(pending, result);
+    conn->worker_pending = NULL;
+    pthread_cond_broadcast(&workers->done);
+
+    /* one query per turn, so that a busy connection cannot starve
+       the others */
+    if (_in_flight(conn, &pending)) {
+      _schedule(workers, conn);
+    }
+    else {
+      conn->worker_active = 0;
+    }
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+static void _create_worker_key(void) {
+  pthread_key_create(&worker_key, NULL);
+}
+
+/* waits until the threads ran out of work */
+static void _join_workers(dbi_workers_t *workers) {
+  unsigned int idx;
+
+  pthread_mutex_lock(&workers->lock);
+  workers->stopping = 1;
+  pthread_cond_broadcast(&workers->wakeup);
+  pthread_mutex_unlock(&workers->lock);
+
+  for (idx = 0; idx < workers->numthreads; idx++) {
+    pthread_join(workers->threads[idx], NULL);
+  }
+
+  pthread_mutex_destroy(&workers->lock);
+  pthread_cond_destroy(&workers->wakeup);
+  pthread_cond_destroy(&workers->done);
+  free(workers->threads);
+  free(workers);
+}
+
+static void _schedule(dbi_workers_t *workers, dbi_conn_t *conn) {
+  conn->worker_active = 1;
+  conn->next_runnable = NULL;
+  if (workers->runnable_tail) {
+    workers->runnable_tail->next_runnable = conn;
+  }
+  else {
+    workers->runnable = conn;
+  }
+  workers->runnable_tail = conn;
+  pthread_cond_signal(&workers->wakeup);
+}
+
+static void _unschedule(dbi_workers_t *workers, dbi_conn_t *conn) {
+  dbi_conn_t *prev = NULL;
+  dbi_conn_t *cur = workers->runnable;
+
+  while (cur && cur != conn) {
+    prev = cur;
+    cur = cur->next_runnable;
+  }
+  if (cur) {
+    if (prev) {
+      prev->next_runnable = cur->next_runnable;
+    }
+    else {
+      workers->runnable = cur->next_runnable;
+    }
+    if (workers->runnable_tail == cur) {
+      workers->runnable_tail = prev;
+    }
+    cur->next_runnable = NULL;
+  }
+  conn->worker_active = 0;
+}
+
+/* fetches all rows, so that the application does not block on them.
+   They are counted by _report_query() */
+static void _prefetch_rows(dbi_pending_t *pending, dbi_result_t *result) {
+  unsigned long long rowidx;
+  unsigned long long numrows = 0;
+  long long start;
+
+  if (result->result_state == NOTHING_RETURNED || !result->rows) {
+    return;
+  }
+  start = (pending->start >= 0) ? _now_us() : -1;
+  for (rowidx = 0; rowidx < result->numrows_matched; rowidx++) {
+    /* rows are stored one-based */
+    if (result->rows[rowidx+1]) {
+      continue;
+    }
+    if (result->conn->driver->functions->goto_row(result, rowidx) == -1
+	|| result->conn->driver->functions->fetch_row(result, rowidx) == 0) {
+      break;
+    }
+    numrows++;
+  }
+  pending->prefetched = numrows;
+  if (start >= 0) {
+    pending->prefetch_us = _now_us()-start;
+  }
+}
+
+/* the error handlers ignore the worker, see _worker_runs() */
+static void _save_error(dbi_pending_t *pending) {
+  dbi_conn_t *conn = pending->conn;
+
+  if (conn->driver->functions->geterror(conn, &pending->error_number, &pending->error_message) == -1) {
+    pending->error_number = 0;
+    free(pending->error_message);
+    pending->error_message = NULL;
+  }
+}
+#endif
@@ -0,0 +1,580 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (multi-row inserts, either as INSERT ... VALUES (...),(...) statements
+ * or through the bulk insert function of a driver)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+// cast the opaque parameter to our struct pointer
+#define BATCH ((dbi_batch_t*)Batch)
+
+/* default limits, most servers accept statements of at least 1 MB */
+#define DBI_BATCH_MAXBYTES (1024*1024)
+#define DBI_BATCH_MAXROWS 1000
+
+static dbi_param_t *_next_value(dbi_batch_t *batch, dbi_param_t *scratch);
+static int _append_value(dbi_batch_t *batch, dbi_param_t *param);
+static int _append_copy(dbi_batch_t *batch, unsigned short type, const void *value, size_t length);
+static int _append_text(dbi_batch_t *batch, const char *text, size_t length);
+static dbi_result_t *_send_rows(dbi_batch_t *batch, size_t length);
+static void _free_batch_values(dbi_batch_t *batch);
+static size_t _native_bytes(const dbi_param_t *param);
+static void _unlink_batch(dbi_batch_t *batch);
+
+dbi_batch dbi_conn_batch_new(dbi_conn Conn, const char *table, const char **columns, unsigned int numcolumns) {
+  dbi_conn_t *conn = Conn;
+  dbi_batch_t *batch;
+  unsigned int idx;
+
+  if (!conn) return NULL;
+
+  _reset_conn_error(conn);
+
+  if (!table || !columns || numcolumns == 0) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  batch = calloc(1, sizeof(dbi_batch_t));
+  if (!batch) {
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+  batch->conn = conn;
+  /* so that closing the connection can detach the batch */
+  batch->next = conn->batches;
+  if (conn->batches) {
+    conn->batches->prev = batch;
+  }
+  conn->batches = batch;
+  batch->numcolumns = numcolumns;
+  batch->maxbytes = DBI_BATCH_MAXBYTES;
+  batch->maxrows = DBI_BATCH_MAXROWS;
+  batch->native = (conn->driver->functions->insert_batch != NULL
+		   && _conn_has_cap(conn, DBI_CAP_BULK_INSERT));
+
+  batch->table = strdup(table);
+  batch->columns = calloc(numcolumns, sizeof(char *));
+  if (!batch->table || !batch->columns) {
+    goto nomem;
+  }
+  for (idx = 0; idx < numcolumns; idx++) {
+    if (!columns[idx]) {
+      dbi_batch_free((dbi_batch)batch);
+      _error_handler(conn, DBI_ERROR_BADPTR);
+      return NULL;
+    }
+    if ((batch->columns[idx] = strdup(columns[idx])) == NULL) {
+      goto nomem;
+    }
+  }
+
+  if (!batch->native) {
+    /* all statements share the same header */
+    if (_append_text(batch, "INSERT INTO ", 12) < 0
+	|| _append_text(batch, table, strlen(table)) < 0
+	|| _append_text(batch, " (", 2) < 0) {
+      goto nomem;
+    }
+    for (idx = 0; idx < numcolumns; idx++) {
+      if ((idx && _append_text(batch, ",", 1) < 0)
+	  || _append_text(batch, columns[idx], strlen(columns[idx])) < 0) {
+	goto nomem;
+      }
+    }
+    if (_append_text(batch, ") VALUES ", 9) < 0) {
+      goto nomem;
+    }
+    batch->headerlen = batch->rowstart = batch->used;
+  }
+
+  return (dbi_batch)batch;
+
+ nomem:
+  dbi_batch_free((dbi_batch)batch);
+  _error_handler(conn, DBI_ERROR_NOMEM);
+  return NULL;
+}
+
+int dbi_batch_set_limits(dbi_batch Batch, size_t maxbytes, unsigned int maxrows) {
+  if (!BATCH) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  _reset_conn_error(BATCH->conn);
+
+  if (maxbytes) {
+    BATCH->maxbytes = maxbytes;
+  }
+  if (maxrows) {
+    BATCH->maxrows = maxrows;
+  }
+  return 0;
+}
+
+/* BATCH: append_* functions. Values are appended to the current row
+   in the order of the columns passed to dbi_conn_batch_new() */
+
+int dbi_batch_append_int(dbi_batch Batch, int value) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(BATCH, &scratch);
+
+  if (!param) return -1;
+
+  param->type = DBI_TYPE_INTEGER;
+  param->attribs = DBI_INTEGER_SIZE4;
+  param->value.d_long = value;
+  return _append_value(BATCH, param);
+}
+
+int dbi_batch_append_longlong(dbi_batch Batch, long long value) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(BATCH, &scratch);
+
+  if (!param) return -1;
+
+  param->type = DBI_TYPE_INTEGER;
+  param->attribs = DBI_INTEGER_SIZE8;
+  param->value.d_longlong = value;
+  return _append_value(BATCH, param);
+}
+
+int dbi_batch_append_double(dbi_batch Batch, double value) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(BATCH, &scratch);
+
+  if (!param) return -1;
+
+  param->type = DBI_TYPE_DECIMAL;
+  param->attribs = DBI_DECIMAL_SIZE8;
+  param->value.d_double = value;
+  return _append_value(BATCH, param);
+}
+
+int dbi_batch_append_string(dbi_batch Batch, const char *value) {
+  if (!value) {
+    return dbi_batch_append_null(Batch);
+  }
+  return _append_copy(BATCH, DBI_TYPE_STRING, value, strlen(value));
+}
+
+int dbi_batch_append_binary(dbi_batch Batch, const unsigned char *value, size_t length) {
+  if (!value) {
+    return dbi_batch_append_null(Batch);
+  }
+  return _append_copy(BATCH, DBI_TYPE_BINARY, value, length);
+}
+
+int dbi_batch_append_datetime(dbi_batch Batch, time_t value) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(BATCH, &scratch);
+
+  if (!param) return -1;
+
+  param->type = DBI_TYPE_DATETIME;
+  param->attribs = DBI_DATETIME_DATE|DBI_DATETIME_TIME;
+  param->value.d_datetime = value;
+  return _append_value(BATCH, param);
+}
+
+int dbi_batch_append_null(dbi_batch Batch) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(BATCH, &scratch);
+
+  if (!param) return -1;
+
+  param->type = DBI_TYPE_STRING;
+  param->flags = DBI_VALUE_NULL;
+  return _append_value(BATCH, param);
+}
+
+int dbi_batch_end_row(dbi_batch Batch) {
+  dbi_batch_t *batch = BATCH;
+  dbi_result_t *result = NULL;
+  size_t rowstart;
+  size_t rowlength;
+
+  if (!batch) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  if (!batch->conn) {
+    /* the connection was closed */
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return -1;
+  }
+  _reset_conn_error(batch->conn);
+
+  if (batch->curcolumn != batch->numcolumns) {
+    /* not enough values for this row. It is dropped, so that the
+       next value starts a new one */
+    _drop_batch_row(batch);
+    _error_handler(batch->conn, DBI_ERROR_BADIDX);
+    return -1;
+  }
+
+  if (!batch->native && _append_text(batch, ")", 1) < 0) {
+    _error_handler(batch->conn, DBI_ERROR_NOMEM);
+    return -1;
+  }
+  batch->numrows++;
+  batch->curcolumn = 0;
+
+  if (batch->native) {
+    if (batch->numrows < batch->maxrows && batch->native_bytes < batch->maxbytes) {
+      return 0;
+    }
+    result = _send_rows(batch, 0);
+  }
+  else if (batch->used > batch->maxbytes && batch->numrows > 1) {
+    /* the new row does not fit, send the rows before it and make it
+       the first row of the next statement */
+    rowstart = batch->rowstart;
+    rowlength = batch->used-rowstart-1; /* without the comma */
+    result = _send_rows(batch, rowstart);
+    memmove(batch->buffer+batch->headerlen, batch->buffer+rowstart+1, rowlength);
+    batch->used = batch->headerlen+rowlength;
+    batch->numrows = 1;
+  }
+  else if (batch->numrows >= batch->maxrows || batch->used >= batch->maxbytes) {
+    result = _send_rows(batch, batch->used);
+  }
+  else {
+    return 0;
+  }
+
+  if (!result) {
+    return -1;
+  }
+  dbi_result_free((dbi_result)result);
+  return 0;
+}
+
+unsigned int dbi_batch_get_numrows_pending(dbi_batch Batch) {
+  if (!BATCH) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return 0;
+  }
+
+  return BATCH->numrows;
+}
+
+unsigned long long dbi_batch_get_numrows_affected(dbi_batch Batch) {
+  if (!BATCH) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return DBI_ROW_ERROR;
+  }
+
+  return BATCH->numrows_affected;
+}
+
+dbi_result dbi_batch_flush(dbi_batch Batch) {
+  dbi_batch_t *batch = BATCH;
+
+  if (!batch) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  if (!batch->conn) {
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return NULL;
+  }
+  _reset_conn_error(batch->conn);
+
+  if (batch->curcolumn) {
+    /* the current row is incomplete */
+    _error_handler(batch->conn, DBI_ERROR_BADIDX);
+    return NULL;
+  }
+
+  if (!batch->numrows) {
+    return NULL; /* nothing to do, not an error */
+  }
+
+  return (dbi_result)_send_rows(batch, batch->native ? 0 : batch->used);
+}
+
+int dbi_batch_free(dbi_batch Batch) {
+  unsigned int idx;
+
+  if (!BATCH) return -1;
+
+  if (BATCH->numrows || BATCH->curcolumn) {
+    _verbose_handler(BATCH->conn, "dbi_batch_free: %u rows into %s were not flushed\n",
+		     BATCH->numrows, BATCH->table);
+  }
+
+  if (BATCH->conn) {
+    _unlink_batch(BATCH);
+  }
+  _free_batch_values(BATCH);
+  for (idx = 0; BATCH->columns && idx < BATCH->numcolumns; idx++) {
+    free(BATCH->columns[idx]);
+  }
+  free(BATCH->columns);
+  free(BATCH->table);
+  free(BATCH->buffer);
+  free(BATCH);
+  return 0;
+}
+
+/* removes the values of the current, incomplete row */
+void _drop_batch_row(dbi_batch_t *batch) {
+  dbi_param_t *row;
+  unsigned int idx;
+
+  if (!batch->curcolumn) {
+    return;
+  }
+  if (batch->native) {
+    row = &batch->values[(size_t)batch->numrows*batch->numcolumns];
+    for (idx = 0; idx < batch->curcolumn; idx++) {
+      batch->native_bytes -= _native_bytes(&row[idx]);
+    }
+  }
+  else {
+    batch->used = batch->rowstart;
+  }
+  batch->curcolumn = 0;
+}
+
+/* detaches the batches of a connection which is being closed. Rows
+   which were not flushed are lost, and the batches fail with
+   DBI_ERROR_BADOBJECT until dbi_batch_free() */
+void _detach_batches(dbi_conn_t *conn) {
+  dbi_batch_t *batch;
+
+  while ((batch = conn->batches) != NULL) {
+    _unlink_batch(batch);
+    batch->conn = NULL;
+  }
+}
+
+/* PRIVATE */
+
+static void _unlink_batch(dbi_batch_t *batch) {
+  if (batch->prev) {
+    batch->prev->next = batch->next;
+  }
+  else {
+    batch->conn->batches = batch->next;
+  }
+  if (batch->next) {
+    batch->next->prev = batch->prev;
+  }
+  batch->prev = batch->next = NULL;
+}
+
+/* returns the slot for the next value of the current row: a slot in
+   the values array if the rows are kept for the driver, otherwise
+   scratch. Returns NULL if the row is complete already */
+static dbi_param_t *_next_value(dbi_batch_t *batch, dbi_param_t *scratch) {
+  dbi_param_t *values;
+  dbi_param_t *param;
+  unsigned int newrows;
+
+  if (!batch) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+  if (!batch->conn) {
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return NULL;
+  }
+
+  _reset_conn_error(batch->conn);
+
+  if (batch->curcolumn >= batch->numcolumns) {
+    /* too many values for this row */
+    _error_handler(batch->conn, DBI_ERROR_BADIDX);
+    return NULL;
+  }
+
+  if (!batch->native) {
+    memset(scratch, 0, sizeof(dbi_param_t));
+    return scratch;
+  }
+
+  if (batch->numrows >= batch->values_rows) {
+    newrows = batch->values_rows ? batch->values_rows*2 : 16;
+    values = realloc(batch->values, (size_t)newrows*batch->numcolumns*sizeof(dbi_param_t));
+    if (!values) {
+      _error_handler(batch->conn, DBI_ERROR_NOMEM);
+      return NULL;
+    }
+    memset(values+((size_t)batch->values_rows*batch->numcolumns), 0,
+	   (size_t)(newrows-batch->values_rows)*batch->numcolumns*sizeof(dbi_param_t));
+    batch->values = values;
+    batch->values_rows = newrows;
+  }
+
+  /* slots are reused after a flush, keep the buffer of the last copy */
+  param = &batch->values[((size_t)batch->numrows*batch->numcolumns)+batch->curcolumn];
+  param->type = 0;
+  param->attribs = 0;
+  param->flags = 0;
+  param->length = 0;
+  return param;
+}
+
+/* adds a value filled in by an append_* function to the current row */
+static int _append_value(dbi_batch_t *batch, dbi_param_t *param) {
+  if (batch->native) {
+    batch->native_bytes += _native_bytes(param);
+    batch->curcolumn++;
+    return 0;
+  }
+
+  if (batch->curcolumn == 0) {
+    batch->rowstart = batch->used;
+    if (_append_text(batch, batch->numrows ? ",(" : "(", batch->numrows ? 2 : 1) < 0) {
+      _error_handler(batch->conn, DBI_ERROR_NOMEM);
+      return -1;
+    }
+  }
+  else if (_append_text(batch, ",", 1) < 0) {
+    _error_handler(batch->conn, DBI_ERROR_NOMEM);
+    return -1;
+  }
+
+  if (_render_param(batch->conn, param, &batch->buffer, &batch->size, &batch->used) < 0) {
+    /* drop the incomplete row */
+    batch->used = batch->rowstart;
+    batch->curcolumn = 0;
+    if (batch->conn->error_flag == DBI_ERROR_NONE) {
+      _error_handler(batch->conn, DBI_ERROR_NOMEM);
+    }
+    return -1;
+  }
+  batch->curcolumn++;
+  return 0;
+}
+
+static int _append_copy(dbi_batch_t *batch, unsigned short type, const void *value, size_t length) {
+  dbi_param_t scratch;
+  dbi_param_t *param = _next_value(batch, &scratch);
+  char *copy;
+
+  if (!param) return -1;
+
+  if (!batch->native) {
+    /* rendered right away, no need for a copy */
+    param->type = type;
+    param->value.d_string = (char *)value;
+    param->length = length;
+    return _append_value(batch, param);
+  }
+
+  if (param->capacity < length+1) {
+    copy = realloc(param->copy, length+1);
+    if (!copy) {
+      _error_handler(batch->conn, DBI_ERROR_NOMEM);
+      return -1;
+    }
+    param->copy = copy;
+    param->capacity = length+1;
+  }
+  memcpy(param->copy, value, length);
+  param->copy[length] = '\0';
+  param->type = type;
+  param->value.d_string = param->copy;
+  param->length = length;
+  return _append_value(batch, param);
+}
+
+static int _append_text(dbi_batch_t *batch, const char *text, size_t length) {
+  if (_buffer_reserve(&batch->buffer, &batch->size, batch->used, length) < 0) {
+    return -1;
+  }
+  memcpy(batch->buffer+batch->used, text, length);
+  batch->used += length;
+  return 0;
+}
+
+/* sends the pending rows. If the rows are rendered, only the first
+   length bytes of the statement are sent and the caller fixes up
+   whatever follows them */
+static dbi_result_t *_send_rows(dbi_batch_t *batch, size_t length) {
+  dbi_conn_t *conn = batch->conn;
+  dbi_result_t *result;
+  char saved;
+
+  if (batch->native) {
+    _logquery(conn, "[batch] %u rows into %s\n", batch->numrows, batch->table);
+    result = conn->driver->functions->insert_batch(conn, batch->table, (const char **)batch->columns, batch->numcolumns, batch->values, batch->numrows);
+    batch->native_bytes = 0;
+  }
+  else {
+    if (_buffer_reserve(&batch->buffer, &batch->size, batch->used, 1) < 0) {
+      _error_handler(conn, DBI_ERROR_NOMEM);
+      return NULL;
+    }
+    saved = batch->buffer[length];
+    batch->buffer[length] = '\0';
+    _logquery(conn, "[batch] %s\n", batch->buffer);
+    result = _conn_query(conn, batch->buffer, length);
+    batch->buffer[length] = saved;
+    batch->used = batch->rowstart = batch->headerlen;
+  }
+
+  /* rows of a failed statement are dropped as well */
+  batch->numrows = 0;
+
+  if (result == NULL) {
+    _error_handler(conn, DBI_ERROR_DBD);
+    return NULL;
+  }
+
+  batch->numrows_affected += result->numrows_affected;
+  return result;
+}
+
+static void _free_batch_values(dbi_batch_t *batch) {
+  size_t idx;
+
+  for (idx = 0; idx < (size_t)batch->values_rows*batch->numcolumns; idx++) {
+    free(batch->values[idx].copy);
+  }
+  free(batch->values);
+  batch->values = NULL;
+  batch->values_rows = 0;
+}
+
+
+/* estimated size of a value kept for the driver */
+static size_t _native_bytes(const dbi_param_t *param) {
+  return (param->type == DBI_TYPE_STRING || param->type == DBI_TYPE_BINARY) ? param->length : 8;
+}
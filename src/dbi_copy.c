@@ -0,0 +1,586 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (streaming bulk loads in COPY text format, either through the native
+ * load path of a driver or through batched inserts)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+// cast the opaque parameter to our struct pointer
+#define COPY ((dbi_copy_t*)Copy)
+
+/* encoded rows are passed to the driver in chunks of about this size */
+#define DBI_COPY_CHUNK (64*1024)
+
+static int _copy_flush(dbi_copy_t *copy);
+static int _copy_append(dbi_copy_t *copy, const char *data, size_t length);
+static int _copy_insert_lines(dbi_copy_t *copy, int final);
+static int _copy_insert_line(dbi_copy_t *copy, char *line, char *end);
+static int _copy_decode_number(char **read, char *end, int base, int maxdigits);
+static void _copy_free(dbi_copy_t *copy);
+static void _unlink_copy(dbi_copy_t *copy);
+
+dbi_copy dbi_conn_copy_begin(dbi_conn Conn, const char *table, const char **columns, unsigned int numcolumns) {
+  dbi_conn_t *conn = Conn;
+  dbi_copy_t *copy;
+  unsigned int idx;
+
+  if (!conn) return NULL;
+
+  _reset_conn_error(conn);
+
+  if (!table || !columns || numcolumns == 0) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+  for (idx = 0; idx < numcolumns; idx++) {
+    if (!columns[idx]) {
+      _error_handler(conn, DBI_ERROR_BADPTR);
+      return NULL;
+    }
+  }
+
+  copy = calloc(1, sizeof(dbi_copy_t));
+  if (!copy) {
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+  copy->conn = conn;
+  /* so that closing the connection can finish the load */
+  copy->next = conn->copies;
+  if (conn->copies) {
+    conn->copies->prev = copy;
+  }
+  conn->copies = copy;
+  copy->numcolumns = numcolumns;
+  copy->table = strdup(table);
+  copy->columns = calloc(numcolumns, sizeof(char *));
+  if (!copy->table || !copy->columns) {
+    _copy_free(copy);
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+  for (idx = 0; idx < numcolumns; idx++) {
+    if ((copy->columns[idx] = strdup(columns[idx])) == NULL) {
+      _copy_free(copy);
+      _error_handler(conn, DBI_ERROR_NOMEM);
+      return NULL;
+    }
+  }
+
+  if (conn->driver->functions->copy_begin) {
+    _logquery(conn, "[copy] into %s\n", table);
+
+    /* the driver may leave copy_handle at NULL if it cannot load
+       this table natively */
+    if (conn->driver->functions->copy_begin(copy) < 0) {
+      copy->copy_handle = NULL;
+      _copy_free(copy);
+      _error_handler(conn, DBI_ERROR_DBD);
+      return NULL;
+    }
+  }
+
+  if (!copy->copy_handle) {
+    copy->batch = dbi_conn_batch_new(Conn, table, columns, numcolumns);
+    if (!copy->batch) {
+      /* error was set by dbi_conn_batch_new() */
+      _copy_free(copy);
+      return NULL;
+    }
+  }
+
+  return (dbi_copy)copy;
+}
+
+int dbi_copy_put_row(dbi_copy Copy, const char **values) {
+  dbi_copy_t *copy = COPY;
+  const char *value;
+  const char *escape;
+  unsigned int idx;
+
+  if (!copy) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+  if (!copy->conn) {
+    /* the connection was closed */
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return -1;
+  }
+
+  _reset_conn_error(copy->conn);
+
+  if (!values) {
+    _error_handler(copy->conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  if (copy->batch) {
+    for (idx = 0; idx < copy->numcolumns; idx++) {
+      if (dbi_batch_append_string(copy->batch, values[idx]) < 0) {
+	_drop_batch_row(copy->batch);
+	copy->failed = 1;
+	return -1;
+      }
+    }
+    if (dbi_batch_end_row(copy->batch) < 0) {
+      copy->failed = 1;
+      return -1;
+    }
+    copy->numrows++;
+    return 0;
+  }
+
+  /* encode the row in COPY text format */
+  for (idx = 0; idx < copy->numcolumns; idx++) {
+    if (idx && _copy_append(copy, "\t", 1) < 0) {
+      return -1;
+    }
+    value = values[idx];
+    if (!value) {
+      if (_copy_append(copy, "\\N", 2) < 0) {
+	return -1;
+      }
+      continue;
+    }
+    while (*value) {
+      /* copy runs of characters which need no escaping at once */
+      escape = value+strcspn(value, "\\\t\n\r");
+      if (escape > value && _copy_append(copy, value, escape-value) < 0) {
+	return -1;
+      }
+      value = escape;
+      if (!*value) {
+	break;
+      }
+      switch (*value) {
+      case '\\':
+	escape = "\\\\";
+	break;
+      case '\t':
+	escape = "\\t";
+	break;
+      case '\n':
+	escape = "\\n";
+	break;
+      default:
+	escape = "\\r";
+	break;
+      }
+      if (_copy_append(copy, escape, 2) < 0) {
+	return -1;
+      }
+      value++;
+    }
+  }
+  if (_copy_append(copy, "\n", 1) < 0) {
+    return -1;
+  }
+  copy->numrows++;
+
+  if (copy->used >= DBI_COPY_CHUNK) {
+    return _copy_flush(copy);
+  }
+  return 0;
+}
+
+int dbi_copy_put_buffer(dbi_copy Copy, const char *data, size_t length) {
+  dbi_copy_t *copy = COPY;
+
+  if (!copy) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+  if (!copy->conn) {
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return -1;
+  }
+
+  _reset_conn_error(copy->conn);
+
+  if (!data) {
+    _error_handler(copy->conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  if (copy->batch) {
+    /* rows may be split across buffers, keep the incomplete one */
+    if (_copy_append(copy, data, length) < 0) {
+      return -1;
+    }
+    return _copy_insert_lines(copy, 0);
+  }
+
+  /* keep the order of rows put earlier */
+  if (_copy_flush(copy) < 0) {
+    return -1;
+  }
+  if (copy->conn->driver->functions->copy_put(copy, data, length) < 0) {
+    copy->failed = 1;
+    _error_handler(copy->conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  return 0;
+}
+
+unsigned long long dbi_copy_get_numrows_rejected(dbi_copy Copy) {
+  if (!COPY) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return DBI_ROW_ERROR;
+  }
+
+  return COPY->numrows_rejected;
+}
+
+unsigned long long dbi_copy_end(dbi_copy Copy) {
+  dbi_copy_t *copy = COPY;
+  dbi_conn_t *conn;
+  dbi_result result;
+  unsigned long long numrows = DBI_ROW_ERROR;
+
+  if (!copy) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return DBI_ROW_ERROR;
+  }
+
+  conn = copy->conn;
+  if (!conn) {
+    _copy_free(copy);
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return DBI_ROW_ERROR;
+  }
+  _reset_conn_error(conn);
+
+  if (copy->batch) {
+    if (_copy_insert_lines(copy, 1) == 0) {
+      result = dbi_batch_flush(copy->batch);
+      if (result) {
+	dbi_result_free(result);
+      }
+      else if (conn->error_number) {
+	copy->failed = 1;
+      }
+    }
+    if (copy->numrows_rejected) {
+      _verbose_handler(conn, "dbi_copy_end: %llu rows into %s did not fit the columns\n",
+		       copy->numrows_rejected, copy->table);
+    }
+    if (!copy->failed) {
+      numrows = dbi_batch_get_numrows_affected(copy->batch);
+    }
+  }
+  else {
+    /* the driver finishes the load even after an error so that the
+       connection is usable again */
+    _copy_flush(copy);
+    numrows = conn->driver->functions->copy_end(copy);
+    if (numrows == DBI_ROW_ERROR) {
+      _error_handler(conn, DBI_ERROR_DBD);
+    }
+    else if (copy->failed) {
+      numrows = DBI_ROW_ERROR;
+    }
+  }
+
+  _copy_free(copy);
+  return numrows;
+}
+
+/* finishes the loads of a connection which is being closed so that
+   the driver releases its handles. The loads stay valid until
+   dbi_copy_end(), but fail with DBI_ERROR_BADOBJECT */
+void _detach_copies(dbi_conn_t *conn) {
+  dbi_copy_t *copy;
+
+  while ((copy = conn->copies) != NULL) {
+    if (copy->copy_handle) {
+      conn->driver->functions->copy_end(copy);
+      copy->copy_handle = NULL;
+    }
+    _unlink_copy(copy);
+    copy->conn = NULL;
+  }
+}
+
+/* PRIVATE */
+
+static void _unlink_copy(dbi_copy_t *copy) {
+  if (copy->prev) {
+    copy->prev->next = copy->next;
+  }
+  else {
+    copy->conn->copies = copy->next;
+  }
+  if (copy->next) {
+    copy->next->prev = copy->prev;
+  }
+  copy->prev = copy->next = NULL;
+}
+
+/* passes the encoded rows to the driver */
+static int _copy_flush(dbi_copy_t *copy) {
+  if (!copy->used) {
+    return 0;
+  }
+  if (copy->conn->driver->functions->copy_put(copy, copy->buffer, copy->used) < 0) {
+    copy->failed = 1;
+    copy->used = 0;
+    _error_handler(copy->conn, DBI_ERROR_DBD);
+    return -1;
+  }
+  copy->used = 0;
+  return 0;
+}
+
+static int _copy_append(dbi_copy_t *copy, const char *data, size_t length) {
+  if (_buffer_reserve(&copy->buffer, &copy->size, copy->used, length) < 0) {
+    copy->failed = 1;
+    _error_handler(copy->conn, DBI_ERROR_NOMEM);
+    return -1;
+  }
+  memcpy(copy->buffer+copy->used, data, length);
+  copy->used += length;
+  return 0;
+}
+
+/* inserts all complete lines in the buffer. If final is set, a last
+   line without a newline is inserted as well */
+static int _copy_insert_lines(dbi_copy_t *copy, int final) {
+  char *line;
+  char *bufend;
+  char *newline;
+  int retval = 0;
+
+  /* room to terminate a last field which is not followed by a newline */
+  if (_buffer_reserve(&copy->buffer, &copy->size, copy->used, 1) < 0) {
+    copy->failed = 1;
+    _error_handler(copy->conn, DBI_ERROR_NOMEM);
+    return -1;
+  }
+  line = copy->buffer;
+  bufend = copy->buffer+copy->used;
+
+  while (line < bufend) {
+    newline = memchr(line, '\n', bufend-line);
+    if (!newline) {
+      if (!final) {
+	break;
+      }
+      newline = bufend;
+    }
+    if (_copy_insert_line(copy, line, newline) < 0) {
+      retval = -1;
+    }
+    line = newline+1;
+  }
+
+  if (line < bufend) {
+    memmove(copy->buffer, line, bufend-line);
+    copy->used = bufend-line;
+  }
+  else {
+    copy->used = 0;
+  }
+  return retval;
+}
+
+/* decodes a line in COPY text format in place and appends its fields
+   to the batch. A line which does not fit the columns is skipped and
+   counted, the load goes on */
+static int _copy_insert_line(dbi_copy_t *copy, char *line, char *end) {
+  char *read = line;
+  const char *field;
+  unsigned int numfields = 1;
+
+  if (end > line && end[-1] == '\r') {
+    end--;
+  }
+  if (end-line == 2 && line[0] == '\\' && line[1] == '.') {
+    return 0; /* end-of-data marker */
+  }
+
+  /* tabs in values are escaped, so every tab separates two fields */
+  while ((read = memchr(read, '\t', end-read)) != NULL) {
+    numfields++;
+    read++;
+  }
+  if (numfields != copy->numcolumns) {
+    copy->numrows_rejected++;
+    return 0;
+  }
+  read = line;
+
+  for (;;) {
+    field = _copy_decode_field(&read, end);
+    if (dbi_batch_append_string(copy->batch, field) < 0) {
+      _drop_batch_row(copy->batch);
+      copy->failed = 1;
+      return -1;
+    }
+    if (read == end) {
+      break;
+    }
+    read++; /* the tab */
+  }
+
+  if (dbi_batch_end_row(copy->batch) < 0) {
+    copy->failed = 1;
+    return -1;
+  }
+  copy->numrows++;
+  return 0;
+}
+
+/* decodes the field in COPY text format at *read in place and
+   zero-terminates it, possibly over the tab after it. Moves *read to
+   that tab or to end. Returns the field, or NULL for \N */
+const char *_copy_decode_field(char **read, char *end) {
+  char *field = *read;
+  char *write = *read;
+  char *cur = *read;
+  int value;
+
+  /* \N is NULL only as the whole field */
+  if (end-cur >= 2 && cur[0] == '\\' && cur[1] == 'N'
+      && (cur+2 == end || cur[2] == '\t')) {
+    *read = cur+2;
+    **read = '\0';
+    return NULL;
+  }
+
+  while (cur < end && *cur != '\t') {
+    if (*cur == '\\' && cur+1 < end) {
+      cur++;
+      switch (*cur) {
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+	/* the byte with up to three octal digits as its value */
+	*write++ = (char)_copy_decode_number(&cur, end, 8, 3);
+	continue;
+      case 'x':
+	/* the byte with one or two hex digits as its value */
+	cur++;
+	value = _copy_decode_number(&cur, end, 16, 2);
+	if (value < 0) {
+	  *write++ = 'x';
+	}
+	else {
+	  *write++ = (char)value;
+	}
+	continue;
+      case 'b':
+	*write++ = '\b';
+	break;
+      case 'f':
+	*write++ = '\f';
+	break;
+      case 'n':
+	*write++ = '\n';
+	break;
+      case 'r':
+	*write++ = '\r';
+	break;
+      case 't':
+	*write++ = '\t';
+	break;
+      case 'v':
+	*write++ = '\v';
+	break;
+      default:
+	*write++ = *cur; /* backslash and everything else */
+	break;
+      }
+      cur++;
+      continue;
+    }
+    *write++ = *cur++;
+  }
+
+  *read = cur;
+  *write = '\0';
+  return field;
+}
+
+/* decodes up to maxdigits digits at *read and moves *read past them.
+   Returns -1 if there are none */
+static int _copy_decode_number(char **read, char *end, int base, int maxdigits) {
+  int value = 0;
+  int digits;
+  int digit;
+  char c;
+
+  for (digits = 0; digits < maxdigits && *read < end; digits++) {
+    c = **read;
+    if (c >= '0' && c <= '7') {
+      digit = c-'0';
+    }
+    else if (base == 16 && c >= '8' && c <= '9') {
+      digit = c-'0';
+    }
+    else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c-'a'+10;
+    }
+    else if (base == 16 && c >= 'A' && c <= 'F') {
+      digit = c-'A'+10;
+    }
+    else {
+      break;
+    }
+    value = value*base+digit;
+    (*read)++;
+  }
+  return digits ? value : -1;
+}
+
+static void _copy_free(dbi_copy_t *copy) {
+  unsigned int idx;
+
+  if (copy->conn) {
+    _unlink_copy(copy);
+  }
+  if (copy->batch) {
+    dbi_batch_free(copy->batch);
+  }
+  for (idx = 0; copy->columns && idx < copy->numcolumns; idx++) {
+    free(copy->columns[idx]);
+  }
+  free(copy->columns);
+  free(copy->table);
+  free(copy->buffer);
+  free(copy);
+}
@@ -83,22 +83,31 @@ char *win_dlerror();
 
 #include <math.h>
 #include <limits.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include <dbi/dbi.h>
 #include <dbi/dbi-dev.h>
 
 #ifdef __MINGW32__
-#  define DBI_PATH_SEPARATOR "\\"
 #  ifndef DBI_DRIVER_DIR
 #	define DBI_DRIVER_DIR "c:\\libdbi\\lib\\dbd" /* use this as the default */
 #  endif
 #  else
-#    define DBI_PATH_SEPARATOR "/"
 #    ifndef DBI_DRIVER_DIR
 #    	define DBI_DRIVER_DIR "/usr/local/lib/dbd" /* use this as the default */
 #    endif
 #endif
 
+/* the lists of an instance are shared by all threads using it */
+typedef struct dbi_inst_lock_s {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t mutex;
+#endif
+	int unused; /* keeps the struct non-empty without threads */
+} dbi_inst_lock_t;
+
 #ifndef DLSYM_PREFIX
 #define DLSYM_PREFIX ""
 #endif
@@ -116,11 +125,32 @@ int asprintf(char **result, const char *format, ...);
 #endif
 
 /* declarations for internal functions -- anything declared as static won't be accessible by name from client programs */
-static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst);
+static int _initialize(const char *driverdir, dbi_inst *pInst, int lazy);
+static int _scan_driver_dir(dbi_inst_t *inst, const char *driverdir);
+static dbi_driver_t *_get_driver(const char *filename);
+static dbi_driver_t *_get_static_driver(const dbi_functions_t *functions);
+static dbi_functions_t *_get_functions_by_name(void *dlhandle);
+static dbi_functions_t *_copy_functions(const dbi_functions_t *functions);
+static size_t _functions_size(unsigned int abi_version);
+static int _has_required_functions(const dbi_functions_t *functions);
+static void _check_optional_functions(dbi_functions_t *functions);
+static int _load_static_drivers(dbi_inst_t *inst);
+static dbi_driver_t *_load_driver(dbi_inst_t *inst, const char *filename);
+static dbi_module_t *_acquire_module(const char *filename, const dbi_functions_t *functions);
+static void _release_module(dbi_module_t *module);
+static void _free_driver(dbi_driver_t *driver);
+static dbi_driver_t *_add_driver(dbi_inst_t *inst, dbi_module_t *module);
+static dbi_driver_t *_load_driver_file(dbi_inst_t *inst, const char *name);
+static void _free_driver_files(dbi_inst_t *inst);
+static void _update_driver_manifest(dbi_inst_t *inst);
 static void _free_custom_functions(dbi_driver_t *driver);
 static dbi_option_t *_find_or_create_option_node(dbi_conn Conn, const char *key);
+static int _hash_reserved_words(dbi_driver_t *driver);
+static void _update_cached_option(dbi_conn_t *conn, const char *key, dbi_option_t *option);
 static int _update_internal_conn_list(dbi_conn_t *conn, int operation);
 static void _free_caps(_capability_t *caproot);
+static void _inst_lock(dbi_inst_t *inst);
+static void _inst_unlock(dbi_inst_t *inst);
 static const char *_get_option(dbi_conn Conn, const char *key, int aggressive);
 static int _get_option_numeric(dbi_conn Conn, const char *key, int aggressive);
 static unsigned int _parse_versioninfo(const char *version);
@@ -136,19 +166,43 @@ int dbi_conn_set_error(dbi_conn Conn, int errnum, const char *formatstr, ...) __
 static const char *my_ERROR = "ERROR";
 static dbi_inst dbi_inst_legacy;
 
+/* drivers linked into the program, see dbi_register_static_driver() */
+#define DBI_MAX_STATIC_DRIVERS 32
+static const dbi_functions_t *static_drivers[DBI_MAX_STATIC_DRIVERS];
+static unsigned int num_static_drivers = 0;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t static_drivers_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* drivers loaded by any instance, see _acquire_module() */
+static dbi_module_t *modules = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /* XXX DBI CORE FUNCTIONS XXX */
 
 int dbi_initialize_r(const char *driverdir, dbi_inst *pInst) {
+	return _initialize(driverdir, pInst, 0);
+}
+
+int dbi_initialize_lazy_r(const char *driverdir, dbi_inst *pInst) {
+	/* only remember the driver files, they are loaded by name when
+	 * dbi_driver_open_r() or dbi_conn_new_r() asks for them */
+	return _initialize(driverdir, pInst, 1);
+}
+
+static int _initialize(const char *driverdir, dbi_inst *pInst, int lazy) {
 	dbi_inst_t *inst;
-	DIR *dir;
-	struct dirent *driver_dirent = NULL;
-	struct stat statbuf;
-	char fullpath[256];
 	char *effective_driverdir;
 	
+	int num_files;
+	int num_static;
 	int num_loaded = 0;
-	dbi_driver_t *driver = NULL;
-	dbi_driver_t *prevdriver = NULL;
+	int manifest_stale = 0;
+	dbi_driver_file_t *file;
+	dbi_driver_file_t *failed = NULL;
+	dbi_driver_t *driver;
 #if HAVE_LTDL_H
         (void)lt_dlinit();
 #endif	
@@ -163,43 +217,146 @@ int dbi_initialize_r(const char *driverdir, dbi_inst *pInst) {
 	inst->rootdriver = NULL;
 	inst->rootconn = NULL;
 	inst->dbi_verbosity = 1; /* TODO: is this really the right default? */
+	inst->workers = NULL;
+	inst->async_queued = 0;
+	inst->slowlog = NULL;
+	memset(&inst->closed_stats, 0, sizeof(inst->closed_stats));
+	inst->driver_files = NULL;
+	inst->failed_files = NULL;
+	inst->driverdir = NULL;
+	inst->manifest_stale = 0;
+	inst->pools = NULL;
+	inst->lock = malloc(sizeof(dbi_inst_lock_t));
+	if (!inst->lock) {
+		free(inst);
+		*pInst = NULL;
+		return -1;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->lock->mutex, NULL);
+#endif
 	/* end instance init */
 	effective_driverdir = (driverdir ? (char *)driverdir : DBI_DRIVER_DIR);
-	dir = opendir(effective_driverdir);
 
+	/* drivers linked into the program are found first and need no
+	 * files, so a static program may have no driver directory */
+	_inst_lock(inst);
+	num_static = _load_static_drivers(inst);
+	_inst_unlock(inst);
+
+	/* a current manifest saves reading the directory */
+	num_files = _read_driver_manifest(inst, effective_driverdir);
+	if (num_files < 0) {
+		manifest_stale = 1;
+		num_files = _scan_driver_dir(inst, effective_driverdir);
+		if (num_files < 0) {
+			return num_static ? num_static : -1;
+		}
+	}
+	if (lazy) {
+		/* the manifest is checked and rewritten as the files are loaded */
+		inst->manifest_stale = manifest_stale;
+		if (num_files) {
+			inst->driverdir = strdup(effective_driverdir);
+		}
+		/* files the manifest lists as not loadable are tried again,
+		 * but not counted as drivers */
+		num_loaded = num_static;
+		for (file = inst->driver_files; file; file = file->next) {
+			if (!file->from_manifest || file->name) {
+				num_loaded++;
+			}
+		}
+		return num_loaded;
+	}
+	num_loaded = num_static;
+
+	_inst_lock(inst);
+	while ((file = inst->driver_files) != NULL) {
+		inst->driver_files = file->next;
+		driver = _load_driver(inst, file->filename);
+		if (driver) {
+			num_loaded++;
+		}
+		if (!manifest_stale && _driver_file_changed(file, driver)) {
+			manifest_stale = 1;
+		}
+		if (driver) {
+			_free_driver_file(file);
+		}
+		else {
+			/* kept in the manifest, a later start tries it again */
+			file->next = failed;
+			failed = file;
+		}
+	}
+	_inst_unlock(inst);
+
+	if (manifest_stale) {
+		_write_driver_manifest(inst, effective_driverdir, failed);
+	}
+	while ((file = failed) != NULL) {
+		failed = file->next;
+		_free_driver_file(file);
+	}
+	return num_loaded;
+}
+
+/* lists the driver files in driverdir. Returns their number, or -1 if
+ * the directory cannot be read */
+static int _scan_driver_dir(dbi_inst_t *inst, const char *driverdir) {
+	DIR *dir;
+	struct dirent *driver_dirent = NULL;
+	struct stat statbuf;
+	char fullpath[256];
+	dbi_driver_file_t *file;
+	dbi_driver_file_t *prevfile = NULL;
+	const char *ext;
+	size_t namelen;
+	int num_files = 0;
+
+	dir = opendir(driverdir);
 	if (dir == NULL) {
 		return -1;
 	}
-	else {
-		while ((driver_dirent = readdir(dir)) != NULL) {
-			driver = NULL;
-			snprintf(fullpath, sizeof(fullpath), "%s%s%s", effective_driverdir, DBI_PATH_SEPARATOR, driver_dirent->d_name);
-			if ((stat(fullpath, &statbuf) == 0) && S_ISREG(statbuf.st_mode) && strrchr(driver_dirent->d_name, '.') && (!strcmp(strrchr(driver_dirent->d_name, '.'), DRIVER_EXT))) {
-				/* file is a stat'able regular file that ends in .so (or appropriate dynamic library extension) */
-				driver = _get_driver(fullpath, inst);
-				if (driver && (driver->functions->initialize(driver) != -1)) {
-					if (!inst->rootdriver) {
-						inst->rootdriver = driver;
-					}
-					if (prevdriver) {
-						prevdriver->next = driver;
-					}
-					prevdriver = driver;
-					num_loaded++;
-				}
-				else {
-					if (driver && driver->dlhandle) _safe_dlclose(driver);
-					if (driver && driver->functions) free(driver->functions);
-					if (driver) free(driver);
-					driver = NULL; /* don't include in linked list */
-					if (inst->dbi_verbosity) fprintf(stderr, "libdbi: Failed to load driver: %s\n", fullpath);
-				}
+
+	while ((driver_dirent = readdir(dir)) != NULL) {
+		/* look at the name first, it is cheaper than stat() */
+		ext = strrchr(driver_dirent->d_name, '.');
+		if (!ext || strcmp(ext, DRIVER_EXT)) {
+			continue;
+		}
+		if (snprintf(fullpath, sizeof(fullpath), "%s%s%s", driverdir, DBI_PATH_SEPARATOR, driver_dirent->d_name) >= (int)sizeof(fullpath)
+		    || (stat(fullpath, &statbuf) != 0) || !S_ISREG(statbuf.st_mode)) {
+			continue;
+		}
+		/* file is a stat'able regular file that ends in .so (or appropriate dynamic library extension) */
+		file = calloc(1, sizeof(dbi_driver_file_t));
+		if (!file || (file->filename = strdup(fullpath)) == NULL) {
+			free(file);
+			break;
+		}
+		/* drivers are usually called libdbd<name>.so */
+		if (!strncmp(driver_dirent->d_name, "libdbd", 6)) {
+			namelen = ext-driver_dirent->d_name-6;
+			file->name = malloc(namelen+1);
+			if (file->name) {
+				memcpy(file->name, driver_dirent->d_name+6, namelen);
+				file->name[namelen] = '\0';
 			}
 		}
-		closedir(dir);
+		if (prevfile) {
+			prevfile->next = file;
+		}
+		else {
+			inst->driver_files = file;
+		}
+		prevfile = file;
+		num_files++;
 	}
-	
-	return num_loaded;
+	closedir(dir);
+
+	return num_files;
 }
 
 int dbi_initialize(const char *driverdir) {
@@ -208,31 +365,41 @@ int dbi_initialize(const char *driverdir) {
 
 void dbi_shutdown_r(dbi_inst Inst) {
 	dbi_inst_t *inst = (dbi_inst_t*) Inst;
-	dbi_conn_t *curconn = inst->rootconn;
-	dbi_conn_t *nextconn;
+	dbi_conn_t *curconn;
 	
 	dbi_driver_t *curdriver = inst->rootdriver;
 	dbi_driver_t *nextdriver;
 	
-	while (curconn) {
-		nextconn = curconn->next;
+	/* pools close their idle connections and templates themselves */
+	_free_pools(inst);
+
+	/* closing a conn unlinks it, so always take the first one */
+	for (;;) {
+		_inst_lock(inst);
+		curconn = inst->rootconn;
+		_inst_unlock(inst);
+		if (!curconn) {
+			break;
+		}
 		dbi_conn_close((dbi_conn)curconn);
-		curconn = nextconn;
 	}
+	_stop_workers(inst);
+	_stop_slowlog(inst);
+	_free_driver_files(inst);
 	
 	while (curdriver) {
 		nextdriver = curdriver->next;
- 		_safe_dlclose(curdriver);
-		free(curdriver->functions);
-		_free_custom_functions(curdriver);
-		_free_caps(curdriver->caps);
-		free(curdriver->filename);
+		_release_module(curdriver->module);
 		free(curdriver);
 		curdriver = nextdriver;
 	}
 #if HAVE_LTDL_H
         (void)lt_dlexit();
 #endif	
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->lock->mutex);
+#endif
+	free(inst->lock);
 	free(inst);
 }
 
@@ -258,6 +425,65 @@ int dbi_set_verbosity(int verbosity) {
 	return dbi_set_verbosity_r(verbosity, dbi_inst_legacy);
 }
 
+int dbi_register_static_driver(const dbi_functions_t *functions) {
+	unsigned int idx;
+	int retval = 0;
+
+	if (!functions || !_functions_size(functions->abi_version) || !_has_required_functions(functions)) {
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&static_drivers_lock);
+#endif
+	for (idx = 0; idx < num_static_drivers && static_drivers[idx] != functions; idx++);
+	if (idx == num_static_drivers) {
+		if (num_static_drivers < DBI_MAX_STATIC_DRIVERS) {
+			static_drivers[num_static_drivers++] = functions;
+		}
+		else {
+			retval = -1;
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&static_drivers_lock);
+#endif
+	return retval;
+}
+
+int dbi_set_async_workers_r(unsigned int numthreads, dbi_inst Inst) {
+	dbi_inst_t *inst = (dbi_inst_t*) Inst;
+	/* queries of drivers which cannot send them without waiting for
+	 * the reply are run by these threads. They are not replaced while
+	 * such queries are outstanding */
+
+	if (_stop_workers(inst) < 0) {
+		return -1;
+	}
+	if (numthreads == 0) {
+		return 0;
+	}
+	return _start_workers(inst, numthreads);
+}
+
+/* sums the statistics of all connections the instance opened so far,
+ * including those already closed */
+int dbi_get_stats_r(dbi_conn_stats *stats, dbi_inst Inst) {
+	dbi_inst_t *inst = (dbi_inst_t*) Inst;
+	dbi_conn_t *conn;
+
+	if (!inst || !stats) {
+		return -1;
+	}
+	_inst_lock(inst);
+	*stats = inst->closed_stats;
+	for (conn = inst->rootconn; conn; conn = conn->next) {
+		_stats_add(stats, &conn->stats);
+	}
+	_inst_unlock(inst);
+	return 0;
+}
+
 /* XXX DRIVER FUNCTIONS XXX */
 
 dbi_driver dbi_driver_list_r(dbi_driver Current, dbi_inst Inst) {
@@ -265,7 +491,15 @@ dbi_driver dbi_driver_list_r(dbi_driver Current, dbi_inst Inst) {
 	dbi_driver_t *current = Current;
 
 	if (current == NULL) {
-		return (dbi_driver)inst->rootdriver;
+		_inst_lock(inst);
+		/* the caller wants to see all drivers */
+		while (inst->driver_files) {
+			_load_driver_file(inst, NULL);
+		}
+		_update_driver_manifest(inst);
+		current = inst->rootdriver;
+		_inst_unlock(inst);
+		return (dbi_driver)current;
 	}
 
 	return (dbi_driver)current->next;
@@ -276,11 +510,18 @@ dbi_driver dbi_driver_list(dbi_driver Current) {
 
 dbi_driver dbi_driver_open_r(const char *name, dbi_inst Inst) {
 	dbi_inst_t *inst = (dbi_inst_t*) Inst;
-	dbi_driver_t *driver = inst->rootdriver;
+	dbi_driver_t *driver;
 
+	_inst_lock(inst);
+	driver = inst->rootdriver;
 	while (driver && strcasecmp(name, driver->info->name)) {
 		driver = driver->next;
 	}
+	if (!driver && inst->driver_files) {
+		driver = _load_driver_file(inst, name);
+		_update_driver_manifest(inst);
+	}
+	_inst_unlock(inst);
 
 	return driver;
 }
@@ -302,6 +543,16 @@ int dbi_driver_is_reserved_word(dbi_driver Driver, const char *word) {
 	
 	if (!driver) return 0;
 	
+	if (driver->reserved_word_table) {
+		idx = _name_hash(word) & driver->reserved_word_mask;
+		while (driver->reserved_word_table[idx]) {
+			if (strcasecmp(word, driver->reserved_word_table[idx]) == 0) {
+				return 1;
+			}
+			idx = (idx+1) & driver->reserved_word_mask;
+		}
+		return 0;
+	}
 	while (driver->reserved_words[idx]) {
 		if (strcasecmp(word, driver->reserved_words[idx]) == 0) {
 			return 1;
@@ -314,13 +565,15 @@ int dbi_driver_is_reserved_word(dbi_driver Driver, const char *word) {
 void *dbi_driver_specific_function(dbi_driver Driver, const char *name) {
 	dbi_driver_t *driver = Driver;
 	dbi_custom_function_t *custom;
+	unsigned int hash;
 
 	if (!driver) return NULL;
 
-	custom = driver->custom_functions;
+	hash = _name_hash(name);
+	custom = driver->custom_function_buckets[hash % DBI_CUSTOM_FUNCTION_BUCKETS];
 	
-	while (custom && strcasecmp(name, custom->name)) {
-		custom = custom->next;
+	while (custom && (custom->hash != hash || strcasecmp(name, custom->name))) {
+		custom = custom->hash_next;
 	}
 
 	return custom ? custom->function_pointer : NULL;
@@ -334,12 +587,7 @@ int dbi_driver_cap_get(dbi_driver Driver, const char *capname) {
 	  return 0;
 	}
 
-	cap = driver->caps;
-
- 	while (cap && strcmp(capname, cap->name)) {
-	    cap = cap->next;
-	}
-
+	cap = _find_cap(driver->cap_buckets, capname);
 	return cap ? cap->value : 0;
 }
 
@@ -349,12 +597,7 @@ int dbi_conn_cap_get(dbi_conn Conn, const char *capname) {
 
 	if (!conn) return 0;
 
-	cap = conn->caps;
-	
-	while (cap && strcmp(capname, cap->name)) {
-		cap = cap->next;
-	}
-
+	cap = _find_cap(conn->cap_buckets, capname);
 	return cap ? cap->value : dbi_driver_cap_get((dbi_driver)conn->driver, capname);
 }
 
@@ -513,8 +756,19 @@ dbi_conn dbi_conn_open(dbi_driver Driver) {
 		return NULL;
 	}
 	conn->driver = driver;
-	conn->options = NULL;
+	conn->options = conn->options_tail = NULL;
+	memset(conn->option_buckets, 0, sizeof(conn->option_buckets));
+	conn->log_queries = conn->verbosity = conn->user_error_callback = 0;
+	conn->template_cache_size = -1;
+	conn->latency_histograms = conn->timed = 0;
+	conn->trace = NULL;
+	conn->trace_argument = NULL;
+	conn->slow_query_ms = -1;
+	conn->slow_query_fd = 2;
+	memset(&conn->stats, 0, sizeof(conn->stats));
 	conn->caps = NULL;
+	memset(conn->cap_buckets, 0, sizeof(conn->cap_buckets));
+	conn->cap_flags = conn->cap_mask = 0;
 	conn->connection = NULL;
 	conn->current_db = NULL;
 	conn->error_flag = DBI_ERROR_NONE; /* for legacy code only */
@@ -522,9 +776,28 @@ dbi_conn dbi_conn_open(dbi_driver Driver) {
 	conn->error_message = NULL;
 	conn->error_handler = NULL;
 	conn->error_handler_argument = NULL;
-	_update_internal_conn_list(conn, 1);
 	conn->results = NULL;
 	conn->results_size = conn->results_used = 0;
+	conn->stmts = NULL;
+	conn->batches = NULL;
+	conn->copies = NULL;
+	conn->templates = conn->templates_tail = NULL;
+	memset(conn->template_buckets, 0, sizeof(conn->template_buckets));
+	conn->templates_used = 0;
+	conn->render_buffer = NULL;
+	conn->render_size = 0;
+	conn->pending = conn->pending_tail = NULL;
+	conn->pipelining = conn->pipeline_unsynced = 0;
+	conn->pending_done = 0;
+	conn->worker_active = 0;
+	conn->worker_pending = NULL;
+	conn->next_runnable = NULL;
+	conn->pool = NULL;
+	conn->pool_next = NULL;
+	conn->pool_idle_since = 0;
+
+	/* only publish the connection to the instance once it is complete */
+	_update_internal_conn_list(conn, 1);
 
 	return (dbi_conn)conn;
 }
@@ -547,10 +820,18 @@ int dbi_conn_disjoin_results(dbi_conn Conn) {
 
 void dbi_conn_close(dbi_conn Conn) {
 	dbi_conn_t *conn = Conn;
+	struct dbi_pool_s *pool;
 	
 	if (!conn) return;
 	
+	pool = conn->pool;
 	_update_internal_conn_list(conn, -1);
+	_free_pending_queries(conn);
+	_detach_stmts(conn);
+	_detach_copies(conn);
+	_detach_batches(conn);
+	/* results which are still around can be freed later on */
+	dbi_conn_disjoin_results(Conn);
 	
 	conn->driver->functions->disconnect(conn);
 	conn->driver = NULL;
@@ -565,9 +846,16 @@ void dbi_conn_close(dbi_conn Conn) {
 	conn->error_handler = NULL;
 	conn->error_handler_argument = NULL;
 	free(conn->results);
+	_free_template_cache(conn);
+	free(conn->render_buffer);
+	free(conn->trace);
 
-	free(conn);
+	if (pool) {
+		/* the pool may open another one */
+		_pool_release(pool, conn);
+	}
 
+	free(conn);
 }
 
 dbi_driver dbi_conn_get_driver(dbi_conn Conn) {
@@ -628,7 +916,7 @@ int dbi_conn_set_error(dbi_conn Conn, int errnum, const char *formatstr, ...) {
 
 	if (!conn) return 0;
 
-	trigger_callback = dbi_conn_get_option_numeric(Conn, "UserErrorTriggersCallback");
+	trigger_callback = conn->user_error_callback;
 
 	va_start(ap, formatstr);
 	len = vasprintf(&msg, formatstr, ap);
@@ -811,6 +1099,7 @@ int dbi_conn_set_option(dbi_conn Conn, const char *key, const char *value) {
 	if (option->string_value) free(option->string_value);
 	option->string_value = (value) ? strdup(value) : NULL;
 	option->numeric_value = 0;
+	_update_cached_option(conn, key, option);
 	
 	return 0;
 }
@@ -834,6 +1123,7 @@ int dbi_conn_set_option_numeric(dbi_conn Conn, const char *key, int value) {
 	if (option->string_value) free(option->string_value);
 	option->string_value = NULL;
 	option->numeric_value = value;
+	_update_cached_option(conn, key, option);
 	
 	return 0;
 }
@@ -848,10 +1138,7 @@ static const char *_get_option(dbi_conn Conn, const char *key, int aggressive) {
 	
 	_reset_conn_error(conn);
 
-	option = conn->options;
-	while (option && strcasecmp(key, option->key)) {
-		option = option->next;
-	}
+	option = _find_option_node(conn, key);
 
 	if (option) {
 		return option->string_value;
@@ -878,10 +1165,7 @@ static int _get_option_numeric(dbi_conn Conn, const char *key, int aggressive) {
 	
 	_reset_conn_error(conn);
 
-	option = conn->options;
-	while (option && strcasecmp(key, option->key)) {
-		option = option->next;
-	}
+	option = _find_option_node(conn, key);
 
 	if (option) {
 		return option->numeric_value;
@@ -920,9 +1204,7 @@ const char *dbi_conn_get_option_list(dbi_conn Conn, const char *current) {
 		return option->key;
 	}
 	else {
-		while (option && strcasecmp(current, option->key)) {
-			option = option->next;
-		}
+		option = _find_option_node(conn, current);
 		/* return NULL if there are no more options but don't make
 		   this an error */
 		return (option && option->next) ? option->next->key : NULL;
@@ -933,21 +1215,34 @@ void dbi_conn_clear_option(dbi_conn Conn, const char *key) {
 	dbi_conn_t *conn = Conn;
 	dbi_option_t *prevoption = NULL; /* shut up compiler */
 	dbi_option_t *option;
+	dbi_option_t **link;
 	
 	if (!conn) return;
-	option = conn->options;
-	
-	while (option && strcasecmp(key, option->key)) {
-		prevoption = option;
-		option = option->next;
-	}
+	option = _find_option_node(conn, key);
 	if (!option) return;
+
+	/* unlink it from its bucket */
+	link = &conn->option_buckets[option->hash % DBI_OPTION_BUCKETS];
+	while (*link != option) {
+		link = &(*link)->hash_next;
+	}
+	*link = option->hash_next;
+
+	/* and from the ordered list */
 	if (option == conn->options) {
 		conn->options = option->next;
 	}
 	else {
+		prevoption = conn->options;
+		while (prevoption->next != option) {
+			prevoption = prevoption->next;
+		}
 		prevoption->next = option->next;
 	}
+	if (option == conn->options_tail) {
+		conn->options_tail = prevoption;
+	}
+	_update_cached_option(conn, option->key, NULL);
 	free(option->key);
 	free(option->string_value);
 	free(option);
@@ -970,7 +1265,16 @@ void dbi_conn_clear_options(dbi_conn Conn) {
 		cur = next;
 	}
 
-	conn->options = NULL;
+	conn->options = conn->options_tail = NULL;
+	memset(conn->option_buckets, 0, sizeof(conn->option_buckets));
+	/* not through _update_cached_option(), dbi_conn_close() calls this
+	 * after the driver is gone */
+	conn->log_queries = conn->verbosity = conn->user_error_callback = 0;
+	conn->template_cache_size = -1;
+	conn->latency_histograms = 0;
+	conn->slow_query_ms = -1;
+	conn->slow_query_fd = 2;
+	conn->timed = DBI_CONN_TIMED(conn);
 }
 
 /* DRIVER: SQL layer functions */
@@ -978,12 +1282,15 @@ void dbi_conn_clear_options(dbi_conn Conn) {
 int dbi_conn_connect(dbi_conn Conn) {
 	dbi_conn_t *conn = Conn;
 	int retval;
+	long long start;
 	
 	if (!conn) return -1;
 	
 	_reset_conn_error(conn);
 
+	start = _stats_clock(conn);
 	retval = conn->driver->functions->connect(conn);
+	_stats_count_connect(conn, start);
 	if (retval == -1) {
 		/* couldn't create a connection and no DBD-level error information is available */
 		_error_handler(conn, DBI_ERROR_NOCONN);
@@ -1089,7 +1396,7 @@ dbi_result dbi_conn_query(dbi_conn Conn, const char *statement) {
 	_reset_conn_error(conn);
 
 	_logquery(conn, "[query] %s\n", statement);
-	result = conn->driver->functions->query(conn, statement);
+	result = _conn_query(conn, statement, strlen(statement));
 
 	if (result == NULL) {
 		_error_handler(conn, DBI_ERROR_DBD);
@@ -1103,17 +1410,22 @@ dbi_result dbi_conn_queryf(dbi_conn Conn, const char *formatstr, ...) {
 	char *statement;
 	dbi_result_t *result;
 	va_list ap;
+	int length;
 
 	if (!conn) return NULL;
 	
 	_reset_conn_error(conn);
 
 	va_start(ap, formatstr);
-	vasprintf(&statement, formatstr, ap);
+	length = vasprintf(&statement, formatstr, ap);
 	va_end(ap);
+	if (length < 0) {
+		_error_handler(conn, DBI_ERROR_NOMEM);
+		return NULL;
+	}
 	
 	_logquery(conn, "[queryf] %s\n", statement);
-	result = conn->driver->functions->query(conn, statement);
+	result = _conn_query(conn, statement, length);
 
 	if (result == NULL) {
 		_error_handler(conn, DBI_ERROR_DBD);
@@ -1126,13 +1438,19 @@ dbi_result dbi_conn_queryf(dbi_conn Conn, const char *formatstr, ...) {
 dbi_result dbi_conn_query_null(dbi_conn Conn, const unsigned char *statement, size_t st_length) {
 	dbi_conn_t *conn = Conn;
 	dbi_result_t *result;
+	long long start;
 
 	if (!conn) return NULL;
 
 	_reset_conn_error(conn);
 
 	_logquery_null(conn, statement, st_length);
+	start = _stats_clock(conn);
+	if (conn->trace) _trace_query_start(conn, (const char *)statement, st_length);
 	result = conn->driver->functions->query_null(conn, statement, st_length);
+	_stats_count_query(conn, st_length, result, start);
+	if (conn->trace) _trace_query_end(conn, result, start);
+	if (conn->slow_query_ms >= 0) _slowlog_query(conn, (const char *)statement, st_length, result, start);
 
 	if (result == NULL) {
 		_error_handler(conn, DBI_ERROR_DBD);
@@ -1141,6 +1459,22 @@ dbi_result dbi_conn_query_null(dbi_conn Conn, const unsigned char *statement, si
 	return (dbi_result)result;
 }
 
+/* sends a statement through the driver's query function and accounts
+   for it in the statistics, the trace, and the slow query log. length
+   is the length of the statement, which callers usually know already */
+dbi_result_t *_conn_query(dbi_conn_t *conn, const char *statement, size_t length) {
+	dbi_result_t *result;
+	long long start;
+
+	start = _stats_clock(conn);
+	if (conn->trace) _trace_query_start(conn, statement, length);
+	result = conn->driver->functions->query(conn, statement);
+	_stats_count_query(conn, length, result, start);
+	if (conn->trace) _trace_query_end(conn, result, start);
+	if (conn->slow_query_ms >= 0) _slowlog_query(conn, statement, length, result, start);
+	return result;
+}
+
 int dbi_conn_select_db(dbi_conn Conn, const char *db) {
 	dbi_conn_t *conn = Conn;
 	const char *retval;
@@ -1207,7 +1541,7 @@ int dbi_conn_ping(dbi_conn Conn) {
 
 /* XXX INTERNAL PRIVATE IMPLEMENTATION FUNCTIONS XXX */
 
-static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst) {
+static dbi_driver_t *_get_driver(const char *filename) {
 	dbi_driver_t *driver;
 	void *dlhandle;
 	void *symhandle;
@@ -1216,6 +1550,8 @@ static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst) {
 	dbi_custom_function_t *prevcustom = NULL;
 	dbi_custom_function_t *custom = NULL;
 	char function_name[256];
+	const dbi_functions_t *(*get_functions)(unsigned int);
+	const dbi_functions_t *functions;
 
 	dlhandle = my_dlopen(filename, DLOPEN_FLAG); /* DLOPEN_FLAG defined by autoconf */
 
@@ -1229,45 +1565,31 @@ static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst) {
 
 		driver->dlhandle = dlhandle;
 		driver->filename = strdup(filename);
-		driver->dbi_inst = inst;
+		driver->dbi_inst = NULL;
+		driver->module = NULL;
 		driver->next = NULL;
 		driver->caps = NULL;
-		driver->functions = malloc(sizeof(dbi_functions_t));
-
-		if ( /* nasty looking if block... is there a better way to do it? */
-			((driver->functions->register_driver = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_register_driver")) == NULL) ||
-			((driver->functions->initialize = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_initialize")) == NULL) ||
-			((driver->functions->connect = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_connect")) == NULL) ||
-			((driver->functions->disconnect = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_disconnect")) == NULL) ||
-			((driver->functions->fetch_row = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_fetch_row")) == NULL) ||
-			((driver->functions->free_query = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_free_query")) == NULL) ||
-			((driver->functions->goto_row = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_goto_row")) == NULL) ||
-			((driver->functions->get_socket = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_socket")) == NULL) ||
-			((driver->functions->get_encoding = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_encoding")) == NULL) ||
-			((driver->functions->encoding_from_iana = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_encoding_from_iana")) == NULL) ||
-			((driver->functions->encoding_to_iana = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_encoding_to_iana")) == NULL) ||
-			((driver->functions->get_engine_version = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_engine_version")) == NULL) ||
-			((driver->functions->list_dbs = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_list_dbs")) == NULL) ||
-			((driver->functions->list_tables = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_list_tables")) == NULL) ||
-			((driver->functions->query = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_query")) == NULL) ||
-			((driver->functions->query_null = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_query_null")) == NULL) ||
-			((driver->functions->quote_string = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_quote_string")) == NULL) ||
-			((driver->functions->quote_binary = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_quote_binary")) == NULL) ||
-			((driver->functions->conn_quote_string = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_conn_quote_string")) == NULL) ||
-			((driver->functions->select_db = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_select_db")) == NULL) ||
-			((driver->functions->geterror = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_geterror")) == NULL) ||
-			((driver->functions->get_seq_last = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_seq_last")) == NULL) ||
-			((driver->functions->get_seq_next = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_seq_next")) == NULL) ||
-			((driver->functions->ping = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_ping")) == NULL)
-			)
-		{
-			free(driver->functions);
+		memset(driver->cap_buckets, 0, sizeof(driver->cap_buckets));
+		driver->cap_flags = 0;
+		memset(driver->custom_function_buckets, 0, sizeof(driver->custom_function_buckets));
+		get_functions = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_functions");
+		if (get_functions) {
+			/* one lookup instead of one per function */
+			functions = get_functions(DBI_DRIVER_ABI_VERSION);
+			driver->functions = functions ? _copy_functions(functions) : NULL;
+		}
+		else {
+			driver->functions = _get_functions_by_name(dlhandle);
+		}
+		if (!driver->functions) {
 			free(driver->filename);
 			free(driver);
 			return NULL;
 		}
+
 		driver->functions->register_driver(&driver->info, &custom_functions_list, &driver->reserved_words);
 		driver->custom_functions = NULL; /* in case no custom functions are available */
+		_hash_reserved_words(driver);
 
 		/* this is a weird hack for the sake of dlsym
 		   portability. I can't imagine why using dlhandle
@@ -1285,6 +1607,7 @@ static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst) {
 			custom = malloc(sizeof(dbi_custom_function_t));
 			if (!custom) {
 				_free_custom_functions(driver);
+				free(driver->reserved_word_table);
 				free(driver->functions);
 				free(driver->filename);
 				free(driver);
@@ -1314,12 +1637,214 @@ static dbi_driver_t *_get_driver(const char *filename, dbi_inst_t *inst) {
 				prevcustom->next = custom;
 			}
 			prevcustom = custom;
+			custom->hash = _name_hash(custom->name);
+			custom->hash_next = driver->custom_function_buckets[custom->hash % DBI_CUSTOM_FUNCTION_BUCKETS];
+			driver->custom_function_buckets[custom->hash % DBI_CUSTOM_FUNCTION_BUCKETS] = custom;
 			idx++;
 		}
 	}
 	return driver;
 }
 
+/* looks up the functions of a driver which does not export
+   dbd_get_functions() one by one */
+static dbi_functions_t *_get_functions_by_name(void *dlhandle) {
+	dbi_functions_t *functions;
+
+	functions = malloc(sizeof(dbi_functions_t));
+	if (!functions) return NULL;
+	functions->abi_version = DBI_DRIVER_ABI_VERSION;
+
+	if ( /* nasty looking if block... is there a better way to do it? */
+		((functions->register_driver = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_register_driver")) == NULL) ||
+		((functions->initialize = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_initialize")) == NULL) ||
+		((functions->connect = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_connect")) == NULL) ||
+		((functions->disconnect = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_disconnect")) == NULL) ||
+		((functions->fetch_row = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_fetch_row")) == NULL) ||
+		((functions->free_query = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_free_query")) == NULL) ||
+		((functions->goto_row = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_goto_row")) == NULL) ||
+		((functions->get_socket = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_socket")) == NULL) ||
+		((functions->get_encoding = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_encoding")) == NULL) ||
+		((functions->encoding_from_iana = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_encoding_from_iana")) == NULL) ||
+		((functions->encoding_to_iana = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_encoding_to_iana")) == NULL) ||
+		((functions->get_engine_version = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_engine_version")) == NULL) ||
+		((functions->list_dbs = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_list_dbs")) == NULL) ||
+		((functions->list_tables = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_list_tables")) == NULL) ||
+		((functions->query = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_query")) == NULL) ||
+		((functions->query_null = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_query_null")) == NULL) ||
+		((functions->quote_string = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_quote_string")) == NULL) ||
+		((functions->quote_binary = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_quote_binary")) == NULL) ||
+		((functions->conn_quote_string = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_conn_quote_string")) == NULL) ||
+		((functions->select_db = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_select_db")) == NULL) ||
+		((functions->geterror = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_geterror")) == NULL) ||
+		((functions->get_seq_last = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_seq_last")) == NULL) ||
+		((functions->get_seq_next = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_seq_next")) == NULL) ||
+		((functions->ping = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_ping")) == NULL)
+		)
+	{
+		free(functions);
+		return NULL;
+	}
+
+	/* optional functions, see _check_optional_functions() */
+	functions->prepare = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_prepare");
+	functions->stmt_execute = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_stmt_execute");
+	functions->stmt_free = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_stmt_free");
+	functions->insert_batch = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_insert_batch");
+	functions->copy_begin = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_copy_begin");
+	functions->copy_put = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_copy_put");
+	functions->copy_end = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_copy_end");
+	functions->send_query = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_send_query");
+	functions->consume_input = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_consume_input");
+	functions->is_busy = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_is_busy");
+	functions->get_result = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_get_result");
+	functions->pipeline_begin = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_pipeline_begin");
+	functions->pipeline_sync = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_pipeline_sync");
+	functions->pipeline_end = my_dlsym(dlhandle, DLSYM_PREFIX "dbd_pipeline_end");
+	_check_optional_functions(functions);
+	return functions;
+}
+
+static dbi_driver_t *_get_static_driver(const dbi_functions_t *functions) {
+	dbi_driver_t *driver;
+	const char **custom_functions_list;
+
+	driver = malloc(sizeof(dbi_driver_t));
+	if (!driver) return NULL;
+
+	driver->dlhandle = NULL;
+	driver->filename = NULL;
+	driver->dbi_inst = NULL;
+	driver->module = NULL;
+	driver->next = NULL;
+	driver->caps = NULL;
+	memset(driver->cap_buckets, 0, sizeof(driver->cap_buckets));
+	driver->cap_flags = 0;
+	driver->custom_functions = NULL; /* there is no module to look them up in */
+	memset(driver->custom_function_buckets, 0, sizeof(driver->custom_function_buckets));
+	driver->functions = _copy_functions(functions);
+	if (!driver->functions) {
+		free(driver);
+		return NULL;
+	}
+
+	driver->functions->register_driver(&driver->info, &custom_functions_list, &driver->reserved_words);
+	_hash_reserved_words(driver);
+	return driver;
+}
+
+/* builds the table dbi_driver_is_reserved_word() looks words up in.
+ * It is at most half full, so a lookup compares one or two words.
+ * Without it the list is searched. Returns -1 if it is not built */
+static int _hash_reserved_words(dbi_driver_t *driver) {
+	unsigned int numwords = 0;
+	unsigned int size = 16;
+	unsigned int idx;
+	unsigned int slot;
+
+	driver->reserved_word_table = NULL;
+	driver->reserved_word_mask = 0;
+	if (!driver->reserved_words) {
+		return -1;
+	}
+	while (driver->reserved_words[numwords]) {
+		numwords++;
+	}
+	while (size < 2*numwords) {
+		size *= 2;
+	}
+	driver->reserved_word_table = calloc(size, sizeof(const char *));
+	if (!driver->reserved_word_table) {
+		return -1;
+	}
+	driver->reserved_word_mask = size-1;
+	for (idx = 0; idx < numwords; idx++) {
+		slot = _name_hash(driver->reserved_words[idx]) & driver->reserved_word_mask;
+		while (driver->reserved_word_table[slot]) {
+			slot = (slot+1) & driver->reserved_word_mask;
+		}
+		driver->reserved_word_table[slot] = driver->reserved_words[idx];
+	}
+	return 0;
+}
+
+/* copies the function table of a driver into one of the current
+   layout. Functions the driver was built without are NULL. Returns
+   NULL if required functions are missing */
+static dbi_functions_t *_copy_functions(const dbi_functions_t *functions) {
+	dbi_functions_t *copy;
+	size_t size = _functions_size(functions->abi_version);
+
+	if (!size || !_has_required_functions(functions)) {
+		return NULL;
+	}
+	copy = calloc(1, sizeof(dbi_functions_t));
+	if (!copy) {
+		return NULL;
+	}
+	memcpy(copy, functions, size);
+	_check_optional_functions(copy);
+	return copy;
+}
+
+/* the size of the function table as of an ABI version, or 0 if the
+   version is unknown: 0 is not a function table, and the layout of a
+   newer one cannot be trusted */
+static size_t _functions_size(unsigned int abi_version) {
+	switch (abi_version) {
+	/* when functions are added, older versions map to offsetof() the
+	   first of them */
+	case 1:
+		return sizeof(dbi_functions_t);
+	default:
+		return 0;
+	}
+}
+
+/* returns 1 if all functions which every driver must provide are set */
+static int _has_required_functions(const dbi_functions_t *functions) {
+	return functions->register_driver && functions->initialize
+		&& functions->connect && functions->disconnect
+		&& functions->fetch_row && functions->free_query
+		&& functions->goto_row && functions->get_socket
+		&& functions->get_encoding && functions->encoding_from_iana
+		&& functions->encoding_to_iana && functions->get_engine_version
+		&& functions->list_dbs && functions->list_tables
+		&& functions->query && functions->query_null
+		&& functions->quote_string && functions->quote_binary
+		&& functions->conn_quote_string && functions->select_db
+		&& functions->geterror && functions->get_seq_last
+		&& functions->get_seq_next && functions->ping;
+}
+
+/* optional functions come in groups. Drivers which do not provide a
+   whole group fall back to emulations in libdbi */
+static void _check_optional_functions(dbi_functions_t *functions) {
+	if (!functions->prepare || !functions->stmt_execute || !functions->stmt_free) {
+		functions->prepare = NULL;
+		functions->stmt_execute = NULL;
+		functions->stmt_free = NULL;
+	}
+	if (!functions->copy_begin || !functions->copy_put || !functions->copy_end) {
+		functions->copy_begin = NULL;
+		functions->copy_put = NULL;
+		functions->copy_end = NULL;
+	}
+	if (!functions->send_query || !functions->consume_input
+	    || !functions->is_busy || !functions->get_result) {
+		functions->send_query = NULL;
+		functions->consume_input = NULL;
+		functions->is_busy = NULL;
+		functions->get_result = NULL;
+	}
+	if (!functions->send_query || !functions->pipeline_begin
+	    || !functions->pipeline_sync || !functions->pipeline_end) {
+		functions->pipeline_begin = NULL;
+		functions->pipeline_sync = NULL;
+		functions->pipeline_end = NULL;
+	}
+}
+
 static void _free_custom_functions(dbi_driver_t *driver) {
 	dbi_custom_function_t *cur;
 	dbi_custom_function_t *next;
@@ -1347,54 +1872,303 @@ static void _free_caps(_capability_t *caproot) {
 	return;
 }
 
+_capability_t *_find_cap(_capability_t **buckets, const char *capname) {
+	unsigned int hash = _name_hash(capname);
+	_capability_t *cap = buckets[hash % DBI_CAP_BUCKETS];
+
+	while (cap && (cap->hash != hash || strcmp(capname, cap->name))) {
+		cap = cap->hash_next;
+	}
+	return cap;
+}
+
+/* returns 1 if cap, one of DBI_CAP_*, has a positive value for conn.
+ * Does not look the name up like dbi_conn_cap_get() */
+int _conn_has_cap(dbi_conn_t *conn, unsigned int cap) {
+	if (conn->cap_mask & cap) {
+		return (conn->cap_flags & cap) != 0;
+	}
+	return (conn->driver->cap_flags & cap) != 0;
+}
+
 static int _update_internal_conn_list(dbi_conn_t *conn, const int operation) {
 	/* maintain internal linked list of conns so that we can unload them all
-	 * when dbi is shutdown
+	 * when dbi is shutdown. The list is doubly linked so that a conn is
+	 * added and removed in constant time
 	 * 
 	 * operation = -1: remove conn
 	 *           =  0: just look for conn (return 1 if found, -1 if not)
 	 *           =  1: add conn */
-	dbi_conn_t *curconn = conn->driver->dbi_inst->rootconn;
-	dbi_conn_t *prevconn = NULL;
+	dbi_inst_t *inst = conn->driver->dbi_inst;
+	int retval = 0;
 
+	_inst_lock(inst);
 	if ((operation == -1) || (operation == 0)) {
-		while (curconn && (curconn != conn)) {
-			prevconn = curconn;
-			curconn = curconn->next;
+		if (!conn->prev && inst->rootconn != conn) {
+			retval = -1;
 		}
-		if (!curconn) return -1;
-		if (operation == 0) return 1;
-		else if (operation == -1) {
-			if (prevconn) prevconn->next = curconn->next;
-			else conn->driver->dbi_inst->rootconn = NULL;
-			return 0;
+		else if (operation == 0) {
+			retval = 1;
+		}
+		else {
+			/* what the conn counted stays in the totals of the
+			 * instance */
+			_stats_add(&inst->closed_stats, &conn->stats);
+			if (conn->prev) conn->prev->next = conn->next;
+			else inst->rootconn = conn->next;
+			if (conn->next) conn->next->prev = conn->prev;
+			conn->next = conn->prev = NULL;
 		}
 	}
 	else if (operation == 1) {
-		while (curconn && curconn->next) {
-			curconn = curconn->next;
+		conn->prev = NULL;
+		conn->next = inst->rootconn;
+		if (inst->rootconn) {
+			inst->rootconn->prev = conn;
+		}
+		inst->rootconn = conn;
+	}
+	else {
+		retval = -1;
+	}
+	_inst_unlock(inst);
+	return retval;
+}
+
+/* loads a driver unless another instance did already, and appends it
+ * to the list of the instance. Called with the instance locked */
+static dbi_driver_t *_load_driver(dbi_inst_t *inst, const char *filename) {
+	dbi_module_t *module = _acquire_module(filename, NULL);
+
+	if (!module) {
+		if (inst->dbi_verbosity) fprintf(stderr, "libdbi: Failed to load driver: %s\n", filename);
+		return NULL;
+	}
+	return _add_driver(inst, module);
+}
+
+/* creates the drivers registered with dbi_register_static_driver().
+ * Called with the instance locked */
+static int _load_static_drivers(dbi_inst_t *inst) {
+	const dbi_functions_t *functions[DBI_MAX_STATIC_DRIVERS];
+	dbi_module_t *module;
+	unsigned int num_functions;
+	unsigned int idx;
+	int num_loaded = 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&static_drivers_lock);
+#endif
+	num_functions = num_static_drivers;
+	memcpy(functions, static_drivers, num_functions*sizeof(dbi_functions_t *));
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&static_drivers_lock);
+#endif
+
+	for (idx = 0; idx < num_functions; idx++) {
+		module = _acquire_module(NULL, functions[idx]);
+		if (module && _add_driver(inst, module)) {
+			num_loaded++;
+		}
+		else if (!module && inst->dbi_verbosity) {
+			fprintf(stderr, "libdbi: Failed to initialize a static driver\n");
+		}
+	}
+	return num_loaded;
+}
+
+/* returns the module loaded from filename, or from the table of a
+ * static driver if filename is NULL, and takes a reference to it. The
+ * driver is loaded and initialized only if no instance uses it yet.
+ * Returns NULL if it fails to load */
+static dbi_module_t *_acquire_module(const char *filename, const dbi_functions_t *functions) {
+	dbi_module_t *module;
+	dbi_driver_t *driver;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&modules_lock);
+#endif
+	for (module = modules; module; module = module->next) {
+		if (filename ? (module->driver->filename && !strcmp(filename, module->driver->filename))
+		    : (module->static_functions == functions)) {
+			module->refcount++;
+			break;
+		}
+	}
+	if (!module) {
+		driver = filename ? _get_driver(filename) : _get_static_driver(functions);
+		if (driver && driver->functions->initialize(driver) != -1
+		    && (module = malloc(sizeof(dbi_module_t))) != NULL) {
+			module->driver = driver;
+			module->static_functions = filename ? NULL : functions;
+			module->refcount = 1;
+			module->next = modules;
+			modules = module;
+			driver->module = module;
 		}
-		if (curconn) {
-			curconn->next = conn;
+		else if (driver) {
+			_free_driver(driver);
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&modules_lock);
+#endif
+	return module;
+}
+
+/* drops a reference to module and unloads the driver after the last
+ * one */
+static void _release_module(dbi_module_t *module) {
+	dbi_module_t **link;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&modules_lock);
+#endif
+	if (--module->refcount == 0) {
+		for (link = &modules; *link != module; link = &(*link)->next);
+		*link = module->next;
+		_free_driver(module->driver);
+		free(module);
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&modules_lock);
+#endif
+}
+
+static void _free_driver(dbi_driver_t *driver) {
+	_safe_dlclose(driver);
+	free(driver->reserved_word_table);
+	free(driver->functions);
+	_free_custom_functions(driver);
+	_free_caps(driver->caps);
+	free(driver->filename);
+	free(driver);
+}
+
+/* creates the driver of an instance, which shares everything but the
+ * instance with module, and appends it to the list of the instance.
+ * Releases module if it fails. Called with the instance locked */
+static dbi_driver_t *_add_driver(dbi_inst_t *inst, dbi_module_t *module) {
+	dbi_driver_t *driver;
+	dbi_driver_t *prevdriver;
+
+	driver = malloc(sizeof(dbi_driver_t));
+	if (!driver) {
+		_release_module(module);
+		return NULL;
+	}
+	*driver = *module->driver;
+	driver->dbi_inst = inst;
+	driver->next = NULL;
+
+	if (!inst->rootdriver) {
+		inst->rootdriver = driver;
+	}
+	else {
+		prevdriver = inst->rootdriver;
+		while (prevdriver->next) {
+			prevdriver = prevdriver->next;
+		}
+		prevdriver->next = driver;
+	}
+	return driver;
+}
+
+/* loads driver files of a lazy instance until the driver called name
+ * is found, trying the file named after it first. Loads the first file
+ * if name is NULL. Called with the instance locked */
+static dbi_driver_t *_load_driver_file(dbi_inst_t *inst, const char *name) {
+	dbi_driver_file_t **link;
+	dbi_driver_file_t **candidate;
+	dbi_driver_file_t *file;
+	dbi_driver_t *driver;
+
+	while (inst->driver_files) {
+		candidate = name ? NULL : &inst->driver_files;
+		for (link = &inst->driver_files; name && *link; link = &(*link)->next) {
+			if ((*link)->name && !strcasecmp(name, (*link)->name)) {
+				candidate = link;
+				break;
+			}
+		}
+		/* names from the manifest are exact, other files and those
+		 * which did not load before may still provide the driver */
+		for (link = &inst->driver_files; !candidate && *link; link = &(*link)->next) {
+			if (!(*link)->from_manifest || !(*link)->name) {
+				candidate = link;
+			}
+		}
+		if (!candidate) {
+			return NULL;
+		}
+		file = *candidate;
+		*candidate = file->next;
+		driver = _load_driver(inst, file->filename);
+		if (_driver_file_changed(file, driver)) {
+			inst->manifest_stale = 1;
+		}
+		if (driver) {
+			_free_driver_file(file);
 		}
 		else {
-			conn->driver->dbi_inst->rootconn = conn;
+			/* kept in the manifest, a later start tries it again */
+			file->next = inst->failed_files;
+			inst->failed_files = file;
+		}
+		if (driver && (!name || !strcasecmp(name, driver->info->name))) {
+			return driver;
 		}
-		conn->next = NULL;
-		return 0;
 	}
-	return -1;
+	return NULL;
 }
 
-static dbi_option_t *_find_or_create_option_node(dbi_conn Conn, const char *key) {
-	dbi_option_t *prevoption = NULL;
-	dbi_conn_t *conn = Conn;
-	dbi_option_t *option = conn->options;
+static void _free_driver_files(dbi_inst_t *inst) {
+	dbi_driver_file_t *file;
+
+	while ((file = inst->driver_files) != NULL) {
+		inst->driver_files = file->next;
+		_free_driver_file(file);
+	}
+	while ((file = inst->failed_files) != NULL) {
+		inst->failed_files = file->next;
+		_free_driver_file(file);
+	}
+	free(inst->driverdir);
+	inst->driverdir = NULL;
+}
 
-	while (option && strcasecmp(key, option->key)) {
-		prevoption = option;
-		option = option->next;
+/* rewrites the manifest of a lazy instance if a file loaded since it
+ * was read did not match its entry. Called with the instance locked */
+static void _update_driver_manifest(dbi_inst_t *inst) {
+	if (inst->manifest_stale && inst->driverdir) {
+		_write_driver_manifest(inst, inst->driverdir, inst->failed_files);
+		inst->manifest_stale = 0;
 	}
+}
+
+void _free_driver_file(dbi_driver_file_t *file) {
+	free(file->filename);
+	free(file->name);
+	free(file->version);
+	free(file);
+}
+
+static void _inst_lock(dbi_inst_t *inst) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->lock->mutex);
+#endif
+}
+
+static void _inst_unlock(dbi_inst_t *inst) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->lock->mutex);
+#endif
+}
+
+static dbi_option_t *_find_or_create_option_node(dbi_conn Conn, const char *key) {
+	dbi_conn_t *conn = Conn;
+	dbi_option_t *option = _find_option_node(conn, key);
+	unsigned int bucket;
 
 	if (option == NULL) {
 		/* allocate a new option node */
@@ -1402,18 +2176,108 @@ static dbi_option_t *_find_or_create_option_node(dbi_conn Conn, const char *key)
 		if (!option) return NULL;
 		option->next = NULL;
 		option->key = strdup(key);
+		if (!option->key) {
+			free(option);
+			return NULL;
+		}
 		option->string_value = NULL;
+		option->hash = _name_hash(key);
+		bucket = option->hash % DBI_OPTION_BUCKETS;
+		option->hash_next = conn->option_buckets[bucket];
+		conn->option_buckets[bucket] = option;
 		if (conn->options == NULL) {
 		    conn->options = option;
 		}
 		else {
-		    prevoption->next = option;
+		    conn->options_tail->next = option;
 		}
+		conn->options_tail = option;
 	}
 
 	return option;
 }
 
+/* looks up an option without touching the error of conn */
+dbi_option_t *_find_option_node(dbi_conn_t *conn, const char *key) {
+	unsigned int hash = _name_hash(key);
+	dbi_option_t *option = conn->option_buckets[hash % DBI_OPTION_BUCKETS];
+
+	while (option && (option->hash != hash || strcasecmp(key, option->key))) {
+		option = option->hash_next;
+	}
+	return option;
+}
+
+/* FNV-1a of a name, ignoring case like the comparisons of options,
+   reserved words and custom functions */
+unsigned int _name_hash(const char *name) {
+	unsigned int hash = 2166136261U;
+	unsigned char c;
+
+	while ((c = (unsigned char)*name++) != '\0') {
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a'-'A';
+		}
+		hash = (hash ^ c)*16777619U;
+	}
+	return hash;
+}
+
+/* keeps the struct fields of the options which libdbi reads on every
+   query in sync. option is NULL if the option was cleared */
+static void _update_cached_option(dbi_conn_t *conn, const char *key, dbi_option_t *option) {
+	int value = option ? option->numeric_value : 0;
+
+	if (!strcasecmp(key, "LogQueries")) {
+		conn->log_queries = value;
+	}
+	else if (!strcasecmp(key, "Verbosity")) {
+		conn->verbosity = value;
+	}
+	else if (!strcasecmp(key, "UserErrorTriggersCallback")) {
+		conn->user_error_callback = value;
+	}
+	else if (!strcasecmp(key, "LatencyHistograms")) {
+		conn->latency_histograms = value;
+		conn->timed = DBI_CONN_TIMED(conn);
+	}
+	else if (!strcasecmp(key, "SlowQueryMs")) {
+		dbi_inst_t *inst = conn->driver->dbi_inst;
+
+		if (option && option->string_value) {
+			value = atoi(option->string_value);
+		}
+		conn->slow_query_ms = (option && value >= 0) ? value : -1;
+		conn->timed = DBI_CONN_TIMED(conn);
+		if (conn->slow_query_ms >= 0) {
+			/* if the writer cannot be started, queries are logged
+			 * by the thread running them */
+			_inst_lock(inst);
+			if (!inst->slowlog) {
+				_start_slowlog(inst);
+			}
+			_inst_unlock(inst);
+		}
+	}
+	else if (!strcasecmp(key, "SlowQueryFd")) {
+		if (option && option->string_value) {
+			value = atoi(option->string_value);
+		}
+		conn->slow_query_fd = option ? value : 2;
+	}
+	else if (!strcasecmp(key, "StatementCacheSize")) {
+		if (!option) {
+			conn->template_cache_size = -1;
+		}
+		else {
+			if (option->string_value) {
+				value = atoi(option->string_value);
+			}
+			conn->template_cache_size = (value > 0) ? value : 0;
+		}
+	}
+}
+
 #define COUNTOF(array) (sizeof(array)/sizeof((array)[0]))
 
 /* sets conn->error_number and conn->error_message values */
@@ -1450,6 +2314,11 @@ void _error_handler(dbi_conn_t *conn, dbi_error_flag errflag) {
 					? errflag_messages[errflag+1] : "");
 		return;
 	}
+	if (_worker_runs(conn)) {
+		/* the worker saves the error for the thread using the
+		 * connection, see _save_error() */
+		return;
+	}
 
 	if (errflag == DBI_ERROR_DBD) {
 		errstatus = conn->driver->functions->geterror(conn, &my_errno, &errmsg);
@@ -1501,7 +2370,7 @@ void _reset_conn_error(dbi_conn_t *conn) {
 void _verbose_handler(dbi_conn_t *conn, const char* fmt, ...) {
 	va_list ap;
 
-	if(conn && dbi_conn_get_option_numeric(conn, "Verbosity"))
+	if(conn && conn->verbosity)
 	{
 	  fputs("libdbi: ",stderr);
 	  va_start(ap, fmt);
@@ -1513,7 +2382,7 @@ void _verbose_handler(dbi_conn_t *conn, const char* fmt, ...) {
 void _logquery(dbi_conn_t *conn, const char* fmt, ...) {
 	va_list ap;
 
-	if(conn && dbi_conn_get_option_numeric(conn, "LogQueries")){
+	if(conn && conn->log_queries){
 	  fputs("libdbi: ", stderr);
 	  va_start(ap, fmt);
 	  vfprintf(stderr, fmt, ap);
@@ -1522,7 +2391,7 @@ void _logquery(dbi_conn_t *conn, const char* fmt, ...) {
 }
 
 void _logquery_null(dbi_conn_t *conn, const char* statement, size_t st_length) {
-	if(conn && dbi_conn_get_option_numeric(conn, "LogQueries")){
+	if(conn && conn->log_queries){
 	  fputs("libdbi: [query_null] ", stderr);
 	  fwrite(statement, 1, st_length, stderr);
 	  fputc('\n', stderr);
@@ -1592,7 +2461,10 @@ static unsigned int _parse_versioninfo(const char *version) {
 static int _safe_dlclose(dbi_driver_t *driver) {
   int may_close = 0;
 
-  may_close = dbi_driver_cap_get((dbi_driver)driver, "safe_dlclose");
+  if (!driver->dlhandle) {
+    return 0; /* linked into the program */
+  }
+  may_close = driver->cap_flags & DBI_CAP_SAFE_DLCLOSE;
   if (may_close) {
     my_dlclose(driver->dlhandle);
     return 0;
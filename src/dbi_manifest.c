@@ -0,0 +1,281 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (the driver manifest. A file in the driver directory lists the name,
+ * version, modification time and size of every driver, so that an
+ * instance learns which drivers exist without reading the directory
+ * or loading them)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_UTIME_H
+#include <utime.h>
+#endif
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+#define DBI_MANIFEST_NAME "libdbi.manifest"
+#define DBI_MANIFEST_MAGIC "libdbi driver manifest 1"
+
+/* name, version, mtime, size and filename */
+#define DBI_MANIFEST_FIELDS 5
+
+static int _split_fields(char *line, char **fields, int numfields);
+static int _valid_filename(const char *filename);
+static int _modified_before(const struct stat *a, const struct stat *b);
+static void _write_unnamed_file(FILE *fp, dbi_driver_file_t *file);
+
+/* reads the manifest of driverdir into the driver files of the
+   instance. Returns the number of drivers listed, or -1 if there is no
+   manifest or it is older than the directory */
+int _read_driver_manifest(dbi_inst_t *inst, const char *driverdir) {
+  char path[256];
+  char line[1024];
+  char *fields[DBI_MANIFEST_FIELDS];
+  struct stat dirstat;
+  struct stat manifeststat;
+  FILE *fp;
+  dbi_driver_file_t *files = NULL;
+  dbi_driver_file_t *lastfile = NULL;
+  dbi_driver_file_t *file;
+  int numfiles = 0;
+
+  if (snprintf(path, sizeof(path), "%s%s%s", driverdir, DBI_PATH_SEPARATOR, DBI_MANIFEST_NAME) >= (int)sizeof(path)) {
+    return -1;
+  }
+
+  /* adding, removing or renaming a driver changes the modification
+     time of the directory. The manifest is touched after it was moved
+     into place, so it is at least as new as the directory it lists */
+  if (stat(driverdir, &dirstat) != 0 || stat(path, &manifeststat) != 0
+      || _modified_before(&manifeststat, &dirstat)) {
+    return -1;
+  }
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  if (!fgets(line, sizeof(line), fp) || strncmp(line, DBI_MANIFEST_MAGIC, strlen(DBI_MANIFEST_MAGIC))) {
+    fclose(fp);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    /* the files are loaded, so a manifest naming one outside of the
+       directory is not trusted at all */
+    if (_split_fields(line, fields, DBI_MANIFEST_FIELDS) != DBI_MANIFEST_FIELDS
+	|| !_valid_filename(fields[4])) {
+      numfiles = -1;
+      break;
+    }
+    file = calloc(1, sizeof(dbi_driver_file_t));
+    if (!file) {
+      numfiles = -1;
+      break;
+    }
+    if (lastfile) {
+      lastfile->next = file;
+    }
+    else {
+      files = file;
+    }
+    lastfile = file;
+
+    /* files which did not load have no name */
+    if (*fields[0]) {
+      file->name = strdup(fields[0]);
+      file->version = strdup(fields[1]);
+    }
+    file->mtime = strtol(fields[2], NULL, 10);
+    file->size = strtoul(fields[3], NULL, 10);
+    file->filename = malloc(strlen(driverdir)+strlen(fields[4])+2);
+    if ((*fields[0] && (!file->name || !file->version)) || !file->filename) {
+      numfiles = -1;
+      break;
+    }
+    sprintf(file->filename, "%s%s%s", driverdir, DBI_PATH_SEPARATOR, fields[4]);
+    file->from_manifest = 1;
+    numfiles++;
+  }
+  fclose(fp);
+
+  if (numfiles < 0) {
+    while ((file = files) != NULL) {
+      files = file->next;
+      _free_driver_file(file);
+    }
+    return -1;
+  }
+  inst->driver_files = files;
+  return numfiles;
+}
+
+/* replaces the manifest of driverdir with the drivers the instance
+   loaded, the files which failed to load, and those it did not load
+   yet. Failed files are listed without a name, so that they are tried
+   again. Fails silently, the directory is often read-only */
+void _write_driver_manifest(dbi_inst_t *inst, const char *driverdir, dbi_driver_file_t *failed) {
+  char path[256];
+  char tmppath[256];
+  struct stat filestat;
+  FILE *fp;
+  dbi_driver_t *driver;
+  dbi_driver_file_t *file;
+  const char *basename;
+
+  if (snprintf(path, sizeof(path), "%s%s%s", driverdir, DBI_PATH_SEPARATOR, DBI_MANIFEST_NAME) >= (int)sizeof(path)
+      || snprintf(tmppath, sizeof(tmppath), "%s.%ld", path, (long)getpid()) >= (int)sizeof(tmppath)) {
+    return;
+  }
+
+  fp = fopen(tmppath, "w");
+  if (!fp) {
+    return;
+  }
+  fprintf(fp, "%s\n", DBI_MANIFEST_MAGIC);
+  for (driver = inst->rootdriver; driver; driver = driver->next) {
+    /* static drivers have no file */
+    if (!driver->filename || stat(driver->filename, &filestat) != 0
+	|| strpbrk(driver->info->name, "\t\n") || strpbrk(driver->info->version, "\t\n")) {
+      continue;
+    }
+    basename = strrchr(driver->filename, *DBI_PATH_SEPARATOR);
+    basename = basename ? basename+1 : driver->filename;
+    fprintf(fp, "%s\t%s\t%ld\t%lu\t%s\n", driver->info->name, driver->info->version,
+	    (long)filestat.st_mtime, (unsigned long)filestat.st_size, basename);
+  }
+  for (file = failed; file; file = file->next) {
+    _write_unnamed_file(fp, file);
+  }
+  /* files a lazy instance did not load yet keep their entries, which
+     are checked when they are loaded */
+  for (file = inst->driver_files; file; file = file->next) {
+    if (!file->from_manifest || !file->name) {
+      _write_unnamed_file(fp, file);
+      continue;
+    }
+    basename = strrchr(file->filename, *DBI_PATH_SEPARATOR);
+    basename = basename ? basename+1 : file->filename;
+    fprintf(fp, "%s\t%s\t%ld\t%lu\t%s\n", file->name, file->version,
+	    file->mtime, file->size, basename);
+  }
+  if (fclose(fp) != 0 || rename(tmppath, path) != 0) {
+    remove(tmppath);
+    return;
+  }
+#ifdef HAVE_UTIME_H
+  utime(path, NULL);
+#endif
+}
+
+/* returns 1 if the manifest entry of file does not describe the
+   driver loaded from it, or NULL if it failed to load */
+int _driver_file_changed(dbi_driver_file_t *file, dbi_driver_t *driver) {
+  struct stat filestat;
+
+  if (!file->from_manifest || !driver != !file->name) {
+    return 1;
+  }
+  if (driver && (strcasecmp(file->name, driver->info->name) || strcmp(file->version, driver->info->version))) {
+    return 1;
+  }
+  if (stat(file->filename, &filestat) != 0 || (long)filestat.st_mtime != file->mtime
+      || (unsigned long)filestat.st_size != file->size) {
+    return 1;
+  }
+  return 0;
+}
+
+/* PRIVATE */
+
+/* lists a file without a name, so that it is tried again */
+static void _write_unnamed_file(FILE *fp, dbi_driver_file_t *file) {
+  struct stat filestat;
+  const char *basename;
+
+  if (stat(file->filename, &filestat) != 0) {
+    return;
+  }
+  basename = strrchr(file->filename, *DBI_PATH_SEPARATOR);
+  basename = basename ? basename+1 : file->filename;
+  fprintf(fp, "\t\t%ld\t%lu\t%s\n", (long)filestat.st_mtime,
+	  (unsigned long)filestat.st_size, basename);
+}
+
+/* splits a line at tabs and strips the newline. Returns the number of
+   fields, which is larger than numfields if there are too many */
+static int _split_fields(char *line, char **fields, int numfields) {
+  int count = 0;
+  char *tab;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  for (;;) {
+    if (count < numfields) {
+      fields[count] = line;
+    }
+    count++;
+    tab = strchr(line, '\t');
+    if (!tab) {
+      break;
+    }
+    *tab = '\0';
+    line = tab+1;
+  }
+  return count;
+}
+
+/* a file name of the manifest must name a driver in the directory */
+static int _valid_filename(const char *filename) {
+  size_t length = strlen(filename);
+  size_t extlength = strlen(DRIVER_EXT);
+
+  if (!*filename || strchr(filename, '/') || strchr(filename, '\\') || strstr(filename, "..")) {
+    return 0;
+  }
+  return length > extlength && !strcmp(filename+length-extlength, DRIVER_EXT);
+}
+
+/* returns 1 if a was modified before b. With nanoseconds a driver
+   added in the same second as the manifest was written is noticed */
+static int _modified_before(const struct stat *a, const struct stat *b) {
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) {
+    return a->st_mtim.tv_sec < b->st_mtim.tv_sec;
+  }
+  return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec;
+#else
+  return a->st_mtime < b->st_mtime;
+#endif
+}
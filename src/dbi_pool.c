@@ -0,0 +1,918 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (connection pools. All connections of a pool are created from the
+ * options of a template connection which is never connected. Idle
+ * connections are kept in shards, one per processor, so that threads
+ * rarely compete for a lock when they check connections in and out)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+// cast the opaque parameter to our struct pointer
+#define POOL ((dbi_pool_t*)Pool)
+
+/* defaults, can be changed with dbi_pool_set_limits() and
+   dbi_pool_set_idle_times() */
+#define DBI_POOL_MAXCONNS 10
+#define DBI_POOL_PING_AFTER (30*1000)
+#define DBI_POOL_REAP_AFTER (10*60*1000)
+
+#define DBI_POOL_MAXSHARDS 64
+/* a shard is checked for connections to reap at most this often (ms) */
+#define DBI_POOL_REAP_INTERVAL 1000
+/* waiting checkouts look at the shards at least this often (ms), in
+   case they missed a wakeup */
+#define DBI_POOL_RECHECK 10
+
+/* the condition variable of a pool waits on the clock of _now_ms() */
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+#define DBI_POOL_MONOTONIC
+#endif
+
+typedef struct dbi_pool_shard_s {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+  dbi_conn_t *idle; /* most recently used first */
+  unsigned int numidle;
+  int closed; /* the pool is freed, checkins close their connection */
+  unsigned long checkouts;
+  long long last_reap;
+  char padding[64]; /* keeps neighbouring shards out of our cache line */
+} dbi_pool_shard_t;
+
+typedef struct dbi_pool_s {
+  dbi_conn_t *template; /* holds the options of new connections */
+  unsigned int minconns;
+  unsigned int maxconns;
+  int ping_after; /* ms a connection may be idle without a check */
+  int reap_after; /* ms a connection may be idle before it is closed */
+  dbi_pool_shard_t *shards;
+  unsigned int numshards;
+  unsigned int nextshard; /* home of the next thread seen */
+  volatile unsigned int waiters; /* checkouts waiting for a connection */
+  unsigned int warming; /* threads opening connections in advance */
+  int freeing; /* tells them to stop. The last connection closed frees the pool */
+  dbi_pool_stats stats; /* except the counters kept by the shards */
+  dbi_inst_t *inst;
+  struct dbi_pool_s *next; /* pools of the instance, see _free_pools() */
+  struct dbi_pool_s *prev;
+#ifdef HAVE_PTHREAD_H
+  pthread_key_t home; /* shard of the calling thread, plus one */
+  pthread_mutex_t lock; /* protects everything but the shards */
+  pthread_cond_t available; /* a connection was checked in or closed */
+#endif
+} dbi_pool_t;
+
+/* shared by dbi_pool_warmup() and the threads it starts */
+typedef struct dbi_warmup_s {
+  dbi_pool_t *pool;
+  unsigned int remaining; /* connections nobody started to open yet */
+  unsigned int ready;
+  unsigned int running; /* threads */
+  int abandoned; /* dbi_pool_warmup() has returned */
+} dbi_warmup_t;
+
+static unsigned int _pool_home(dbi_pool_t *pool);
+static dbi_conn_t *_pool_take(dbi_pool_t *pool, unsigned int home, int wait);
+static dbi_conn_t *_pool_take_slow(dbi_pool_t *pool, unsigned int home, long long start, long long deadline);
+static dbi_conn_t *_pool_open(dbi_pool_t *pool);
+static void _pool_discard(dbi_pool_t *pool, dbi_conn_t *conn);
+static void _pool_reap(dbi_pool_t *pool, dbi_pool_shard_t *shard, long long now);
+static void _pool_destroy(dbi_pool_t *pool);
+static void _pool_lock(dbi_pool_t *pool);
+static void _pool_unlock(dbi_pool_t *pool);
+static void _shard_lock(dbi_pool_shard_t *shard);
+static int _shard_trylock(dbi_pool_shard_t *shard);
+static void _shard_unlock(dbi_pool_shard_t *shard);
+static int _pool_wait(dbi_pool_t *pool, long long deadline);
+static void *_warmup_main(void *arg);
+
+#ifdef HAVE_PTHREAD_H
+/* guards the lists of pools of all instances */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+dbi_pool dbi_pool_new_r(const char *name, dbi_inst Inst) {
+  dbi_pool_t *pool;
+  unsigned int idx;
+
+  pool = calloc(1, sizeof(dbi_pool_t));
+  if (!pool) {
+    _error_handler(NULL, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+
+  pool->numshards = 1;
+#if defined(HAVE_PTHREAD_H) && defined(_SC_NPROCESSORS_ONLN)
+  {
+    long numcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numcpus > DBI_POOL_MAXSHARDS) {
+      numcpus = DBI_POOL_MAXSHARDS;
+    }
+    if (numcpus > 1) {
+      pool->numshards = (unsigned int)numcpus;
+    }
+  }
+#endif
+  pool->shards = calloc(pool->numshards, sizeof(dbi_pool_shard_t));
+  if (!pool->shards) {
+    free(pool);
+    _error_handler(NULL, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+
+  /* the template reports errors of connections which could not be
+     opened */
+  pool->template = dbi_conn_new_r(name, Inst);
+  if (!pool->template) {
+    free(pool->shards);
+    free(pool);
+    return NULL;
+  }
+  pool->minconns = 0;
+  pool->maxconns = DBI_POOL_MAXCONNS;
+  pool->ping_after = DBI_POOL_PING_AFTER;
+  pool->reap_after = DBI_POOL_REAP_AFTER;
+#ifdef HAVE_PTHREAD_H
+  pthread_key_create(&pool->home, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+#ifdef DBI_POOL_MONOTONIC
+  {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->available, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+#else
+  pthread_cond_init(&pool->available, NULL);
+#endif
+  for (idx = 0; idx < pool->numshards; idx++) {
+    pthread_mutex_init(&pool->shards[idx].lock, NULL);
+  }
+  pthread_mutex_lock(&pools_lock);
+#endif
+  pool->inst = pool->template->driver->dbi_inst;
+  pool->next = pool->inst->pools;
+  if (pool->next) {
+    pool->next->prev = pool;
+  }
+  pool->inst->pools = pool;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&pools_lock);
+#endif
+
+  return (dbi_pool)pool;
+}
+
+dbi_conn dbi_pool_get_template(dbi_pool Pool) {
+  if (!POOL) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+  return (dbi_conn)POOL->template;
+}
+
+int dbi_pool_set_limits(dbi_pool Pool, unsigned int minconns, unsigned int maxconns) {
+  if (!POOL) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  _pool_lock(POOL);
+  _reset_conn_error(POOL->template);
+
+  if (maxconns == 0 || minconns > maxconns) {
+    _error_handler(POOL->template, DBI_ERROR_BADIDX);
+    _pool_unlock(POOL);
+    return -1;
+  }
+
+  POOL->minconns = minconns;
+  POOL->maxconns = maxconns;
+  _pool_unlock(POOL);
+  return 0;
+}
+
+int dbi_pool_set_idle_times(dbi_pool Pool, int ping_after, int reap_after) {
+  if (!POOL) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  _pool_lock(POOL);
+  _reset_conn_error(POOL->template);
+  POOL->ping_after = ping_after;
+  POOL->reap_after = reap_after;
+  _pool_unlock(POOL);
+  return 0;
+}
+
+dbi_conn dbi_pool_checkout(dbi_pool Pool, int timeout) {
+  dbi_pool_t *pool = POOL;
+  dbi_conn_t *conn;
+  unsigned int home;
+  long long start;
+  long long deadline = 0;
+
+  if (!pool) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  start = _now_ms();
+  if (timeout >= 0) {
+    deadline = start+timeout;
+  }
+  home = _pool_home(pool);
+
+  for (;;) {
+    /* the connection this thread used last, or one of another shard
+       which is not busy */
+    conn = _pool_take(pool, home, 0);
+    if (!conn) {
+      conn = _pool_take_slow(pool, home, start, deadline);
+      if (!conn) {
+	return NULL;
+      }
+    }
+
+    /* connections which were used recently are assumed to work */
+    if (!conn->pool_idle_since || pool->ping_after < 0
+	|| _now_ms()-conn->pool_idle_since < pool->ping_after
+	|| dbi_conn_ping((dbi_conn)conn)) {
+      break;
+    }
+    _pool_discard(pool, conn);
+  }
+
+  return (dbi_conn)conn;
+}
+
+int dbi_pool_checkin(dbi_pool Pool, dbi_conn Conn) {
+  dbi_pool_t *pool = POOL;
+  dbi_conn_t *conn = Conn;
+  dbi_pool_shard_t *shard;
+  long long now;
+  int reap;
+
+  if (!pool || !conn) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  if (conn->pool != pool) {
+    _error_handler(conn, DBI_ERROR_BADOBJECT);
+    return -1;
+  }
+
+  /* the same thread will most likely get it back */
+  shard = &pool->shards[_pool_home(pool)];
+  now = _now_ms();
+  conn->pool_idle_since = now;
+
+  _shard_lock(shard);
+  if (shard->closed) {
+    /* checked out when the pool was freed */
+    _shard_unlock(shard);
+    dbi_conn_close((dbi_conn)conn);
+    return 0;
+  }
+  conn->pool_next = shard->idle;
+  shard->idle = conn;
+  shard->numidle++;
+  reap = (now-shard->last_reap >= DBI_POOL_REAP_INTERVAL);
+  _shard_unlock(shard);
+
+  if (reap) {
+    _pool_reap(pool, shard, now);
+  }
+
+  /* read without the lock, a missed wakeup only delays a waiting
+     checkout until it looks again */
+  if (pool->waiters) {
+    _pool_lock(pool);
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_signal(&pool->available);
+#endif
+    _pool_unlock(pool);
+  }
+  return 0;
+}
+
+int dbi_pool_warmup(dbi_pool Pool, unsigned int numconns, unsigned int numthreads, unsigned int quorum, int timeout) {
+  dbi_pool_t *pool = POOL;
+  dbi_warmup_t *warmup;
+  long long deadline = 0;
+  int ready;
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_attr_t attr;
+#endif
+
+  if (!pool) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  if (timeout >= 0) {
+    deadline = _now_ms()+timeout;
+  }
+
+  _pool_lock(pool);
+  _reset_conn_error(pool->template);
+
+  if (quorum > numconns) {
+    _error_handler(pool->template, DBI_ERROR_BADIDX);
+    _pool_unlock(pool);
+    return -1;
+  }
+  if (pool->stats.numconns >= pool->maxconns) {
+    numconns = 0;
+  }
+  else if (numconns > pool->maxconns-pool->stats.numconns) {
+    numconns = pool->maxconns-pool->stats.numconns;
+  }
+  if (quorum > numconns) {
+    quorum = numconns;
+  }
+  if (numthreads == 0 || numthreads > numconns) {
+    numthreads = numconns;
+  }
+
+  warmup = calloc(1, sizeof(dbi_warmup_t));
+  if (!warmup) {
+    _error_handler(pool->template, DBI_ERROR_NOMEM);
+    _pool_unlock(pool);
+    return -1;
+  }
+  warmup->pool = pool;
+  warmup->remaining = numconns;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (warmup->running < numthreads) {
+    if (pthread_create(&thread, &attr, _warmup_main, warmup) != 0) {
+      break;
+    }
+    warmup->running++;
+    pool->warming++;
+  }
+  pthread_attr_destroy(&attr);
+#endif
+
+  if (!warmup->running && numconns) {
+    /* no threads, open them one after the other */
+    warmup->running++;
+    pool->warming++;
+    _pool_unlock(pool);
+    _warmup_main(warmup);
+    _pool_lock(pool);
+  }
+
+  /* the threads open the remaining connections in the background */
+  while (warmup->ready < quorum && (warmup->remaining || warmup->running)) {
+    if (_pool_wait(pool, deadline) < 0) {
+      break;
+    }
+  }
+
+  ready = (int)warmup->ready;
+  warmup->abandoned = 1;
+  if (!warmup->running) {
+    free(warmup);
+  }
+  if ((unsigned int)ready < quorum) {
+    _error_handler(pool->template, DBI_ERROR_NOCONN);
+    ready = -1;
+  }
+  _pool_unlock(pool);
+  return ready;
+}
+
+int dbi_pool_get_stats(dbi_pool Pool, dbi_pool_stats *stats) {
+  unsigned int idx;
+
+  if (!POOL || !stats) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  _pool_lock(POOL);
+  *stats = POOL->stats;
+  stats->idle = 0;
+  for (idx = 0; idx < POOL->numshards; idx++) {
+    _shard_lock(&POOL->shards[idx]);
+    stats->idle += POOL->shards[idx].numidle;
+    stats->checkouts += POOL->shards[idx].checkouts;
+    _shard_unlock(&POOL->shards[idx]);
+  }
+  stats->in_use = stats->numconns-stats->idle;
+  _pool_unlock(POOL);
+  return 0;
+}
+
+void dbi_pool_free(dbi_pool Pool) {
+  dbi_pool_t *pool = POOL;
+  dbi_pool_shard_t *shard;
+  dbi_conn_t *idle;
+  dbi_conn_t *conn;
+  unsigned int numclosed = 0;
+  unsigned int idx;
+  int last;
+
+  if (!pool) return;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&pools_lock);
+#endif
+  if (pool->prev) {
+    pool->prev->next = pool->next;
+  }
+  else {
+    pool->inst->pools = pool->next;
+  }
+  if (pool->next) {
+    pool->next->prev = pool->prev;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&pools_lock);
+#endif
+
+  _pool_lock(pool);
+  pool->freeing = 1;
+  while (pool->warming) {
+    _pool_wait(pool, 0);
+  }
+  _pool_unlock(pool);
+
+  for (idx = 0; idx < pool->numshards; idx++) {
+    shard = &pool->shards[idx];
+    _shard_lock(shard);
+    shard->closed = 1;
+    idle = shard->idle;
+    shard->idle = NULL;
+    shard->numidle = 0;
+    _shard_unlock(shard);
+
+    while ((conn = idle) != NULL) {
+      idle = conn->pool_next;
+      conn->pool = NULL;
+      dbi_conn_close((dbi_conn)conn);
+      numclosed++;
+    }
+  }
+  dbi_conn_close((dbi_conn)pool->template);
+  pool->template = NULL;
+
+  /* connections still checked out keep the pool until they are
+     checked in or closed */
+  _pool_lock(pool);
+  pool->stats.numconns -= numclosed;
+  last = !pool->stats.numconns;
+  _pool_unlock(pool);
+  if (last) {
+    _pool_destroy(pool);
+  }
+}
+
+/* PRIVATE */
+
+/* threads are spread over the shards in the order they show up */
+static unsigned int _pool_home(dbi_pool_t *pool) {
+#ifdef HAVE_PTHREAD_H
+  void *value;
+  unsigned int home;
+
+  value = pthread_getspecific(pool->home);
+  if (value) {
+    return (unsigned int)((size_t)value-1);
+  }
+  _pool_lock(pool);
+  home = pool->nextshard++ % pool->numshards;
+  _pool_unlock(pool);
+  pthread_setspecific(pool->home, (void *)(size_t)(home+1));
+  return home;
+#else
+  return 0;
+#endif
+}
+
+/* takes an idle connection from the home shard or, failing that, from
+   another one. Unless wait is set, shards locked by other threads are
+   skipped */
+static dbi_conn_t *_pool_take(dbi_pool_t *pool, unsigned int home, int wait) {
+  dbi_pool_shard_t *shard;
+  dbi_conn_t *conn;
+  unsigned int idx;
+
+  for (idx = 0; idx < pool->numshards; idx++) {
+    shard = &pool->shards[(home+idx) % pool->numshards];
+    if (idx == 0 || wait) {
+      _shard_lock(shard);
+    }
+    else if (_shard_trylock(shard) != 0) {
+      continue;
+    }
+    conn = shard->idle;
+    if (conn) {
+      shard->idle = conn->pool_next;
+      shard->numidle--;
+      shard->checkouts++;
+    }
+    _shard_unlock(shard);
+    if (conn) {
+      conn->pool_next = NULL;
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+/* opens a new connection if the pool is not full, or waits for one
+   to be checked in */
+static dbi_conn_t *_pool_take_slow(dbi_pool_t *pool, unsigned int home, long long start, long long deadline) {
+  dbi_conn_t *conn;
+  unsigned long waited;
+  int connected;
+
+  _pool_lock(pool);
+  _reset_conn_error(pool->template);
+
+  for (;;) {
+    /* the shard locks are always taken after the pool lock */
+    conn = _pool_take(pool, home, 1);
+    if (conn) {
+      break;
+    }
+
+    if (pool->stats.numconns < pool->maxconns) {
+      /* the slot is taken before the lock is released */
+      pool->stats.numconns++;
+      conn = _pool_open(pool);
+      if (conn) {
+	_pool_unlock(pool);
+	connected = dbi_conn_connect((dbi_conn)conn);
+	if (connected < 0) {
+	  dbi_conn_close((dbi_conn)conn);
+	}
+	_pool_lock(pool);
+	if (connected >= 0) {
+	  conn->pool = pool;
+	  conn->pool_idle_since = 0;
+	  pool->stats.created++;
+	  pool->stats.checkouts++;
+	  break;
+	}
+      }
+      pool->stats.failed++;
+      pool->stats.numconns--;
+#ifdef HAVE_PTHREAD_H
+      pthread_cond_signal(&pool->available);
+#endif
+      _error_handler(pool->template, DBI_ERROR_NOCONN);
+      _pool_unlock(pool);
+      return NULL;
+    }
+
+    pool->waiters++;
+    if (_pool_wait(pool, deadline) < 0) {
+      pool->waiters--;
+      pool->stats.timeouts++;
+      _error_handler(pool->template, DBI_ERROR_NOCONN);
+      _pool_unlock(pool);
+      return NULL;
+    }
+    pool->waiters--;
+  }
+
+  waited = (unsigned long)(_now_ms()-start);
+  pool->stats.wait_total += waited;
+  if (waited > pool->stats.wait_max) {
+    pool->stats.wait_max = waited;
+  }
+  _pool_unlock(pool);
+  return conn;
+}
+
+/* creates a connection with the options of the template */
+static dbi_conn_t *_pool_open(dbi_pool_t *pool) {
+  dbi_conn_t *conn;
+  dbi_option_t *option;
+
+  conn = dbi_conn_open((dbi_driver)pool->template->driver);
+  if (!conn) {
+    return NULL;
+  }
+
+  for (option = pool->template->options; option; option = option->next) {
+    if (option->string_value) {
+      dbi_conn_set_option((dbi_conn)conn, option->key, option->string_value);
+    }
+    else {
+      dbi_conn_set_option_numeric((dbi_conn)conn, option->key, option->numeric_value);
+    }
+  }
+  conn->error_handler = pool->template->error_handler;
+  conn->error_handler_argument = pool->template->error_handler_argument;
+  if (pool->template->trace
+      && dbi_conn_set_trace((dbi_conn)conn, pool->template->trace, pool->template->trace_argument) < 0) {
+    dbi_conn_close((dbi_conn)conn);
+    return NULL;
+  }
+  return conn;
+}
+
+/* closes a checked out connection which does not work anymore */
+static void _pool_discard(dbi_pool_t *pool, dbi_conn_t *conn) {
+  conn->pool = NULL;
+  dbi_conn_close((dbi_conn)conn);
+
+  _pool_lock(pool);
+  pool->stats.numconns--;
+  pool->stats.failed++;
+#ifdef HAVE_PTHREAD_H
+  /* a waiting checkout may open a new one now */
+  pthread_cond_signal(&pool->available);
+#endif
+  _pool_unlock(pool);
+}
+
+/* closes connections of a shard which were idle too long, unless the
+   pool would shrink below its minimum size */
+static void _pool_reap(dbi_pool_t *pool, dbi_pool_shard_t *shard, long long now) {
+  dbi_conn_t **link;
+  dbi_conn_t *conn;
+  dbi_conn_t *reaped = NULL;
+
+  _pool_lock(pool);
+  _shard_lock(shard);
+  shard->last_reap = now;
+  link = &shard->idle;
+  while ((conn = *link) != NULL && pool->reap_after >= 0
+	 && pool->stats.numconns > pool->minconns) {
+    if (now-conn->pool_idle_since >= pool->reap_after) {
+      *link = conn->pool_next;
+      shard->numidle--;
+      pool->stats.numconns--;
+      pool->stats.reaped++;
+      conn->pool = NULL;
+      conn->pool_next = reaped;
+      reaped = conn;
+    }
+    else {
+      link = &conn->pool_next;
+    }
+  }
+  _shard_unlock(shard);
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_signal(&pool->available);
+#endif
+  _pool_unlock(pool);
+
+  /* closing may wait for the database, not for the locks */
+  while ((conn = reaped) != NULL) {
+    reaped = conn->pool_next;
+    dbi_conn_close((dbi_conn)conn);
+  }
+}
+
+/* frees the pools which are left when the instance is shut down */
+void _free_pools(dbi_inst_t *inst) {
+  dbi_pool_t *pool;
+
+  for (;;) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pools_lock);
+#endif
+    pool = inst->pools;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&pools_lock);
+#endif
+    if (!pool) {
+      break;
+    }
+    /* unlinks the pool */
+    dbi_pool_free((dbi_pool)pool);
+  }
+}
+
+/* a connection of the pool is being closed by dbi_conn_close(), which
+   happens to idle ones when the instance is shut down. The last one
+   of a pool which was freed frees it */
+void _pool_release(dbi_pool_t *pool, dbi_conn_t *conn) {
+  dbi_pool_shard_t *shard;
+  dbi_conn_t **link;
+  unsigned int idx;
+  int last;
+
+  _pool_lock(pool);
+  for (idx = 0; idx < pool->numshards; idx++) {
+    shard = &pool->shards[idx];
+    _shard_lock(shard);
+    for (link = &shard->idle; *link && *link != conn; link = &(*link)->pool_next);
+    if (*link) {
+      *link = conn->pool_next;
+      shard->numidle--;
+      _shard_unlock(shard);
+      break;
+    }
+    _shard_unlock(shard);
+  }
+  pool->stats.numconns--;
+  last = (pool->freeing && !pool->stats.numconns);
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_signal(&pool->available);
+#endif
+  _pool_unlock(pool);
+  if (last) {
+    _pool_destroy(pool);
+  }
+}
+
+static void _pool_destroy(dbi_pool_t *pool) {
+#ifdef HAVE_PTHREAD_H
+  unsigned int idx;
+
+  for (idx = 0; idx < pool->numshards; idx++) {
+    pthread_mutex_destroy(&pool->shards[idx].lock);
+  }
+  pthread_key_delete(pool->home);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->available);
+#endif
+  free(pool->shards);
+  free(pool);
+}
+
+/* opens connections for dbi_pool_warmup() and stores them in the
+   shards in turn */
+static void *_warmup_main(void *arg) {
+  dbi_warmup_t *warmup = arg;
+  dbi_pool_t *pool = warmup->pool;
+  dbi_pool_shard_t *shard;
+  dbi_conn_t *conn;
+  int connected;
+
+  _pool_lock(pool);
+  while (warmup->remaining && !pool->freeing && pool->stats.numconns < pool->maxconns) {
+    warmup->remaining--;
+    pool->stats.numconns++;
+    conn = _pool_open(pool);
+    if (conn) {
+      _pool_unlock(pool);
+      connected = dbi_conn_connect((dbi_conn)conn);
+      if (connected < 0) {
+	dbi_conn_close((dbi_conn)conn);
+      }
+      _pool_lock(pool);
+      if (connected >= 0) {
+	conn->pool = pool;
+	conn->pool_idle_since = _now_ms();
+	shard = &pool->shards[pool->stats.created % pool->numshards];
+	_shard_lock(shard);
+	conn->pool_next = shard->idle;
+	shard->idle = conn;
+	shard->numidle++;
+	_shard_unlock(shard);
+	pool->stats.created++;
+	warmup->ready++;
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&pool->available);
+#endif
+	continue;
+      }
+    }
+    pool->stats.failed++;
+    pool->stats.numconns--;
+  }
+
+  warmup->running--;
+  pool->warming--;
+  if (warmup->abandoned && !warmup->running) {
+    free(warmup);
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_broadcast(&pool->available);
+#endif
+  _pool_unlock(pool);
+  return NULL;
+}
+
+static void _pool_lock(dbi_pool_t *pool) {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void _pool_unlock(dbi_pool_t *pool) {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+static void _shard_lock(dbi_pool_shard_t *shard) {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&shard->lock);
+#endif
+}
+
+static int _shard_trylock(dbi_pool_shard_t *shard) {
+#ifdef HAVE_PTHREAD_H
+  return pthread_mutex_trylock(&shard->lock);
+#else
+  return 0;
+#endif
+}
+
+static void _shard_unlock(dbi_pool_shard_t *shard) {
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&shard->lock);
+#endif
+}
+
+/* waits until a connection may be available. Returns -1 once the
+   deadline has passed, a deadline of 0 waits forever */
+static int _pool_wait(dbi_pool_t *pool, long long deadline) {
+#ifdef HAVE_PTHREAD_H
+#ifndef DBI_POOL_MONOTONIC
+  struct timeval now;
+#endif
+  struct timespec until;
+  long long wait = DBI_POOL_RECHECK;
+
+  if (deadline) {
+    wait = deadline-_now_ms();
+    if (wait <= 0) {
+      return -1;
+    }
+    if (wait > DBI_POOL_RECHECK) {
+      wait = DBI_POOL_RECHECK;
+    }
+  }
+  /* the deadline is on the monotonic clock. Otherwise the condition
+     only waits for a short slice, so a clock which is set does little
+     harm */
+#ifdef DBI_POOL_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &until);
+#else
+  gettimeofday(&now, NULL);
+  until.tv_sec = now.tv_sec;
+  until.tv_nsec = now.tv_usec*1000L;
+#endif
+  until.tv_sec += wait/1000;
+  until.tv_nsec += (wait%1000)*1000000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(&pool->available, &pool->lock, &until);
+  return 0;
+#else
+  /* nobody else can check in a connection meanwhile */
+  return -1;
+#endif
+}
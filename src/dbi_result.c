@@ -37,6 +37,7 @@
 
 #include <dbi/dbi.h>
 #include <dbi/dbi-dev.h>
+#include <dbi/dbd.h>
 
 #ifdef __MINGW32__
 #define strtok_r(s1,s2,s3) strtok(s1,s2)
@@ -55,6 +56,7 @@ static void _activate_bindings(dbi_result_t *result);
 static unsigned int _parse_field_formatstr(const char *format, char ***tokens_dest, char ***fieldnames_dest);
 static void _free_string_list(char **ptrs, int total);
 static void _free_result_rows(dbi_result_t *result);
+static size_t _get_string_length(dbi_row_t *row, unsigned int fieldidx);
 int _disjoin_from_conn(dbi_result_t *result);
 
 static void _bind_helper_char(_field_binding_t *binding);
@@ -78,6 +80,7 @@ static void _bind_helper_datetime(_field_binding_t *binding);
 /* returns 1 if ok, 0 on error */
 int dbi_result_seek_row(dbi_result Result, unsigned long long rowidx) {
   int retval;
+  long long start;
 
   if (!RESULT) {
     _error_handler(/*RESULT->conn*/ NULL, DBI_ERROR_BADPTR);
@@ -100,6 +103,7 @@ int dbi_result_seek_row(dbi_result Result, unsigned long long rowidx) {
   }
 	
   /* row is one-based for the user, but zero-based to the dbd conn */
+  start = _stats_clock(RESULT->conn);
   retval = RESULT->conn->driver->functions->goto_row(RESULT, rowidx-1);
   if (retval == -1) {
     _error_handler(RESULT->conn, DBI_ERROR_DBD);
@@ -110,6 +114,8 @@ int dbi_result_seek_row(dbi_result Result, unsigned long long rowidx) {
     _error_handler(RESULT->conn, DBI_ERROR_DBD);
     return 0;
   }
+  _stats_count_row(RESULT, rowidx, start);
+  if (RESULT->conn->trace) _trace_fetch(RESULT, 1, start);
 
   RESULT->currowidx = rowidx;
   _activate_bindings(RESULT);
@@ -505,29 +511,20 @@ int dbi_result_field_is_null_idx(dbi_result Result, unsigned int fieldidx) {
 }
 
 int _disjoin_from_conn(dbi_result_t *result) {
-  /* todo: is int enough? */
-  int idx;
-  int found = -1;
+  dbi_conn_t *conn = result->conn;
+  dbi_result_t *last;
   int retval;
 
-  retval = result->conn->driver->functions->free_query(result);
+  retval = conn->driver->functions->free_query(result);
 
-  for (idx = 0; idx < result->conn->results_used; idx++) {
-    if (found < 0) {
-      /* keep looking */
-      if (result->conn->results[idx] == result) {
-        found = idx;
-        result->conn->results[idx] = NULL;
-      }
-    }
-    else {
-      /* already found, shift remaining elements back one */
-      result->conn->results[idx-1] = result->conn->results[idx];
-    }
-  }
-  if (found >= 0) {
-    result->conn->results[result->conn->results_used-1] = NULL;
-    result->conn->results_used--;
+  if (result->conn_slot >= 0) {
+    /* move the last result into the slot, the order does not matter */
+    conn->results_used--;
+    last = conn->results[conn->results_used];
+    conn->results[result->conn_slot] = last;
+    last->conn_slot = result->conn_slot;
+    conn->results[conn->results_used] = NULL;
+    result->conn_slot = -1;
   }
 
   result->conn = NULL;
@@ -545,6 +542,7 @@ int dbi_result_free(dbi_result Result) {
   if (!RESULT) return -1;
 	
   if (RESULT->conn) {
+    if (RESULT->conn->trace) _trace_result_free(RESULT);
     retval = _disjoin_from_conn(RESULT);
   }
 
@@ -1375,6 +1373,7 @@ long long dbi_result_get_as_longlong(dbi_result Result, const char *fieldname) {
 
 long long dbi_result_get_as_longlong_idx(dbi_result Result, unsigned int fieldidx) {
   long long ERROR = 0;
+  long long value;
   fieldidx--;
 
   switch (RESULT->field_types[fieldidx]) {
@@ -1410,8 +1409,9 @@ long long dbi_result_get_as_longlong_idx(dbi_result Result, unsigned int fieldid
       return 0; /* do not raise an error */
     }
     /* else if field size == 0: empty string */
-    /* todo: do we need strtoll() error handling? */
-    return strtoll((const char *)(RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_string), NULL, 10);
+    _dbd_parse_longlong(RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_string,
+			_get_string_length(RESULT->rows[RESULT->currowidx], fieldidx), &value);
+    return value;
   case DBI_TYPE_BINARY:
     return 0; /* do not raise an error */
   case DBI_TYPE_DATETIME:
@@ -1422,6 +1422,73 @@ long long dbi_result_get_as_longlong_idx(dbi_result Result, unsigned int fieldid
   }
 }
 
+double dbi_result_get_as_double(dbi_result Result, const char *fieldname) {
+  double ERROR = 0.0;
+  unsigned int fieldidx;
+  dbi_error_flag errflag;
+
+  _reset_conn_error(RESULT->conn);
+
+  fieldidx = _find_field(RESULT, fieldname, &errflag);
+  if (errflag != DBI_ERROR_NONE) {
+    dbi_conn_t *conn = RESULT->conn;
+    _error_handler(conn, DBI_ERROR_BADNAME);
+    return ERROR;
+  }
+  return dbi_result_get_as_double_idx(Result, fieldidx+1);
+}
+
+double dbi_result_get_as_double_idx(dbi_result Result, unsigned int fieldidx) {
+  double ERROR = 0.0;
+  double value;
+  fieldidx--;
+
+  switch (RESULT->field_types[fieldidx]) {
+  case DBI_TYPE_INTEGER:
+    switch (RESULT->field_attribs[fieldidx] & DBI_INTEGER_SIZEMASK) {
+    case DBI_INTEGER_SIZE1:
+      return (double)RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_char;
+    case DBI_INTEGER_SIZE2:
+      return (double)RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_short;
+    case DBI_INTEGER_SIZE3:
+    case DBI_INTEGER_SIZE4:
+      return (double)RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_long;
+    case DBI_INTEGER_SIZE8:
+      return (double)RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_longlong;
+    default:
+      _error_handler(RESULT->conn, DBI_ERROR_BADTYPE);
+      return ERROR;
+    }
+  case DBI_TYPE_DECIMAL:
+    switch (RESULT->field_attribs[fieldidx] & DBI_DECIMAL_SIZEMASK) {
+    case DBI_DECIMAL_SIZE4:
+      return (double)RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_float;
+    case DBI_DECIMAL_SIZE8:
+      return RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_double;
+    default:
+      _error_handler(RESULT->conn, DBI_ERROR_BADTYPE);
+      return ERROR;
+    }
+  case DBI_TYPE_STRING:
+    if (RESULT->rows[RESULT->currowidx]->field_sizes[fieldidx] == 0
+	&& RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_string == NULL) {
+      /* string does not exist */
+      return 0.0; /* do not raise an error */
+    }
+    /* else if field size == 0: empty string */
+    _dbd_parse_double(RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_string,
+		      _get_string_length(RESULT->rows[RESULT->currowidx], fieldidx), &value);
+    return value;
+  case DBI_TYPE_BINARY:
+    return 0.0; /* do not raise an error */
+  case DBI_TYPE_DATETIME:
+    return (double)(RESULT->rows[RESULT->currowidx]->field_values[fieldidx].d_datetime);
+  default:
+    _error_handler(RESULT->conn, DBI_ERROR_BADTYPE);
+    return ERROR;
+  }
+}
+
 char *dbi_result_get_as_string_copy(dbi_result Result, const char *fieldname) {
   char *ERROR = "ERROR";
   unsigned int fieldidx;
@@ -1719,6 +1786,15 @@ static unsigned int _find_field(dbi_result_t *result, const char *fieldname, dbi
   return 0;
 }
 
+/* some drivers report a size of 0 for all strings, so fall back to
+   strlen() unless the size is known */
+static size_t _get_string_length(dbi_row_t *row, unsigned int fieldidx) {
+  if (row->field_sizes[fieldidx] == 0 && row->field_values[fieldidx].d_string) {
+    return strlen(row->field_values[fieldidx].d_string);
+  }
+  return row->field_sizes[fieldidx];
+}
+
 static int _is_row_fetched(dbi_result_t *result, unsigned long long row) {
   if (!result->rows || (row >= result->numrows_matched)) return -1;
   return !(result->rows[row] == NULL);
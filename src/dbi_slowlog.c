@@ -0,0 +1,366 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (the slow query log. Queries which take at least SlowQueryMs
+ * milliseconds are put into a ring buffer of the instance, which a
+ * thread of its own writes to the file descriptor SlowQueryFd. Putting
+ * an entry never waits: if the ring is full the entry is dropped and
+ * only counted)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+/* the ring holds this many entries, a power of two */
+#define DBI_SLOWLOG_ENTRIES 128
+/* longer statements are cut */
+#define DBI_SLOWLOG_STATEMENT 480
+#define DBI_SLOWLOG_DATABASE 64
+
+/* seconds the writer sleeps if it misses a wakeup */
+#define DBI_SLOWLOG_POLL 1
+
+typedef struct dbi_slowlog_entry_s {
+  unsigned long sequence; /* position it may be claimed at, one more once it is filled */
+  int fd;
+  const void *conn;
+  const char *driver;
+  unsigned long long duration; /* microseconds */
+  unsigned long long numrows_matched;
+  unsigned long long numrows_affected;
+  int failed;
+  size_t length; /* of the whole statement */
+  char database[DBI_SLOWLOG_DATABASE];
+  char statement[DBI_SLOWLOG_STATEMENT];
+} dbi_slowlog_entry_t;
+
+typedef struct dbi_slowlog_s {
+  dbi_slowlog_entry_t entries[DBI_SLOWLOG_ENTRIES];
+  unsigned long head; /* next position the query threads claim */
+  unsigned long tail; /* next position the writer takes */
+  unsigned long dropped; /* entries which did not fit */
+  unsigned long reported; /* dropped entries the writer logged */
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_mutex_t lock; /* only taken by the writer and to stop it */
+  pthread_cond_t wakeup;
+#endif
+  int stopping;
+} dbi_slowlog_t;
+
+static void _fill_entry(dbi_slowlog_entry_t *entry, dbi_conn_t *conn, const char *statement,
+			size_t length, dbi_result_t *result, unsigned long long elapsed);
+static void _write_entry(const dbi_slowlog_entry_t *entry);
+static void _write_all(int fd, const char *buffer, size_t length);
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+static dbi_slowlog_entry_t *_claim_entry(dbi_slowlog_t *slowlog);
+static int _write_next(dbi_slowlog_t *slowlog);
+static void _write_dropped(dbi_slowlog_t *slowlog, int fd);
+static void *_slowlog_main(void *arg);
+#endif
+
+/* starts the writer of the slow query log of inst. Without threads or
+   atomic operations it fails, and entries are written by the thread
+   running the query */
+int _start_slowlog(dbi_inst_t *inst) {
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+  dbi_slowlog_t *slowlog;
+  unsigned long idx;
+
+  slowlog = calloc(1, sizeof(dbi_slowlog_t));
+  if (!slowlog) {
+    return -1;
+  }
+  for (idx = 0; idx < DBI_SLOWLOG_ENTRIES; idx++) {
+    slowlog->entries[idx].sequence = idx;
+  }
+  pthread_mutex_init(&slowlog->lock, NULL);
+  pthread_cond_init(&slowlog->wakeup, NULL);
+
+  if (pthread_create(&slowlog->thread, NULL, _slowlog_main, slowlog) != 0) {
+    pthread_mutex_destroy(&slowlog->lock);
+    pthread_cond_destroy(&slowlog->wakeup);
+    free(slowlog);
+    return -1;
+  }
+  inst->slowlog = slowlog;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* writes the entries left and stops the writer */
+void _stop_slowlog(dbi_inst_t *inst) {
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+  dbi_slowlog_t *slowlog = inst->slowlog;
+
+  if (!slowlog) {
+    return;
+  }
+
+  pthread_mutex_lock(&slowlog->lock);
+  slowlog->stopping = 1;
+  pthread_cond_signal(&slowlog->wakeup);
+  pthread_mutex_unlock(&slowlog->lock);
+
+  pthread_join(slowlog->thread, NULL);
+  inst->slowlog = NULL;
+
+  pthread_mutex_destroy(&slowlog->lock);
+  pthread_cond_destroy(&slowlog->wakeup);
+  free(slowlog);
+#endif
+}
+
+/* logs the query if it took at least SlowQueryMs since start */
+void _slowlog_query(dbi_conn_t *conn, const char *statement, size_t length, dbi_result_t *result, long long start) {
+  dbi_slowlog_entry_t local;
+  long long elapsed;
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+  dbi_slowlog_t *slowlog = conn->driver->dbi_inst->slowlog;
+  dbi_slowlog_entry_t *entry;
+#endif
+
+  if (start < 0) {
+    return;
+  }
+  elapsed = _now_us()-start;
+  if (elapsed < (long long)conn->slow_query_ms*1000) {
+    return;
+  }
+  if (elapsed < 0) {
+    elapsed = 0;
+  }
+
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+  if (slowlog) {
+    entry = _claim_entry(slowlog);
+    if (!entry) {
+      __atomic_fetch_add(&slowlog->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    _fill_entry(entry, conn, statement, length, result, (unsigned long long)elapsed);
+    /* publishes the entry to the writer */
+    __atomic_store_n(&entry->sequence, entry->sequence+1, __ATOMIC_RELEASE);
+    /* without the lock the writer may miss this, and finds the entry
+       when it wakes up by itself */
+    pthread_cond_signal(&slowlog->wakeup);
+    return;
+  }
+#endif
+  _fill_entry(&local, conn, statement, length, result, (unsigned long long)elapsed);
+  _write_entry(&local);
+}
+
+/* PRIVATE */
+
+static void _fill_entry(dbi_slowlog_entry_t *entry, dbi_conn_t *conn, const char *statement,
+			size_t length, dbi_result_t *result, unsigned long long elapsed) {
+  dbi_option_t *option;
+  const char *database;
+  size_t copied;
+  size_t idx;
+
+  entry->fd = conn->slow_query_fd;
+  entry->conn = conn;
+  entry->driver = conn->driver->info->name;
+  entry->duration = elapsed;
+  entry->numrows_matched = result ? result->numrows_matched : 0;
+  entry->numrows_affected = result ? result->numrows_affected : 0;
+  entry->failed = (result == NULL);
+
+  /* dbi_conn_get_option() would reset the error of a failed query */
+  database = conn->current_db;
+  if (!database) {
+    option = _find_option_node(conn, "dbname");
+    database = option ? option->string_value : NULL;
+  }
+  for (idx = 0; database && database[idx] && idx < DBI_SLOWLOG_DATABASE-1; idx++) {
+    entry->database[idx] = database[idx];
+  }
+  entry->database[idx] = '\0';
+
+  /* one line per entry, statements with line breaks are joined */
+  copied = (length < DBI_SLOWLOG_STATEMENT) ? length : DBI_SLOWLOG_STATEMENT-1;
+  for (idx = 0; idx < copied; idx++) {
+    entry->statement[idx] = (statement[idx] == '\n' || statement[idx] == '\r'
+			     || statement[idx] == '\0') ? ' ' : statement[idx];
+  }
+  entry->statement[copied] = '\0';
+  entry->length = length;
+}
+
+static void _write_entry(const dbi_slowlog_entry_t *entry) {
+  char line[DBI_SLOWLOG_STATEMENT+DBI_SLOWLOG_DATABASE+256];
+  int used;
+
+  used = snprintf(line, sizeof(line),
+		  "libdbi: [slow] %llu.%03llu ms, %llu rows matched, %llu affected%s, conn %p, driver %s, db %s: %s%s\n",
+		  entry->duration/1000, entry->duration%1000,
+		  entry->numrows_matched, entry->numrows_affected,
+		  entry->failed ? ", failed" : "", entry->conn, entry->driver,
+		  *entry->database ? entry->database : "-", entry->statement,
+		  (entry->length >= DBI_SLOWLOG_STATEMENT) ? "..." : "");
+  if (used < 0) {
+    return;
+  }
+  if ((size_t)used >= sizeof(line)) {
+    used = sizeof(line)-1;
+    line[used-1] = '\n';
+  }
+  _write_all(entry->fd, line, (size_t)used);
+}
+
+/* the writer may block here, the query threads never do */
+static void _write_all(int fd, const char *buffer, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = write(fd, buffer, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return;
+    }
+    buffer += written;
+    length -= (size_t)written;
+  }
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(DBI_ATOMICS)
+
+/* claims the entry at the head of the ring, or returns NULL if the
+   writer did not take it yet. Any number of threads may claim entries
+   at the same time, each gets its own */
+static dbi_slowlog_entry_t *_claim_entry(dbi_slowlog_t *slowlog) {
+  dbi_slowlog_entry_t *entry;
+  unsigned long position;
+  unsigned long sequence;
+  long difference;
+
+  position = __atomic_load_n(&slowlog->head, __ATOMIC_RELAXED);
+  for (;;) {
+    entry = &slowlog->entries[position & (DBI_SLOWLOG_ENTRIES-1)];
+    sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    difference = (long)(sequence-position);
+    if (difference == 0) {
+      /* on failure position is set to the current head */
+      if (__atomic_compare_exchange_n(&slowlog->head, &position, position+1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	return entry;
+      }
+    }
+    else if (difference < 0) {
+      /* still filled from the last round */
+      return NULL;
+    }
+    else {
+      /* another thread claimed it meanwhile */
+      position = __atomic_load_n(&slowlog->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* writes the entry at the tail of the ring. Returns 0 if it is not
+   filled yet */
+static int _write_next(dbi_slowlog_t *slowlog) {
+  dbi_slowlog_entry_t *entry = &slowlog->entries[slowlog->tail & (DBI_SLOWLOG_ENTRIES-1)];
+
+  if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != slowlog->tail+1) {
+    return 0;
+  }
+  _write_entry(entry);
+  _write_dropped(slowlog, entry->fd);
+
+  /* hands the entry back for the next round */
+  __atomic_store_n(&entry->sequence, slowlog->tail+DBI_SLOWLOG_ENTRIES, __ATOMIC_RELEASE);
+  slowlog->tail++;
+  return 1;
+}
+
+/* notes the entries dropped since the last note, on the descriptor of
+   the first entry which made it */
+static void _write_dropped(dbi_slowlog_t *slowlog, int fd) {
+  char line[80];
+  unsigned long dropped = __atomic_load_n(&slowlog->dropped, __ATOMIC_RELAXED);
+  int used;
+
+  if (dropped == slowlog->reported) {
+    return;
+  }
+  used = snprintf(line, sizeof(line), "libdbi: [slow] %lu slow queries were not logged\n",
+		  dropped-slowlog->reported);
+  slowlog->reported = dropped;
+  if (used > 0 && (size_t)used < sizeof(line)) {
+    _write_all(fd, line, (size_t)used);
+  }
+}
+
+static void *_slowlog_main(void *arg) {
+  dbi_slowlog_t *slowlog = arg;
+  dbi_slowlog_entry_t *entry;
+  struct timespec until;
+  int stopping;
+
+  for (;;) {
+    while (_write_next(slowlog))
+      ;
+
+    pthread_mutex_lock(&slowlog->lock);
+    stopping = slowlog->stopping;
+    entry = &slowlog->entries[slowlog->tail & (DBI_SLOWLOG_ENTRIES-1)];
+    if (!stopping && __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != slowlog->tail+1) {
+      until.tv_sec = time(NULL)+DBI_SLOWLOG_POLL;
+      until.tv_nsec = 0;
+      pthread_cond_timedwait(&slowlog->wakeup, &slowlog->lock, &until);
+    }
+    pthread_mutex_unlock(&slowlog->lock);
+
+    if (stopping) {
+      /* the connections are closed, nothing is put anymore */
+      while (_write_next(slowlog))
+	;
+      return NULL;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (statistics of connections. Queries, errors, rows and bytes are always
+ * counted, latencies only if the option LatencyHistograms is set, as
+ * they cost two reads of the clock)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+static void _stats_record(dbi_histogram *histogram, long long start);
+static unsigned int _bucket_index(unsigned long long elapsed);
+static unsigned long long _bucket_bound(unsigned int idx);
+static void _histogram_add(dbi_histogram *total, const dbi_histogram *histogram);
+
+int dbi_conn_get_stats(dbi_conn Conn, dbi_conn_stats *stats) {
+  dbi_conn_t *conn = Conn;
+
+  if (!conn || !stats) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+  memset(stats, 0, sizeof(dbi_conn_stats));
+  _stats_add(stats, &conn->stats);
+  return 0;
+}
+
+/* returns the latency in microseconds below which percentile percent
+   of the recorded ones are. This is the upper bound of the sub-bucket
+   it falls into, and never more than the longest latency */
+unsigned long long dbi_histogram_percentile(const dbi_histogram *histogram, double percentile) {
+  unsigned long long rank;
+  unsigned long long seen = 0;
+  unsigned long long bound;
+  unsigned int idx;
+
+  if (!histogram || histogram->count == 0) {
+    return 0;
+  }
+  if (percentile <= 0.0) {
+    rank = 1;
+  }
+  else if (percentile >= 100.0) {
+    rank = histogram->count;
+  }
+  else {
+    rank = (unsigned long long)(percentile*histogram->count/100.0+0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+  }
+  for (idx = 0; idx < DBI_HISTOGRAM_BUCKETS-1; idx++) {
+    seen += histogram->buckets[idx];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  bound = _bucket_bound(idx);
+  return (idx == DBI_HISTOGRAM_BUCKETS-1 || bound > histogram->max) ? histogram->max : bound;
+}
+
+/* returns the time to pass to the _stats_count_*() and _trace_*()
+   functions after the operation, or -1 if conn neither records
+   latencies nor is traced nor logs slow queries */
+long long _stats_clock(dbi_conn_t *conn) {
+  if (!conn->timed) {
+    return -1;
+  }
+  return _now_us();
+}
+
+void _stats_count_connect(dbi_conn_t *conn, long long start) {
+  if (conn->latency_histograms) {
+    _stats_record(&conn->stats.connect, start);
+  }
+}
+
+void _stats_count_query(dbi_conn_t *conn, size_t length, dbi_result_t *result, long long start) {
+  DBI_STAT_ADD(conn->stats.queries, 1);
+  if (!result) {
+    DBI_STAT_ADD(conn->stats.errors, 1);
+  }
+  DBI_STAT_ADD(conn->stats.bytes, length);
+  if (conn->latency_histograms) {
+    _stats_record(&conn->stats.query, start);
+  }
+}
+
+/* counts a row the driver fetched, with the size of its string and
+   binary fields */
+void _stats_count_row(dbi_result_t *result, unsigned long long rowidx, long long start) {
+  dbi_conn_t *conn = result->conn;
+  dbi_row_t *row = result->rows ? result->rows[rowidx] : NULL;
+  unsigned long long bytes = 0;
+  unsigned int idx;
+
+  if (row) {
+    for (idx = 0; idx < result->numfields; idx++) {
+      bytes += row->field_sizes[idx];
+    }
+  }
+  DBI_STAT_ADD(conn->stats.rows, 1);
+  DBI_STAT_ADD(conn->stats.bytes, bytes);
+  if (conn->latency_histograms) {
+    _stats_record(&conn->stats.fetch_row, start);
+  }
+}
+
+/* adds stats, which may be written meanwhile, to total */
+void _stats_add(dbi_conn_stats *total, const dbi_conn_stats *stats) {
+  total->queries += DBI_STAT_GET(stats->queries);
+  total->errors += DBI_STAT_GET(stats->errors);
+  total->rows += DBI_STAT_GET(stats->rows);
+  total->bytes += DBI_STAT_GET(stats->bytes);
+  _histogram_add(&total->connect, &stats->connect);
+  _histogram_add(&total->query, &stats->query);
+  _histogram_add(&total->fetch_row, &stats->fetch_row);
+}
+
+/* microseconds of a clock which is not set back */
+long long _now_us(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+    return (long long)now.tv_sec*1000000+now.tv_nsec/1000;
+  }
+#endif
+#ifdef HAVE_SYS_TIME_H
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000+tv.tv_usec;
+  }
+#else
+  return (long long)time(NULL)*1000000;
+#endif
+}
+
+/* PRIVATE */
+
+/* records the time since start, unless it is -1 */
+static void _stats_record(dbi_histogram *histogram, long long start) {
+  unsigned long long elapsed;
+  unsigned int idx;
+
+  if (start < 0) {
+    return;
+  }
+  start = _now_us()-start;
+  elapsed = (start > 0) ? (unsigned long long)start : 0;
+  idx = _bucket_index(elapsed);
+  DBI_STAT_ADD(histogram->count, 1);
+  DBI_STAT_ADD(histogram->total, elapsed);
+  DBI_STAT_ADD(histogram->buckets[idx], 1);
+  if (elapsed > DBI_STAT_GET(histogram->max)) {
+    DBI_STAT_SET(histogram->max, elapsed);
+  }
+}
+
+/* the bits of the sub-bucket in a power of two */
+#define DBI_SUBBUCKET_BITS 2
+
+/* the most significant bit of elapsed selects the power of two, the
+   next DBI_SUBBUCKET_BITS the sub-bucket */
+static unsigned int _bucket_index(unsigned long long elapsed) {
+  unsigned long long bits;
+  unsigned int exponent = 0;
+  unsigned int idx;
+
+  if (elapsed < DBI_HISTOGRAM_SUBBUCKETS) {
+    return (unsigned int)elapsed;
+  }
+  for (bits = elapsed >> 1; bits; bits >>= 1) {
+    exponent++;
+  }
+  idx = DBI_HISTOGRAM_SUBBUCKETS*(exponent-DBI_SUBBUCKET_BITS+1)
+    + (unsigned int)((elapsed >> (exponent-DBI_SUBBUCKET_BITS)) & (DBI_HISTOGRAM_SUBBUCKETS-1));
+  return (idx < DBI_HISTOGRAM_BUCKETS) ? idx : DBI_HISTOGRAM_BUCKETS-1;
+}
+
+/* the longest latency counted in bucket idx */
+static unsigned long long _bucket_bound(unsigned int idx) {
+  unsigned int shift;
+  unsigned int sub;
+
+  if (idx < DBI_HISTOGRAM_SUBBUCKETS) {
+    return idx;
+  }
+  shift = idx/DBI_HISTOGRAM_SUBBUCKETS-1;
+  sub = idx%DBI_HISTOGRAM_SUBBUCKETS;
+  return ((unsigned long long)(DBI_HISTOGRAM_SUBBUCKETS+sub+1) << shift)-1;
+}
+
+static void _histogram_add(dbi_histogram *total, const dbi_histogram *histogram) {
+  unsigned long long max = DBI_STAT_GET(histogram->max);
+  unsigned int idx;
+
+  total->count += DBI_STAT_GET(histogram->count);
+  total->total += DBI_STAT_GET(histogram->total);
+  if (max > total->max) {
+    total->max = max;
+  }
+  for (idx = 0; idx < DBI_HISTOGRAM_BUCKETS; idx++) {
+    total->buckets[idx] += DBI_STAT_GET(histogram->buckets[idx]);
+  }
+}
@@ -0,0 +1,731 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (prepared statements and their emulation for drivers without native support)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <locale.h>
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+// cast the opaque parameter to our struct pointer
+#define STMT ((dbi_stmt_t*)Stmt)
+
+/* number of parsed statements kept per connection if the
+   StatementCacheSize option is not set */
+#define DBI_TEMPLATE_CACHE_SIZE 32
+
+static dbi_param_t *_get_param(dbi_stmt_t *stmt, unsigned int paramidx);
+static int _bind_copy(dbi_stmt_t *stmt, unsigned int paramidx, unsigned short type, const void *value, size_t length);
+static const char *_render_statement(dbi_stmt_t *stmt, size_t *length);
+static int _sql_decimal_point(char *number, int length);
+static dbi_template_t *_get_template(dbi_conn_t *conn, const char *statement);
+static void _release_template(dbi_template_t *tmpl);
+static unsigned int _get_template_cache_size(dbi_conn_t *conn);
+static void _unlink_stmt(dbi_stmt_t *stmt);
+
+dbi_stmt dbi_conn_prepare(dbi_conn Conn, const char *statement) {
+  dbi_conn_t *conn = Conn;
+  dbi_stmt_t *stmt;
+  dbi_template_t *tmpl;
+
+  if (!conn) return NULL;
+
+  _reset_conn_error(conn);
+
+  if (!statement) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  tmpl = _get_template(conn, statement);
+  if (!tmpl) {
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+
+  stmt = calloc(1, sizeof(dbi_stmt_t));
+  if (!stmt || (tmpl->numparams && !(stmt->params = calloc(tmpl->numparams, sizeof(dbi_param_t))))) {
+    free(stmt);
+    _release_template(tmpl);
+    _error_handler(conn, DBI_ERROR_NOMEM);
+    return NULL;
+  }
+  stmt->conn = conn;
+  stmt->tmpl = tmpl;
+  stmt->statement = tmpl->statement;
+  stmt->numparams = tmpl->numparams;
+  stmt->placeholders = tmpl->placeholders;
+
+  /* so that closing the connection can free the driver's handle */
+  stmt->next = conn->stmts;
+  if (conn->stmts) {
+    conn->stmts->prev = stmt;
+  }
+  conn->stmts = stmt;
+
+  if (conn->driver->functions->prepare) {
+    _logquery(conn, "[prepare] %s\n", statement);
+
+    /* the driver may leave stmt_handle at NULL if it prefers to
+       have the statement emulated */
+    if (conn->driver->functions->prepare(stmt) < 0) {
+      stmt->stmt_handle = NULL;
+      dbi_stmt_free((dbi_stmt)stmt);
+      _error_handler(conn, DBI_ERROR_DBD);
+      return NULL;
+    }
+  }
+
+  return (dbi_stmt)stmt;
+}
+
+dbi_conn dbi_stmt_get_conn(dbi_stmt Stmt) {
+  if (!STMT) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  return STMT->conn;
+}
+
+unsigned int dbi_stmt_get_numparams(dbi_stmt Stmt) {
+  if (!STMT) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return DBI_FIELD_ERROR;
+  }
+
+  if (!STMT->conn) {
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return DBI_FIELD_ERROR;
+  }
+
+  _reset_conn_error(STMT->conn);
+
+  return STMT->numparams;
+}
+
+/* STMT: bind_* functions. Parameters are numbered from 1, like
+   fields in the *_idx functions. Strings and binaries are copied, so
+   the caller may reuse its buffers right after binding */
+
+int dbi_stmt_bind_int(dbi_stmt Stmt, unsigned int paramidx, int value) {
+  dbi_param_t *param = _get_param(STMT, paramidx);
+
+  if (!param) return DBI_BIND_ERROR;
+
+  param->type = DBI_TYPE_INTEGER;
+  param->attribs = DBI_INTEGER_SIZE4;
+  param->flags = 0;
+  param->value.d_long = value;
+  return 0;
+}
+
+int dbi_stmt_bind_longlong(dbi_stmt Stmt, unsigned int paramidx, long long value) {
+  dbi_param_t *param = _get_param(STMT, paramidx);
+
+  if (!param) return DBI_BIND_ERROR;
+
+  param->type = DBI_TYPE_INTEGER;
+  param->attribs = DBI_INTEGER_SIZE8;
+  param->flags = 0;
+  param->value.d_longlong = value;
+  return 0;
+}
+
+int dbi_stmt_bind_double(dbi_stmt Stmt, unsigned int paramidx, double value) {
+  dbi_param_t *param = _get_param(STMT, paramidx);
+
+  if (!param) return DBI_BIND_ERROR;
+
+  param->type = DBI_TYPE_DECIMAL;
+  param->attribs = DBI_DECIMAL_SIZE8;
+  param->flags = 0;
+  param->value.d_double = value;
+  return 0;
+}
+
+int dbi_stmt_bind_string(dbi_stmt Stmt, unsigned int paramidx, const char *value) {
+  if (!value) {
+    return dbi_stmt_bind_null(Stmt, paramidx);
+  }
+  return _bind_copy(STMT, paramidx, DBI_TYPE_STRING, value, strlen(value));
+}
+
+int dbi_stmt_bind_binary(dbi_stmt Stmt, unsigned int paramidx, const unsigned char *value, size_t length) {
+  if (!value) {
+    return dbi_stmt_bind_null(Stmt, paramidx);
+  }
+  return _bind_copy(STMT, paramidx, DBI_TYPE_BINARY, value, length);
+}
+
+int dbi_stmt_bind_datetime(dbi_stmt Stmt, unsigned int paramidx, time_t value) {
+  dbi_param_t *param = _get_param(STMT, paramidx);
+
+  if (!param) return DBI_BIND_ERROR;
+
+  param->type = DBI_TYPE_DATETIME;
+  param->attribs = DBI_DATETIME_DATE|DBI_DATETIME_TIME;
+  param->flags = 0;
+  param->value.d_datetime = value;
+  return 0;
+}
+
+int dbi_stmt_bind_null(dbi_stmt Stmt, unsigned int paramidx) {
+  dbi_param_t *param = _get_param(STMT, paramidx);
+
+  if (!param) return DBI_BIND_ERROR;
+
+  /* keep the type of a previous binding, drivers may need it */
+  if (!param->type) {
+    param->type = DBI_TYPE_STRING;
+  }
+  param->flags = DBI_VALUE_NULL;
+  return 0;
+}
+
+dbi_result dbi_stmt_execute(dbi_stmt Stmt) {
+  dbi_conn_t *conn;
+  dbi_result_t *result;
+  const char *statement;
+  size_t length;
+  unsigned int idx;
+
+  if (!STMT) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+
+  conn = STMT->conn;
+  if (!conn) {
+    /* the connection was closed */
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return NULL;
+  }
+  _reset_conn_error(conn);
+
+  for (idx = 0; idx < STMT->numparams; idx++) {
+    if (!STMT->params[idx].type) {
+      /* parameter was never bound */
+      _error_handler(conn, DBI_ERROR_BADIDX);
+      return NULL;
+    }
+  }
+
+  if (STMT->stmt_handle) {
+    _logquery(conn, "[execute] %s\n", STMT->statement);
+    result = conn->driver->functions->stmt_execute(STMT);
+  }
+  else {
+    statement = _render_statement(STMT, &length);
+    if (!statement) {
+      /* error was set by the quoting functions or the allocator */
+      if (conn->error_flag == DBI_ERROR_NONE) {
+	_error_handler(conn, DBI_ERROR_NOMEM);
+      }
+      return NULL;
+    }
+    _logquery(conn, "[execute] %s\n", statement);
+    result = _conn_query(conn, statement, length);
+  }
+
+  if (result == NULL) {
+    _error_handler(conn, DBI_ERROR_DBD);
+  }
+
+  return (dbi_result)result;
+}
+
+int dbi_stmt_free(dbi_stmt Stmt) {
+  int retval = 0;
+  unsigned int idx;
+
+  if (!STMT) return -1;
+
+  /* without a connection, its closing freed the driver's handle */
+  if (STMT->conn) {
+    _reset_conn_error(STMT->conn);
+
+    if (STMT->stmt_handle) {
+      retval = STMT->conn->driver->functions->stmt_free(STMT);
+    }
+    if (retval == -1) {
+      _error_handler(STMT->conn, DBI_ERROR_DBD);
+    }
+    _unlink_stmt(STMT);
+  }
+
+  for (idx = 0; STMT->params && idx < STMT->numparams; idx++) {
+    free(STMT->params[idx].copy);
+  }
+
+  free(STMT->params);
+  _release_template(STMT->tmpl);
+  free(STMT);
+  return retval;
+}
+
+/* frees the driver's handles of the statements of a connection which
+   is being closed. The statements stay valid until dbi_stmt_free(), but
+   fail with DBI_ERROR_BADOBJECT */
+void _detach_stmts(dbi_conn_t *conn) {
+  dbi_stmt_t *stmt;
+
+  while ((stmt = conn->stmts) != NULL) {
+    if (stmt->stmt_handle) {
+      conn->driver->functions->stmt_free(stmt);
+      stmt->stmt_handle = NULL;
+    }
+    _unlink_stmt(stmt);
+    stmt->conn = NULL;
+  }
+}
+
+/* PRIVATE */
+
+static void _unlink_stmt(dbi_stmt_t *stmt) {
+  if (stmt->prev) {
+    stmt->prev->next = stmt->next;
+  }
+  else {
+    stmt->conn->stmts = stmt->next;
+  }
+  if (stmt->next) {
+    stmt->next->prev = stmt->prev;
+  }
+  stmt->prev = stmt->next = NULL;
+}
+
+/* finds the '?' placeholders outside of quoted strings, quoted
+   identifiers, and comments. Stores their offsets into placeholders
+   unless it is NULL. Quotes are closed by the next matching quote
+   character as in SQL92, so a doubled quote simply starts a new
+   string. If backslash_escapes is set, as for MySQL, a backslash in a
+   string also escapes the character after it */
+unsigned int _count_placeholders(const char *statement, size_t *placeholders, int backslash_escapes) {
+  const char *cur = statement;
+  unsigned int count = 0;
+  char quote;
+
+  while (*cur) {
+    switch (*cur) {
+    case '\'':
+    case '"':
+    case '`':
+      quote = *cur++;
+      while (*cur && *cur != quote) {
+	if (*cur == '\\' && backslash_escapes && quote != '`' && cur[1]) {
+	  cur++;
+	}
+	cur++;
+      }
+      break;
+    case '-':
+      if (cur[1] == '-') {
+	while (*cur && *cur != '\n') {
+	  cur++;
+	}
+	continue;
+      }
+      break;
+    case '/':
+      if (cur[1] == '*') {
+	cur += 2;
+	while (*cur && !(*cur == '*' && cur[1] == '/')) {
+	  cur++;
+	}
+	if (*cur) {
+	  cur++;
+	}
+      }
+      break;
+    case '?':
+      if (placeholders) {
+	placeholders[count] = cur-statement;
+      }
+      count++;
+      break;
+    default:
+      break;
+    }
+    if (*cur) {
+      cur++;
+    }
+  }
+
+  return count;
+}
+
+static dbi_param_t *_get_param(dbi_stmt_t *stmt, unsigned int paramidx) {
+  if (!stmt) {
+    _error_handler(NULL, DBI_ERROR_BADPTR);
+    return NULL;
+  }
+  if (!stmt->conn) {
+    _error_handler(NULL, DBI_ERROR_BADOBJECT);
+    return NULL;
+  }
+
+  _reset_conn_error(stmt->conn);
+
+  if (paramidx < 1 || paramidx > stmt->numparams) {
+    _error_handler(stmt->conn, DBI_ERROR_BADIDX);
+    return NULL;
+  }
+
+  return &stmt->params[paramidx-1];
+}
+
+static int _bind_copy(dbi_stmt_t *stmt, unsigned int paramidx, unsigned short type, const void *value, size_t length) {
+  dbi_param_t *param = _get_param(stmt, paramidx);
+  char *copy;
+
+  if (!param) return DBI_BIND_ERROR;
+
+  /* the copy is zero-terminated for the sake of the quoting functions */
+  if (param->capacity < length+1) {
+    copy = realloc(param->copy, length+1);
+    if (!copy) {
+      _error_handler(stmt->conn, DBI_ERROR_NOMEM);
+      return DBI_BIND_ERROR;
+    }
+    param->copy = copy;
+    param->capacity = length+1;
+  }
+
+  memcpy(param->copy, value, length);
+  param->copy[length] = '\0';
+  param->value.d_string = param->copy;
+  param->type = type;
+  param->attribs = 0;
+  param->flags = 0;
+  param->length = length;
+  return 0;
+}
+
+/* makes room for extra more bytes after the first used bytes of
+   *buffer, growing it geometrically. Returns 0 on success, -1 if out
+   of memory */
+int _buffer_reserve(char **buffer, size_t *size, size_t used, size_t extra) {
+  char *newbuffer;
+  size_t newsize;
+
+  if (used+extra <= *size) {
+    return 0;
+  }
+
+  newsize = *size*2;
+  if (newsize < used+extra) {
+    newsize = used+extra;
+  }
+
+  newbuffer = realloc(*buffer, newsize);
+  if (!newbuffer) {
+    return -1;
+  }
+  *buffer = newbuffer;
+  *size = newsize;
+  return 0;
+}
+
+/* appends the SQL literal of a bound value to *buffer. Returns 0 on
+   success, -1 on error */
+int _render_param(dbi_conn_t *conn, const dbi_param_t *param, char **buffer, size_t *size, size_t *used) {
+  unsigned char *quoted;
+  size_t quoted_length;
+  struct tm utctime;
+  int rendered;
+
+  /* enough for all but strings and binaries */
+  if (_buffer_reserve(buffer, size, *used, 32) < 0) {
+    return -1;
+  }
+
+  if (param->flags & DBI_VALUE_NULL) {
+    memcpy(*buffer+*used, "NULL", 4);
+    *used += 4;
+    return 0;
+  }
+
+  switch (param->type) {
+  case DBI_TYPE_INTEGER:
+    if (param->attribs & DBI_INTEGER_SIZE8) {
+      *used += snprintf(*buffer+*used, 32, "%lld", param->value.d_longlong);
+    }
+    else {
+      *used += snprintf(*buffer+*used, 32, "%d", param->value.d_long);
+    }
+    break;
+  case DBI_TYPE_DECIMAL:
+    rendered = snprintf(*buffer+*used, 32, "%.17g", param->value.d_double);
+    /* there is no SQL literal for nan and inf. The text is checked as
+       isnan() and isinf() are always false with -ffast-math */
+    if (strpbrk(*buffer+*used, "ni")) {
+      _error_handler(conn, DBI_ERROR_BADTYPE);
+      return -1;
+    }
+    *used += _sql_decimal_point(*buffer+*used, rendered);
+    break;
+  case DBI_TYPE_STRING:
+    /* worst case, we have to escape every character and add 2*2 surrounding quotes */
+    if (_buffer_reserve(buffer, size, *used, (param->length*2)+4+1) < 0) {
+      return -1;
+    }
+    quoted_length = conn->driver->functions->conn_quote_string(conn, param->value.d_string, *buffer+*used);
+    if (!quoted_length) {
+      return -1;
+    }
+    *used += quoted_length;
+    break;
+  case DBI_TYPE_BINARY:
+    quoted = NULL;
+    quoted_length = conn->driver->functions->quote_binary(conn, (const unsigned char *)param->value.d_string, param->length, &quoted);
+    if (!quoted_length || _buffer_reserve(buffer, size, *used, quoted_length) < 0) {
+      free(quoted);
+      return -1;
+    }
+    memcpy(*buffer+*used, quoted, quoted_length);
+    *used += quoted_length;
+    free(quoted);
+    break;
+  case DBI_TYPE_DATETIME:
+#ifdef HAVE_GMTIME_R
+    if (!gmtime_r(&param->value.d_datetime, &utctime)) {
+      return -1;
+    }
+#else
+    {
+      struct tm *shared = gmtime(&param->value.d_datetime);
+
+      if (!shared) {
+	return -1;
+      }
+      utctime = *shared;
+    }
+#endif
+    *used += snprintf(*buffer+*used, 32, "'%04d-%02d-%02d %02d:%02d:%02d'", utctime.tm_year+1900, utctime.tm_mon+1, utctime.tm_mday, utctime.tm_hour, utctime.tm_min, utctime.tm_sec);
+    break;
+  default:
+    _error_handler(conn, DBI_ERROR_BADTYPE);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* snprintf() writes the decimal point of LC_NUMERIC, which is a comma
+   in many locales. Replaces it with the '.' of SQL in the zero-terminated
+   number, returns the new length */
+static int _sql_decimal_point(char *number, int length) {
+  const char *point = localeconv()->decimal_point;
+  size_t pointlen;
+  char *found;
+
+  if (!point || !*point || (point[0] == '.' && !point[1])) {
+    return length;
+  }
+  found = strstr(number, point);
+  if (!found) {
+    return length;
+  }
+  pointlen = strlen(point);
+  *found = '.';
+  memmove(found+1, found+pointlen, length-(found-number)-pointlen+1);
+  return length-(int)(pointlen-1);
+}
+
+/* substitutes the quoted values of all parameters for their
+   placeholders. Returns a zero-terminated statement in the render
+   buffer of the connection, which is kept for the next execution */
+static const char *_render_statement(dbi_stmt_t *stmt, size_t *length) {
+  dbi_conn_t *conn = stmt->conn;
+  size_t used = 0;
+  size_t literal_start = 0;
+  size_t literal_length;
+  unsigned int idx;
+
+  if (_buffer_reserve(&conn->render_buffer, &conn->render_size, 0, stmt->tmpl->length+(32*stmt->numparams)+1) < 0) {
+    return NULL;
+  }
+
+  for (idx = 0; idx < stmt->numparams; idx++) {
+    /* copy the literal SQL up to the placeholder */
+    literal_length = stmt->placeholders[idx]-literal_start;
+    if (_buffer_reserve(&conn->render_buffer, &conn->render_size, used, literal_length) < 0) {
+      return NULL;
+    }
+    memcpy(conn->render_buffer+used, stmt->statement+literal_start, literal_length);
+    used += literal_length;
+    literal_start = stmt->placeholders[idx]+1;
+
+    if (_render_param(conn, &stmt->params[idx], &conn->render_buffer, &conn->render_size, &used) < 0) {
+      return NULL;
+    }
+  }
+
+  /* the rest of the statement including the terminating zero byte */
+  literal_length = stmt->tmpl->length-literal_start+1;
+  if (_buffer_reserve(&conn->render_buffer, &conn->render_size, used, literal_length) < 0) {
+    return NULL;
+  }
+  memcpy(conn->render_buffer+used, stmt->statement+literal_start, literal_length);
+  *length = used+literal_length-1;
+  return conn->render_buffer;
+}
+
+/* STATEMENT TEMPLATE CACHE */
+
+static unsigned int _get_template_cache_size(dbi_conn_t *conn) {
+  /* StatementCacheSize is decoded when it is set */
+  if (conn->template_cache_size < 0) {
+    return DBI_TEMPLATE_CACHE_SIZE;
+  }
+  return (unsigned int)conn->template_cache_size;
+}
+
+/* returns the template of statement with a reference held for the
+   caller. Recently used templates are looked up by hash in the cache
+   of the connection, otherwise the statement is parsed and cached */
+static dbi_template_t *_get_template(dbi_conn_t *conn, const char *statement) {
+  dbi_template_t *tmpl;
+  dbi_template_t **link;
+  unsigned long hash = 2166136261UL; /* FNV-1a */
+  size_t length;
+  unsigned int cache_size;
+  int backslash_escapes;
+
+  for (length = 0; statement[length]; length++) {
+    hash = (hash ^ (unsigned char)statement[length]) * 16777619UL;
+  }
+
+  for (tmpl = conn->template_buckets[hash % DBI_TEMPLATE_BUCKETS]; tmpl; tmpl = tmpl->hash_next) {
+    if (tmpl->hash == hash && tmpl->length == length
+	&& !memcmp(tmpl->statement, statement, length)) {
+      if (tmpl != conn->templates) {
+	/* move to the front of the list */
+	tmpl->prev->next = tmpl->next;
+	if (tmpl->next) {
+	  tmpl->next->prev = tmpl->prev;
+	}
+	else {
+	  conn->templates_tail = tmpl->prev;
+	}
+	tmpl->prev = NULL;
+	tmpl->next = conn->templates;
+	conn->templates->prev = tmpl;
+	conn->templates = tmpl;
+      }
+      tmpl->refcount++;
+      return tmpl;
+    }
+  }
+
+  tmpl = calloc(1, sizeof(dbi_template_t));
+  if (!tmpl) return NULL;
+
+  tmpl->statement = malloc(length+1);
+  backslash_escapes = _conn_has_cap(conn, DBI_CAP_BACKSLASH_ESCAPES);
+  tmpl->numparams = _count_placeholders(statement, NULL, backslash_escapes);
+  if (tmpl->numparams) {
+    tmpl->placeholders = calloc(tmpl->numparams, sizeof(size_t));
+  }
+  if (!tmpl->statement || (tmpl->numparams && !tmpl->placeholders)) {
+    free(tmpl->statement);
+    free(tmpl);
+    return NULL;
+  }
+  memcpy(tmpl->statement, statement, length+1);
+  _count_placeholders(statement, tmpl->placeholders, backslash_escapes);
+  tmpl->length = length;
+  tmpl->hash = hash;
+  tmpl->refcount = 1;
+
+  cache_size = _get_template_cache_size(conn);
+  if (cache_size == 0) {
+    return tmpl; /* owned by the statement alone */
+  }
+
+  while (conn->templates_used >= cache_size) {
+    /* evict the least recently used template */
+    dbi_template_t *lru = conn->templates_tail;
+    conn->templates_tail = lru->prev;
+    if (lru->prev) {
+      lru->prev->next = NULL;
+    }
+    else {
+      conn->templates = NULL;
+    }
+    link = &conn->template_buckets[lru->hash % DBI_TEMPLATE_BUCKETS];
+    while (*link != lru) {
+      link = &(*link)->hash_next;
+    }
+    *link = lru->hash_next;
+    conn->templates_used--;
+    _release_template(lru);
+  }
+
+  tmpl->next = conn->templates;
+  if (conn->templates) {
+    conn->templates->prev = tmpl;
+  }
+  else {
+    conn->templates_tail = tmpl;
+  }
+  conn->templates = tmpl;
+  link = &conn->template_buckets[hash % DBI_TEMPLATE_BUCKETS];
+  tmpl->hash_next = *link;
+  *link = tmpl;
+  conn->templates_used++;
+  tmpl->refcount++; /* the cache's reference */
+  return tmpl;
+}
+
+static void _release_template(dbi_template_t *tmpl) {
+  if (--tmpl->refcount > 0) {
+    return;
+  }
+  free(tmpl->placeholders);
+  free(tmpl->statement);
+  free(tmpl);
+}
+
+void _free_template_cache(dbi_conn_t *conn) {
+  dbi_template_t *tmpl = conn->templates;
+  dbi_template_t *next;
+
+  while (tmpl) {
+    next = tmpl->next;
+    _release_template(tmpl);
+    tmpl = next;
+  }
+  conn->templates = conn->templates_tail = NULL;
+  memset(conn->template_buckets, 0, sizeof(conn->template_buckets));
+  conn->templates_used = 0;
+}
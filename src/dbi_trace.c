@@ -0,0 +1,115 @@
+/*
+ * libdbi - database independent abstraction layer for C.
+ * Copyright (C) 2001-2003, David Parker and Mark Tobenkin.
+ * http://libdbi.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ * (tracing of queries. The callbacks of a connection are called when a
+ * query starts and ends, when rows are fetched and when a result is
+ * freed. The hooks are only called if conn->trace is set)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+
+static unsigned long long _elapsed_us(long long start);
+
+int dbi_conn_set_trace(dbi_conn Conn, const dbi_trace_callbacks *callbacks, void *user_argument) {
+  dbi_conn_t *conn = Conn;
+
+  if (!conn) {
+    _error_handler(conn, DBI_ERROR_BADPTR);
+    return -1;
+  }
+
+  _reset_conn_error(conn);
+
+  if (!callbacks) {
+    free(conn->trace);
+    conn->trace = NULL;
+    conn->trace_argument = NULL;
+  }
+  else {
+    if (!conn->trace) {
+      conn->trace = malloc(sizeof(dbi_trace_callbacks));
+      if (!conn->trace) {
+	_error_handler(conn, DBI_ERROR_NOMEM);
+	return -1;
+      }
+    }
+    *conn->trace = *callbacks;
+    conn->trace_argument = user_argument;
+  }
+  conn->timed = DBI_CONN_TIMED(conn);
+  return 0;
+}
+
+void _trace_query_start(dbi_conn_t *conn, const char *statement, size_t length) {
+  if (conn->trace->query_start) {
+    conn->trace->query_start((dbi_conn)conn, statement, length, conn->trace_argument);
+  }
+}
+
+void _trace_query_end(dbi_conn_t *conn, dbi_result_t *result, long long start) {
+  dbi_query_trace trace;
+
+  if (!conn->trace->query_end) {
+    return;
+  }
+  trace.duration = _elapsed_us(start);
+  trace.numrows_matched = result ? result->numrows_matched : 0;
+  trace.numrows_affected = result ? result->numrows_affected : 0;
+  trace.failed = (result == NULL);
+  conn->trace->query_end((dbi_conn)conn, (dbi_result)result, &trace, conn->trace_argument);
+}
+
+/* numrows were fetched from the database since start */
+void _trace_fetch(dbi_result_t *result, unsigned long long numrows, long long start) {
+  dbi_conn_t *conn = result->conn;
+
+  if (conn->trace->fetch) {
+    conn->trace->fetch((dbi_conn)conn, (dbi_result)result, numrows, _elapsed_us(start), conn->trace_argument);
+  }
+}
+
+void _trace_result_free(dbi_result_t *result) {
+  dbi_conn_t *conn = result->conn;
+
+  if (conn->trace->result_free) {
+    conn->trace->result_free((dbi_conn)conn, (dbi_result)result, conn->trace_argument);
+  }
+}
+
+/* PRIVATE */
+
+static unsigned long long _elapsed_us(long long start) {
+  long long elapsed;
+
+  if (start < 0) {
+    return 0;
+  }
+  elapsed = _now_us()-start;
+  return (elapsed > 0) ? (unsigned long long)elapsed : 0;
+}
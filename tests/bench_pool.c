@@ -0,0 +1,133 @@
+/*
+ * bench_pool: measures how many checkouts per second a connection pool
+ * handles with an increasing number of threads. Each thread checks a
+ * connection out and in again, without using it.
+ *
+ * usage: bench_pool driverdir driver [option=value ...]
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <dbi/dbi.h>
+
+#define MAXTHREADS 64
+#define SECONDS 2
+
+static dbi_pool pool;
+static volatile int running;
+
+static double now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void *worker(void *arg) {
+	unsigned long *checkouts = arg;
+	dbi_conn conn;
+
+	while (running) {
+		conn = dbi_pool_checkout(pool, -1);
+		if (!conn) {
+			break;
+		}
+		dbi_pool_checkin(pool, conn);
+		(*checkouts)++;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_conn conns[MAXTHREADS];
+	pthread_t threads[MAXTHREADS];
+	unsigned long checkouts[MAXTHREADS];
+	unsigned long total;
+	dbi_pool_stats stats;
+	double start;
+	double elapsed;
+	const char *errmsg;
+	char *value;
+	int numthreads;
+	int idx;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s driverdir driver [option=value ...]\n", argv[0]);
+		return 1;
+	}
+
+	if (dbi_initialize_r(argv[1], &inst) < 1) {
+		fprintf(stderr, "no drivers found in %s\n", argv[1]);
+		return 1;
+	}
+
+	pool = dbi_pool_new_r(argv[2], inst);
+	if (!pool) {
+		fprintf(stderr, "cannot create a pool for driver %s\n", argv[2]);
+		dbi_shutdown_r(inst);
+		return 1;
+	}
+	conn = dbi_pool_get_template(pool);
+	for (idx = 3; idx < argc; idx++) {
+		value = strchr(argv[idx], '=');
+		if (!value) {
+			continue;
+		}
+		*value++ = '\0';
+		dbi_conn_set_option(conn, argv[idx], value);
+	}
+
+	/* open all connections up front, so that no checkout has to wait */
+	dbi_pool_set_limits(pool, MAXTHREADS, MAXTHREADS);
+	dbi_pool_set_idle_times(pool, -1, -1);
+	for (idx = 0; idx < MAXTHREADS; idx++) {
+		conns[idx] = dbi_pool_checkout(pool, -1);
+		if (!conns[idx]) {
+			dbi_conn_error(conn, &errmsg);
+			fprintf(stderr, "cannot connect: %s\n", errmsg);
+			dbi_pool_free(pool);
+			dbi_shutdown_r(inst);
+			return 1;
+		}
+	}
+	for (idx = 0; idx < MAXTHREADS; idx++) {
+		dbi_pool_checkin(pool, conns[idx]);
+	}
+
+	printf("threads  checkouts/s\n");
+	for (numthreads = 1; numthreads <= MAXTHREADS; numthreads *= 2) {
+		running = 1;
+		start = now();
+		for (idx = 0; idx < numthreads; idx++) {
+			checkouts[idx] = 0;
+			pthread_create(&threads[idx], NULL, worker, &checkouts[idx]);
+		}
+		while (now()-start < SECONDS) {
+			sleep(1);
+		}
+		running = 0;
+		total = 0;
+		for (idx = 0; idx < numthreads; idx++) {
+			pthread_join(threads[idx], NULL);
+			total += checkouts[idx];
+		}
+		elapsed = now()-start;
+		printf("%7d  %11.0f\n", numthreads, total/elapsed);
+	}
+
+	dbi_pool_get_stats(pool, &stats);
+	printf("\nconnections: %u, created: %lu, waits: %llu ms total, %lu ms max\n",
+	       stats.numconns, stats.created, stats.wait_total, stats.wait_max);
+
+	dbi_pool_free(pool);
+	dbi_shutdown_r(inst);
+	return 0;
+}
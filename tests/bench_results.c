@@ -0,0 +1,147 @@
+/*
+ * bench_results: measures the cost of registering results with their
+ * connection. 100k results of a trivial query are created and freed on
+ * one connection, first one at a time and then all kept alive at once,
+ * which is where a linear search on free used to hurt.
+ *
+ * usage: bench_results driverdir driver [option=value ...]
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <dbi/dbi.h>
+
+#define NUMRESULTS 100000
+#define QUERY "SELECT 1"
+
+static double now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static int create_results(dbi_conn conn, dbi_result *results, int numresults) {
+	const char *errmsg;
+	int idx;
+
+	for (idx = 0; idx < numresults; idx++) {
+		results[idx] = dbi_conn_query(conn, QUERY);
+		if (!results[idx]) {
+			dbi_conn_error(conn, &errmsg);
+			fprintf(stderr, "query failed: %s\n", errmsg);
+			while (idx--) {
+				dbi_result_free(results[idx]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_result *results;
+	dbi_result result;
+	const char *errmsg;
+	char *value;
+	double start;
+	double created;
+	double elapsed;
+	int idx;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s driverdir driver [option=value ...]\n", argv[0]);
+		return 1;
+	}
+
+	if (dbi_initialize_r(argv[1], &inst) < 1) {
+		fprintf(stderr, "no drivers found in %s\n", argv[1]);
+		return 1;
+	}
+
+	conn = dbi_conn_new_r(argv[2], inst);
+	if (!conn) {
+		fprintf(stderr, "cannot load driver %s\n", argv[2]);
+		dbi_shutdown_r(inst);
+		return 1;
+	}
+	for (idx = 3; idx < argc; idx++) {
+		value = strchr(argv[idx], '=');
+		if (!value) {
+			continue;
+		}
+		*value++ = '\0';
+		dbi_conn_set_option(conn, argv[idx], value);
+	}
+	if (dbi_conn_connect(conn) < 0) {
+		dbi_conn_error(conn, &errmsg);
+		fprintf(stderr, "cannot connect: %s\n", errmsg);
+		dbi_shutdown_r(inst);
+		return 1;
+	}
+
+	results = malloc(NUMRESULTS*sizeof(dbi_result));
+	if (!results) {
+		dbi_shutdown_r(inst);
+		return 1;
+	}
+
+	printf("%d results of \"%s\"\n\n", NUMRESULTS, QUERY);
+	printf("pattern                 create s    free s\n");
+
+	/* one live result at a time */
+	start = now();
+	for (idx = 0; idx < NUMRESULTS; idx++) {
+		result = dbi_conn_query(conn, QUERY);
+		if (!result) {
+			dbi_conn_error(conn, &errmsg);
+			fprintf(stderr, "query failed: %s\n", errmsg);
+			break;
+		}
+		dbi_result_free(result);
+	}
+	elapsed = now()-start;
+	printf("query and free       %11.3f         -\n", elapsed);
+
+	/* all results alive, freed oldest first */
+	start = now();
+	if (create_results(conn, results, NUMRESULTS) == 0) {
+		created = now();
+		for (idx = 0; idx < NUMRESULTS; idx++) {
+			dbi_result_free(results[idx]);
+		}
+		printf("free oldest first    %11.3f %9.3f\n", created-start, now()-created);
+	}
+
+	/* all results alive, freed newest first */
+	start = now();
+	if (create_results(conn, results, NUMRESULTS) == 0) {
+		created = now();
+		for (idx = NUMRESULTS-1; idx >= 0; idx--) {
+			dbi_result_free(results[idx]);
+		}
+		printf("free newest first    %11.3f %9.3f\n", created-start, now()-created);
+	}
+
+	/* all results alive, disjoined from the connection at once */
+	start = now();
+	if (create_results(conn, results, NUMRESULTS) == 0) {
+		created = now();
+		dbi_conn_disjoin_results(conn);
+		for (idx = 0; idx < NUMRESULTS; idx++) {
+			dbi_result_free(results[idx]);
+		}
+		printf("disjoin all          %11.3f %9.3f\n", created-start, now()-created);
+	}
+
+	free(results);
+	dbi_conn_close(conn);
+	dbi_shutdown_r(inst);
+	return 0;
+}
@@ -1,5 +1,1491 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <locale.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <dbi/dbi.h>
+#include <dbi/dbi-dev.h>
+#include <dbi/dbd.h>
+
+/* the helpers below, and the functions checked with the driver of
+   this program, need no database. They are checked before the
+   interactive part */
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("FAILED: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* switches LC_NUMERIC to a locale with a decimal comma, if one of
+   the usual ones is installed */
+static int set_comma_locale(void) {
+	static const char *locales[] = { "de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR", "nl_NL.UTF-8", "ru_RU.UTF-8", NULL };
+	int idx;
+
+	for (idx = 0; locales[idx]; idx++) {
+		if (setlocale(LC_NUMERIC, locales[idx]) && *localeconv()->decimal_point == ',') {
+			return 1;
+		}
+	}
+	setlocale(LC_NUMERIC, "C");
+	return 0;
+}
+
+static void test_codecs(void) {
+	const unsigned char binary[] = { 0x00, 0x0a, 0x1b, 0xff, 0x80 };
+	const unsigned char symbols[] = { 0xfb, 0xef, 0xbe, 0xff, 0xfb, 0xef, 0xbe, 0xff, 0xfb, 0xef, 0xbe, 0xff };
+	unsigned char long_binary[48];
+	unsigned char decoded[64];
+	char encoded[128];
+	int idx;
+
+	CHECK(_dbd_encode_hex(binary, 5, encoded) == 10);
+	CHECK(strcmp(encoded, "000a1bff80") == 0);
+	CHECK(_dbd_encode_hex(binary, 5, NULL) == 10);
+	CHECK(_dbd_decode_hex("000A1bFf80", 10, decoded) == 5);
+	CHECK(memcmp(decoded, binary, 5) == 0);
+	CHECK(_dbd_decode_hex("0a1", 3, decoded) == DBI_LENGTH_ERROR);
+	CHECK(_dbd_decode_hex("0g", 2, decoded) == DBI_LENGTH_ERROR);
+	CHECK(_dbd_decode_hex("", 0, decoded) == 0);
+
+	CHECK(_dbd_quote_binary_hex(binary, 2, encoded, DBD_HEX_SQL92) == 7);
+	CHECK(strcmp(encoded, "X'000a'") == 0);
+	CHECK(_dbd_quote_binary_hex(binary, 2, encoded, DBD_HEX_BYTEA) == 8);
+	CHECK(strcmp(encoded, "'\\x000a'") == 0);
+
+	CHECK(_dbd_encode_base64((const unsigned char *)"foobar", 6, encoded) == 8);
+	CHECK(strcmp(encoded, "Zm9vYmFy") == 0);
+	CHECK(_dbd_encode_base64((const unsigned char *)"fooba", 5, encoded) == 8);
+	CHECK(strcmp(encoded, "Zm9vYmE=") == 0);
+	CHECK(_dbd_encode_base64((const unsigned char *)"f", 1, encoded) == 4);
+	CHECK(strcmp(encoded, "Zg==") == 0);
+	CHECK(_dbd_encode_base64(symbols, 12, encoded) == 16);
+	CHECK(strcmp(encoded, "++++//vvvv/7777/") == 0);
+	CHECK(_dbd_decode_base64(encoded, 16, decoded) == 12);
+	CHECK(memcmp(decoded, symbols, 12) == 0);
+	CHECK(_dbd_decode_base64("Zm9vYmE=", 8, decoded) == 5);
+	CHECK(memcmp(decoded, "fooba", 5) == 0);
+	CHECK(_dbd_decode_base64("Zg", 2, decoded) == 1);
+	CHECK(decoded[0] == 'f');
+	CHECK(_dbd_encode_base64(binary, 5, encoded) == 8);
+	CHECK(_dbd_decode_base64(encoded, 8, decoded) == 5);
+	CHECK(memcmp(decoded, binary, 5) == 0);
+	CHECK(_dbd_decode_base64("Zm9v!mFy", 8, decoded) == DBI_LENGTH_ERROR);
+	CHECK(_dbd_decode_base64("Zm9vY", 5, decoded) == DBI_LENGTH_ERROR);
+
+	/* long enough for the vector loops and their tails */
+	for (idx = 0; idx < 48; idx++) {
+		long_binary[idx] = idx*5;
+	}
+	CHECK(_dbd_encode_hex(long_binary, 47, encoded) == 94);
+	CHECK(strcmp(encoded, "00050a0f14191e23282d32373c41464b50555a5f64696e73787d82878c91969ba0a5aaafb4b9bec3c8cdd2d7dce1e6") == 0);
+	CHECK(_dbd_decode_hex("00050A0F14191E23282D32373C41464B50555A5F64696E73787D82878C91969BA0A5AAAFB4B9BEC3C8CDD2D7DCE1E6", 94, decoded) == 47);
+	CHECK(memcmp(decoded, long_binary, 47) == 0);
+	CHECK(_dbd_encode_base64(long_binary, 48, encoded) == 64);
+	CHECK(strcmp(encoded, "AAUKDxQZHiMoLTI3PEFGS1BVWl9kaW5zeH2Ch4yRlpugpaqvtLm+w8jN0tfc4ebr") == 0);
+	CHECK(_dbd_decode_base64(encoded, 64, decoded) == 48);
+	CHECK(memcmp(decoded, long_binary, 48) == 0);
+	encoded[21] = '-';
+	CHECK(_dbd_decode_base64(encoded, 64, decoded) == DBI_LENGTH_ERROR);
+	encoded[21] = '\x80';
+	CHECK(_dbd_decode_base64(encoded, 64, decoded) == DBI_LENGTH_ERROR);
+}
+
+static void test_number_parsers(void) {
+	long long integer;
+	double real;
+
+	CHECK(_dbd_parse_longlong("12345678901234567", 17, &integer) == 17);
+	CHECK(integer == 12345678901234567LL);
+	CHECK(_dbd_parse_longlong("  -42abc", 8, &integer) == 5);
+	CHECK(integer == -42);
+	CHECK(_dbd_parse_longlong("+7", 2, &integer) == 2);
+	CHECK(integer == 7);
+	/* the length bounds the digits, the data need not be terminated */
+	CHECK(_dbd_parse_longlong("123456789", 4, &integer) == 4);
+	CHECK(integer == 1234);
+	CHECK(_dbd_parse_longlong("99999999999999999999", 20, &integer) == 20);
+	CHECK(integer == LLONG_MAX);
+	CHECK(_dbd_parse_longlong("-99999999999999999999", 21, &integer) == 21);
+	CHECK(integer == LLONG_MIN);
+	CHECK(_dbd_parse_longlong("-9223372036854775808", 20, &integer) == 20);
+	CHECK(integer == LLONG_MIN);
+	CHECK(_dbd_parse_longlong("abc", 3, &integer) == 0);
+	CHECK(integer == 0);
+	CHECK(_dbd_parse_longlong("-", 1, &integer) == 0);
+
+	CHECK(_dbd_parse_double("3.25", 4, &real) == 4);
+	CHECK(real == 3.25);
+	CHECK(_dbd_parse_double("-0.1", 4, &real) == 4);
+	CHECK(real == -0.1);
+	CHECK(_dbd_parse_double("1.5e3x", 6, &real) == 5);
+	CHECK(real == 1500.0);
+	CHECK(_dbd_parse_double("2.5E-2", 6, &real) == 6);
+	CHECK(real == 0.025);
+	CHECK(_dbd_parse_double("1.23456", 4, &real) == 4);
+	CHECK(real == 1.23);
+	/* outside the fast path, strtod() rounds */
+	CHECK(_dbd_parse_double("1e300", 5, &real) == 5);
+	CHECK(real == 1e300);
+	CHECK(_dbd_parse_double("12345678901234567890123", 23, &real) == 23);
+	CHECK(real == 12345678901234567890123.0);
+	CHECK(_dbd_parse_double("NaN", 3, &real) == 3);
+	CHECK(real != real);
+	CHECK(_dbd_parse_double("x1", 2, &real) == 0);
+	CHECK(real == 0.0);
+	CHECK(_dbd_parse_double("0x1p3", 5, &real) == 5);
+	CHECK(real == 8.0);
+	CHECK(_dbd_parse_double("-0X.8", 5, &real) == 5);
+	CHECK(real == -0.5);
+
+	/* databases send a decimal point whatever the locale says */
+	if (set_comma_locale()) {
+		CHECK(_dbd_parse_double("1.2345678901234567890123", 24, &real) == 24);
+		CHECK(real == 1.2345678901234567890123);
+		CHECK(_dbd_parse_double("-2.5e400", 8, &real) == 8);
+		CHECK(real == -HUGE_VAL);
+		CHECK(_dbd_parse_double("-0,5", 4, &real) == 2);
+		CHECK(real == 0.0);
+		setlocale(LC_NUMERIC, "C");
+	}
+}
+
+static void test_placeholders(void) {
+	size_t offsets[4];
+
+	CHECK(_count_placeholders("SELECT 1", NULL, 0) == 0);
+	CHECK(_count_placeholders("SELECT ?, ? FROM t WHERE a = ?", offsets, 0) == 3);
+	CHECK(offsets[0] == 7 && offsets[1] == 10 && offsets[2] == 29);
+	/* not in strings, quoted identifiers or comments */
+	CHECK(_count_placeholders("SELECT '?', \"?\", `?` -- ?\n, ?", offsets, 0) == 1);
+	CHECK(offsets[0] == 28);
+	CHECK(_count_placeholders("SELECT /* ? */ ? /* ?", offsets, 0) == 1);
+	CHECK(offsets[0] == 15);
+	/* a doubled quote starts a new string */
+	CHECK(_count_placeholders("SELECT 'it''s ?', ?", NULL, 0) == 1);
+	/* a backslash escapes the quote only if the engine says so */
+	CHECK(_count_placeholders("SELECT 'a\\', ?", NULL, 0) == 1);
+	CHECK(_count_placeholders("SELECT 'a\\', ?", NULL, 1) == 0);
+	CHECK(_count_placeholders("SELECT 'a\\\\', ?", NULL, 1) == 1);
+}
+
+static void test_render_param(void) {
+	dbi_param_t param;
+	char *buffer = NULL;
+	size_t size = 0;
+	size_t used;
+
+	/* only types which need no quoting by the driver, so there is no
+	   connection */
+	memset(&param, 0, sizeof(param));
+	param.type = DBI_TYPE_INTEGER;
+	param.value.d_long = -12;
+	used = 0;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+	CHECK(used == 3 && memcmp(buffer, "-12", 3) == 0);
+
+	param.attribs = DBI_INTEGER_SIZE8;
+	param.value.d_longlong = 9007199254740993LL;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+	CHECK(used == 19 && memcmp(buffer, "-129007199254740993", 19) == 0);
+
+	param.type = DBI_TYPE_DECIMAL;
+	param.attribs = DBI_DECIMAL_SIZE8;
+	param.value.d_double = 0.1;
+	used = 0;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+	CHECK(used == 19 && memcmp(buffer, "0.10000000000000001", 19) == 0);
+
+	/* there is no SQL literal for nan and inf */
+	param.value.d_double = strtod("nan", NULL);
+	used = 0;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == -1);
+	param.value.d_double = -strtod("inf", NULL);
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == -1);
+	CHECK(used == 0);
+
+	param.type = DBI_TYPE_DATETIME;
+	param.attribs = DBI_DATETIME_DATE|DBI_DATETIME_TIME;
+	param.value.d_datetime = 86400*365+3661;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+	CHECK(used == 21 && memcmp(buffer, "'1971-01-01 01:01:01'", 21) == 0);
+
+	/* SQL wants a decimal point whatever the locale says */
+	if (set_comma_locale()) {
+		param.type = DBI_TYPE_DECIMAL;
+		param.attribs = DBI_DECIMAL_SIZE8;
+		param.value.d_double = -2.5;
+		used = 0;
+		CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+		CHECK(used == 4 && memcmp(buffer, "-2.5", 4) == 0);
+		setlocale(LC_NUMERIC, "C");
+	}
+	else {
+		printf("No locale with a decimal comma, skipping its checks.\n");
+	}
+
+	param.flags = DBI_VALUE_NULL;
+	used = 0;
+	CHECK(_render_param(NULL, &param, &buffer, &size, &used) == 0);
+	CHECK(used == 4 && memcmp(buffer, "NULL", 4) == 0);
+
+	free(buffer);
+}
+
+/* splits a line in COPY text format into at most 8 fields the way
+   dbi_copy_put_buffer() does, returns the number of fields */
+static unsigned int decode_copy_line(char *line, const char **fields) {
+	char *read = line;
+	char *end = line+strlen(line);
+	unsigned int numfields = 0;
+
+	for (;;) {
+		fields[numfields++] = _copy_decode_field(&read, end);
+		if (read == end || numfields == 8) {
+			return numfields;
+		}
+		read++;
+	}
+}
+
+static void test_copy_decoding(void) {
+	const char *fields[8];
+	char line[64];
+
+	strcpy(line, "1\t\\N\tNaN\t\\x41\\101\\t\\\\");
+	CHECK(decode_copy_line(line, fields) == 4);
+	CHECK(strcmp(fields[0], "1") == 0);
+	CHECK(fields[1] == NULL);
+	CHECK(strcmp(fields[2], "NaN") == 0);
+	CHECK(strcmp(fields[3], "AA\t\\") == 0);
+
+	/* \N is NULL only as the whole field */
+	strcpy(line, "ab\\Ncd\t\\N\\N\t\\\\N\t\\N");
+	CHECK(decode_copy_line(line, fields) == 4);
+	CHECK(strcmp(fields[0], "abNcd") == 0);
+	CHECK(fields[1] && strcmp(fields[1], "NN") == 0);
+	CHECK(fields[2] && strcmp(fields[2], "\\N") == 0);
+	CHECK(fields[3] == NULL);
+
+	/* empty fields, and a row with fewer fields than columns, which
+	   dbi_copy_put_buffer() skips */
+	strcpy(line, "\t");
+	CHECK(decode_copy_line(line, fields) == 2);
+	CHECK(strcmp(fields[0], "") == 0 && strcmp(fields[1], "") == 0);
+	strcpy(line, "partial");
+	CHECK(decode_copy_line(line, fields) == 1);
+	CHECK(strcmp(fields[0], "partial") == 0);
+
+	/* escapes cut short by the end of the line */
+	strcpy(line, "\\x\tq\\");
+	CHECK(decode_copy_line(line, fields) == 2);
+	CHECK(strcmp(fields[0], "x") == 0);
+	CHECK(strcmp(fields[1], "q\\") == 0);
+}
+
+/* the tests below use a driver linked into this program, which answers
+   every query itself. "SELECT n" returns n rows of one string field,
+   INSERTs affect one row per VALUES tuple, and statements containing
+   FAIL fail. The second table of it also sends queries without waiting,
+   their results are done after two calls of consume_input() */
+#define LOOP_SENT 8
+
+typedef struct {
+	char last[2048]; /* the last statement run */
+	unsigned int numqueries;
+	char sent[LOOP_SENT][128]; /* sent but not picked up yet */
+	unsigned int numsent;
+	unsigned int busy;
+} loop_conn_t;
+
+static int loop_ping_result = 1;
+
+static const dbi_info_t loop_info = { "loop", "driver of the test program", "", "", "1.0", "" };
+static const dbi_info_t loop_async_info = { "loopasync", "asynchronous driver of the test program", "", "", "1.0", "" };
+static const char *loop_no_names[] = { NULL };
+
+static void loop_register_driver(const dbi_info_t **info, const char ***custom_functions, const char ***reserved_words) {
+	*info = &loop_info;
+	*custom_functions = loop_no_names;
+	*reserved_words = loop_no_names;
+}
+
+static void loop_async_register_driver(const dbi_info_t **info, const char ***custom_functions, const char ***reserved_words) {
+	*info = &loop_async_info;
+	*custom_functions = loop_no_names;
+	*reserved_words = loop_no_names;
+}
+
+static int loop_initialize(dbi_driver_t *driver) {
+	return 0;
+}
+
+static int loop_connect(dbi_conn_t *conn) {
+	if (dbi_conn_get_option_numeric(conn, "loop_fail")) {
+		return -1;
+	}
+	conn->connection = calloc(1, sizeof(loop_conn_t));
+	if (!conn->connection) {
+		return -1;
+	}
+	if (dbi_conn_get_option_numeric(conn, "loop_bulk")) {
+		_dbd_register_conn_cap(conn, "bulk_insert", 1);
+	}
+	return 0;
+}
+
+static int loop_disconnect(dbi_conn_t *conn) {
+	free(conn->connection);
+	conn->connection = NULL;
+	return 0;
+}
+
+static int loop_fetch_row(dbi_result_t *result, unsigned long long rowidx) {
+	dbi_row_t *row = _dbd_row_allocate(1);
+
+	if (!row) {
+		return 0;
+	}
+	row->field_values[0].d_string = strdup("row");
+	row->field_sizes[0] = 3;
+	_dbd_row_finalize(result, row, rowidx);
+	return 1;
+}
+
+static int loop_free_query(dbi_result_t *result) {
+	return 0;
+}
+
+static int loop_goto_row(dbi_result_t *result, unsigned long long rowidx) {
+	return 1;
+}
+
+static int loop_get_socket(dbi_conn_t *conn) {
+	return -1;
+}
+
+static const char *loop_get_encoding(dbi_conn_t *conn) {
+	return "UTF-8";
+}
+
+static const char *loop_encoding(const char *encoding) {
+	return encoding;
+}
+
+static char *loop_get_engine_version(dbi_conn_t *conn, char *versionstring) {
+	strcpy(versionstring, "1.0");
+	return versionstring;
+}
+
+static dbi_result_t *loop_list_dbs(dbi_conn_t *conn, const char *pattern) {
+	return NULL;
+}
+
+static dbi_result_t *loop_list_tables(dbi_conn_t *conn, const char *db, const char *pattern) {
+	return NULL;
+}
+
+static dbi_result_t *loop_query(dbi_conn_t *conn, const char *statement) {
+	loop_conn_t *loop = conn->connection;
+	dbi_result_t *result;
+	unsigned long long numrows = 1;
+	const char *tuple;
+
+	snprintf(loop->last, sizeof(loop->last), "%s", statement);
+	loop->numqueries++;
+
+	if (strstr(statement, "FAIL")) {
+		return NULL;
+	}
+	if (!strncmp(statement, "SELECT ", 7)) {
+		result = _dbd_result_create(conn, NULL, strtoull(statement+7, NULL, 10), 0);
+		if (result) {
+			_dbd_result_set_numfields(result, 1);
+			_dbd_result_add_field(result, 0, "v", DBI_TYPE_STRING, 0);
+		}
+		return result;
+	}
+	if (strncmp(statement, "INSERT ", 7)) {
+		return _dbd_result_create(conn, NULL, 0, 0);
+	}
+	for (tuple = strstr(statement, "),("); tuple; tuple = strstr(tuple+3, "),(")) {
+		numrows++;
+	}
+	return _dbd_result_create(conn, NULL, 0, numrows);
+}
+
+static dbi_result_t *loop_query_null(dbi_conn_t *conn, const unsigned char *statement, size_t length) {
+	return loop_query(conn, (const char *)statement);
+}
+
+static size_t loop_quote_string(dbi_driver_t *driver, const char *orig, char *dest) {
+	char *end = dest;
+
+	*end++ = '\'';
+	for (; *orig; orig++) {
+		if (*orig == '\'') {
+			*end++ = '\'';
+		}
+		*end++ = *orig;
+	}
+	*end++ = '\'';
+	*end = '\0';
+	return end-dest;
+}
+
+static size_t loop_conn_quote_string(dbi_conn_t *conn, const char *orig, char *dest) {
+	return loop_quote_string(conn->driver, orig, dest);
+}
+
+static size_t loop_quote_binary(dbi_conn_t *conn, const unsigned char *orig, size_t length, unsigned char **dest) {
+	char *quoted = malloc(2*length+4);
+
+	if (!quoted) {
+		return 0;
+	}
+	*dest = (unsigned char *)quoted;
+	return _dbd_quote_binary_hex(orig, length, quoted, DBD_HEX_SQL92);
+}
+
+static const char *loop_select_db(dbi_conn_t *conn, const char *db) {
+	return db;
+}
+
+static int loop_geterror(dbi_conn_t *conn, int *errnum, char **errstr) {
+	*errnum = 1;
+	*errstr = strdup("the statement failed");
+	return 2;
+}
+
+static unsigned long long loop_get_seq(dbi_conn_t *conn, const char *sequence) {
+	return 0;
+}
+
+static int loop_ping(dbi_conn_t *conn) {
+	return loop_ping_result;
+}
+
+static dbi_result_t *loop_insert_batch(dbi_conn_t *conn, const char *table, const char **columns, unsigned int numcolumns, dbi_param_t *values, unsigned int numrows) {
+	loop_conn_t *loop = conn->connection;
+
+	snprintf(loop->last, sizeof(loop->last), "%u rows into %s", numrows, table);
+	loop->numqueries++;
+	return _dbd_result_create(conn, NULL, 0, numrows);
+}
+
+static int loop_send_query(dbi_conn_t *conn, const char *statement) {
+	loop_conn_t *loop = conn->connection;
+
+	if (loop->numsent == LOOP_SENT || strstr(statement, "SENDFAIL")) {
+		return -1;
+	}
+	snprintf(loop->sent[loop->numsent++], sizeof(loop->sent[0]), "%s", statement);
+	loop->busy = 2;
+	return 0;
+}
+
+static int loop_consume_input(dbi_conn_t *conn) {
+	loop_conn_t *loop = conn->connection;
+
+	if (loop->busy) {
+		loop->busy--;
+	}
+	return 0;
+}
+
+static int loop_is_busy(dbi_conn_t *conn) {
+	loop_conn_t *loop = conn->connection;
+
+	return loop->busy > 0;
+}
+
+static dbi_result_t *loop_get_result(dbi_conn_t *conn) {
+	loop_conn_t *loop = conn->connection;
+	char statement[128];
+
+	if (!loop->numsent) {
+		return NULL;
+	}
+	strcpy(statement, loop->sent[0]);
+	memmove(loop->sent[0], loop->sent[1], --loop->numsent*sizeof(loop->sent[0]));
+	loop->busy = loop->numsent ? 2 : 0;
+	return loop_query(conn, statement);
+}
+
+static const dbi_functions_t loop_functions = {
+	DBI_DRIVER_ABI_VERSION,
+	loop_register_driver,
+	loop_initialize,
+	loop_connect,
+	loop_disconnect,
+	loop_fetch_row,
+	loop_free_query,
+	loop_goto_row,
+	loop_get_socket,
+	loop_get_encoding,
+	loop_list_dbs,
+	loop_list_tables,
+	loop_query,
+	loop_query_null,
+	loop_quote_string,
+	loop_conn_quote_string,
+	loop_quote_binary,
+	loop_encoding,
+	loop_encoding,
+	loop_get_engine_version,
+	loop_select_db,
+	loop_geterror,
+	loop_get_seq,
+	loop_get_seq,
+	loop_ping,
+	NULL, NULL, NULL, /* prepared statements */
+	loop_insert_batch,
+	NULL, NULL, NULL, /* bulk loads */
+	NULL, NULL, NULL, NULL, /* asynchronous queries */
+	NULL, NULL, NULL /* pipelines */
+};
+
+static const dbi_functions_t loop_async_functions = {
+	DBI_DRIVER_ABI_VERSION,
+	loop_async_register_driver,
+	loop_initialize,
+	loop_connect,
+	loop_disconnect,
+	loop_fetch_row,
+	loop_free_query,
+	loop_goto_row,
+	loop_get_socket,
+	loop_get_encoding,
+	loop_list_dbs,
+	loop_list_tables,
+	loop_query,
+	loop_query_null,
+	loop_quote_string,
+	loop_conn_quote_string,
+	loop_quote_binary,
+	loop_encoding,
+	loop_encoding,
+	loop_get_engine_version,
+	loop_select_db,
+	loop_geterror,
+	loop_get_seq,
+	loop_get_seq,
+	loop_ping,
+	NULL, NULL, NULL,
+	NULL,
+	NULL, NULL, NULL,
+	loop_send_query,
+	loop_consume_input,
+	loop_is_busy,
+	loop_get_result,
+	NULL, NULL, NULL
+};
+
+/* an instance which only knows the drivers above */
+static dbi_inst loop_instance(void) {
+	dbi_inst inst = NULL;
+
+	dbi_register_static_driver(&loop_functions);
+	dbi_register_static_driver(&loop_async_functions);
+	if (dbi_initialize_r("/nonexistent/libdbi/test", &inst) < 2) {
+		if (inst) {
+			dbi_shutdown_r(inst);
+		}
+		return NULL;
+	}
+	return inst;
+}
+
+static dbi_conn loop_open(dbi_inst inst, const char *drivername) {
+	dbi_conn conn = dbi_conn_new_r(drivername, inst);
+
+	if (conn && dbi_conn_connect(conn) < 0) {
+		dbi_conn_close(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+static const char *loop_last(dbi_conn conn) {
+	return ((loop_conn_t *)((dbi_conn_t *)conn)->connection)->last;
+}
+
+static unsigned int loop_numqueries(dbi_conn conn) {
+	return ((loop_conn_t *)((dbi_conn_t *)conn)->connection)->numqueries;
+}
+
+static void test_batch(void) {
+	const char *columns[] = { "a", "b" };
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_batch batch;
+	dbi_result result;
+	const char *errmsg;
+
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	conn = loop_open(inst, "loop");
+	CHECK(conn != NULL);
+	if (!conn) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+
+	/* sent when the row limit is reached */
+	batch = dbi_conn_batch_new(conn, "t", columns, 2);
+	CHECK(batch != NULL);
+	CHECK(dbi_batch_set_limits(batch, 0, 2) == 0);
+	CHECK(dbi_batch_append_int(batch, 1) == 0);
+	CHECK(dbi_batch_append_string(batch, "it's") == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	CHECK(dbi_batch_get_numrows_pending(batch) == 1);
+	CHECK(loop_numqueries(conn) == 0);
+	CHECK(dbi_batch_append_null(batch) == 0);
+	CHECK(dbi_batch_append_longlong(batch, -2) == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	CHECK(dbi_batch_get_numrows_pending(batch) == 0);
+	CHECK(loop_numqueries(conn) == 1);
+	CHECK(strcmp(loop_last(conn), "INSERT INTO t (a,b) VALUES (1,'it''s'),(NULL,-2)") == 0);
+	CHECK(dbi_batch_get_numrows_affected(batch) == 2);
+
+	/* a row with too few or too many values is dropped */
+	CHECK(dbi_batch_append_int(batch, 3) == 0);
+	CHECK(dbi_batch_end_row(batch) == -1);
+	CHECK(dbi_conn_error(conn, &errmsg) == DBI_ERROR_BADIDX);
+	CHECK(dbi_batch_get_numrows_pending(batch) == 0);
+	CHECK(dbi_batch_append_int(batch, 4) == 0);
+	CHECK(dbi_batch_append_int(batch, 5) == 0);
+	CHECK(dbi_batch_append_int(batch, 6) == -1);
+	CHECK(dbi_batch_end_row(batch) == 0);
+
+	/* the rest is sent by a flush. Without rows it sends nothing and
+	   is no error */
+	result = dbi_batch_flush(batch);
+	CHECK(result != NULL);
+	CHECK(dbi_result_get_numrows_affected(result) == 1);
+	dbi_result_free(result);
+	CHECK(strcmp(loop_last(conn), "INSERT INTO t (a,b) VALUES (4,5)") == 0);
+	CHECK(dbi_batch_flush(batch) == NULL);
+	CHECK(dbi_conn_error(conn, &errmsg) == DBI_ERROR_NONE);
+	CHECK(dbi_batch_get_numrows_affected(batch) == 3);
+
+	/* a row which does not fit starts the next statement */
+	CHECK(dbi_batch_set_limits(batch, 40, 100) == 0);
+	CHECK(dbi_batch_append_int(batch, 7) == 0);
+	CHECK(dbi_batch_append_int(batch, 8) == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	CHECK(dbi_batch_append_string(batch, "a long value") == 0);
+	CHECK(dbi_batch_append_int(batch, 9) == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	CHECK(strcmp(loop_last(conn), "INSERT INTO t (a,b) VALUES (7,8)") == 0);
+	CHECK(dbi_batch_get_numrows_pending(batch) == 1);
+	result = dbi_batch_flush(batch);
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(strcmp(loop_last(conn), "INSERT INTO t (a,b) VALUES ('a long value',9)") == 0);
+	CHECK(dbi_batch_get_numrows_affected(batch) == 5);
+
+	/* a failed statement drops its rows */
+	CHECK(dbi_batch_append_string(batch, "FAIL") == 0);
+	CHECK(dbi_batch_append_int(batch, 0) == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	CHECK(dbi_batch_flush(batch) == NULL);
+	CHECK(dbi_conn_error(conn, &errmsg) != DBI_ERROR_NONE);
+	CHECK(dbi_batch_get_numrows_pending(batch) == 0);
+	CHECK(dbi_batch_free(batch) == 0);
+
+	/* rows of the bulk insert function of a driver are not rendered */
+	dbi_conn_close(conn);
+	conn = dbi_conn_new_r("loop", inst);
+	CHECK(conn != NULL);
+	dbi_conn_set_option_numeric(conn, "loop_bulk", 1);
+	CHECK(dbi_conn_connect(conn) == 0);
+	batch = dbi_conn_batch_new(conn, "t", columns, 2);
+	CHECK(dbi_batch_set_limits(batch, 0, 3) == 0);
+	CHECK(dbi_batch_append_int(batch, 1) == 0);
+	CHECK(dbi_batch_append_string(batch, "x") == 0);
+	CHECK(dbi_batch_end_row(batch) == 0);
+	result = dbi_batch_flush(batch);
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(strcmp(loop_last(conn), "1 rows into t") == 0);
+	CHECK(dbi_batch_get_numrows_affected(batch) == 1);
+
+	/* closing the connection detaches the batch */
+	CHECK(dbi_batch_append_int(batch, 2) == 0);
+	dbi_conn_close(conn);
+	CHECK(dbi_batch_append_int(batch, 3) == -1);
+	CHECK(dbi_batch_end_row(batch) == -1);
+	CHECK(dbi_batch_flush(batch) == NULL);
+	CHECK(dbi_batch_free(batch) == 0);
+
+	dbi_shutdown_r(inst);
+}
+
+static unsigned int async_callbacks = 0;
+static unsigned long long async_callback_rows = 0;
+
+static void async_callback(dbi_conn conn, dbi_result result, void *user_argument) {
+	async_callbacks++;
+	if (result) {
+		async_callback_rows += dbi_result_get_numrows(result);
+		dbi_result_free(result);
+	}
+	CHECK(user_argument == &async_callbacks);
+}
+
+static void test_async(void) {
+	dbi_inst inst;
+	dbi_conn conns[2];
+	dbi_pending pending;
+	dbi_pending second;
+	dbi_result result;
+	const char *errmsg;
+	int ready[2];
+
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	conns[0] = loop_open(inst, "loopasync");
+	conns[1] = loop_open(inst, "loopasync");
+	CHECK(conns[0] != NULL && conns[1] != NULL);
+	if (!conns[0] || !conns[1]) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+
+	/* the result is there after the driver read it */
+	pending = dbi_conn_query_async(conns[0], "SELECT 2");
+	CHECK(pending != NULL);
+	CHECK(dbi_conn_poll_result(pending) == 0);
+	CHECK(dbi_conn_poll_result(pending) == 1);
+	result = dbi_conn_get_async_result(pending);
+	CHECK(result != NULL);
+	CHECK(dbi_result_get_numrows(result) == 2);
+	CHECK(dbi_result_next_row(result) == 1);
+	CHECK(strcmp(dbi_result_get_string_idx(result, 1), "row") == 0);
+	dbi_result_free(result);
+
+	/* the result is waited for if it is not there yet, and a query
+	   sent meanwhile waits for the one before it */
+	pending = dbi_conn_query_async(conns[0], "SELECT 1");
+	second = dbi_conn_query_async(conns[0], "SELECT 3");
+	CHECK(pending != NULL && second != NULL);
+	CHECK(dbi_conn_poll_result(pending) == 1);
+	result = dbi_conn_get_async_result(second);
+	CHECK(result != NULL && dbi_result_get_numrows(result) == 3);
+	dbi_result_free(result);
+	result = dbi_conn_get_async_result(pending);
+	CHECK(result != NULL && dbi_result_get_numrows(result) == 1);
+	dbi_result_free(result);
+
+	/* errors of the query and of sending it */
+	pending = dbi_conn_query_async(conns[0], "SELECT FAIL");
+	CHECK(pending != NULL);
+	while (dbi_conn_poll_result(pending) == 0)
+		;
+	CHECK(dbi_conn_error(conns[0], &errmsg) == 1);
+	CHECK(strcmp(errmsg, "1: the statement failed") == 0);
+	CHECK(dbi_conn_get_async_result(pending) == NULL);
+	CHECK(dbi_conn_error(conns[0], &errmsg) == 1);
+	CHECK(dbi_conn_query_async(conns[0], "SENDFAIL") == NULL);
+	CHECK(dbi_conn_error(conns[0], &errmsg) == 1);
+	CHECK(dbi_conn_query_async(conns[0], NULL) == NULL);
+
+	/* callbacks are called by whatever collects the result */
+	CHECK(dbi_conn_query_callback(conns[0], "SELECT 4", async_callback, &async_callbacks) == 0);
+	CHECK(dbi_conn_query_callback(conns[1], "SELECT 5", async_callback, &async_callbacks) == 0);
+	CHECK(dbi_conn_query_callback(conns[1], "SELECT 1", NULL, NULL) == -1);
+	CHECK(async_callbacks == 0);
+	while (async_callbacks < 2) {
+		CHECK(dbi_conn_wait_any(conns, 2, 1000, ready) == 0);
+	}
+	CHECK(async_callback_rows == 9);
+
+	/* results which are done are reported by dbi_conn_wait_any() */
+	pending = dbi_conn_query_async(conns[1], "SELECT 6");
+	CHECK(dbi_conn_wait_any(conns, 2, 1000, ready) == 1);
+	CHECK(ready[0] == 0 && ready[1] == 1);
+	result = dbi_conn_get_async_result(pending);
+	CHECK(result != NULL && dbi_result_get_numrows(result) == 6);
+	dbi_result_free(result);
+	CHECK(dbi_conn_wait_any(conns, 2, 0, ready) == 0);
+
+	/* closing the connection cancels what it has not delivered, the
+	   callback is not called */
+	CHECK(dbi_conn_query_async(conns[1], "SELECT 7") != NULL);
+	CHECK(dbi_conn_query_async(conns[1], "SELECT 8") != NULL);
+	CHECK(dbi_conn_query_callback(conns[0], "SELECT 9", async_callback, &async_callbacks) == 0);
+	dbi_conn_close(conns[1]);
+	dbi_conn_close(conns[0]);
+	CHECK(async_callbacks == 2);
+
+	/* drivers which cannot send without waiting run the query right
+	   away, or in a worker thread */
+	conns[0] = loop_open(inst, "loop");
+	CHECK(conns[0] != NULL);
+	pending = dbi_conn_query_async(conns[0], "SELECT 2");
+	CHECK(pending != NULL);
+	CHECK(dbi_conn_poll_result(pending) == 1);
+	result = dbi_conn_get_async_result(pending);
+	CHECK(result != NULL && dbi_result_get_numrows(result) == 2);
+	dbi_result_free(result);
+
+	if (dbi_set_async_workers_r(2, inst) == 0) {
+		pending = dbi_conn_query_async(conns[0], "SELECT 3");
+		CHECK(pending != NULL);
+		result = dbi_conn_get_async_result(pending);
+		CHECK(result != NULL && dbi_result_get_numrows(result) == 3);
+		dbi_result_free(result);
+
+		CHECK(dbi_conn_query_callback(conns[0], "SELECT 1", async_callback, &async_callbacks) == 0);
+		while (async_callbacks < 3) {
+			CHECK(dbi_conn_wait_any(conns, 1, 1000, ready) >= 0);
+		}
+		CHECK(async_callback_rows == 10);
+
+		/* the query a worker runs is finished, the others dropped */
+		CHECK(dbi_conn_query_async(conns[0], "SELECT 1") != NULL);
+		CHECK(dbi_conn_query_async(conns[0], "SELECT 2") != NULL);
+	}
+	dbi_conn_close(conns[0]);
+
+	dbi_shutdown_r(inst);
+}
+
+static void test_pool(void) {
+	dbi_inst inst;
+	dbi_pool pool;
+	dbi_pool spare;
+	dbi_pool_stats stats;
+	dbi_conn first;
+	dbi_conn second;
+	dbi_conn conn;
+	dbi_result result;
+
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	CHECK(dbi_pool_new_r("nosuchdriver", inst) == NULL);
+	pool = dbi_pool_new_r("loop", inst);
+	CHECK(pool != NULL);
+	if (!pool) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+	CHECK(dbi_pool_get_template(pool) != NULL);
+	CHECK(dbi_pool_set_limits(pool, 2, 1) == -1);
+	CHECK(dbi_pool_set_limits(pool, 0, 0) == -1);
+	CHECK(dbi_pool_set_limits(pool, 1, 2) == 0);
+
+	/* connections are opened up to the limit, then checkouts wait */
+	first = dbi_pool_checkout(pool, 0);
+	second = dbi_pool_checkout(pool, 0);
+	CHECK(first != NULL && second != NULL && first != second);
+	result = dbi_conn_query(first, "SELECT 1");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(dbi_pool_checkout(pool, 20) == NULL);
+	CHECK(dbi_pool_get_stats(pool, &stats) == 0);
+	CHECK(stats.numconns == 2 && stats.in_use == 2 && stats.idle == 0);
+	CHECK(stats.created == 2 && stats.checkouts == 2 && stats.timeouts == 1);
+
+	/* the connection checked in last comes back first */
+	CHECK(dbi_pool_checkin(pool, first) == 0);
+	CHECK(dbi_pool_get_stats(pool, &stats) == 0);
+	CHECK(stats.in_use == 1 && stats.idle == 1);
+	CHECK(dbi_pool_checkout(pool, 0) == first);
+	CHECK(dbi_pool_checkin(pool, NULL) == -1);
+	conn = loop_open(inst, "loop");
+	CHECK(dbi_pool_checkin(pool, conn) == -1);
+	dbi_conn_close(conn);
+
+	/* idle connections are pinged before they are handed out, and
+	   replaced if they do not answer */
+	CHECK(dbi_pool_set_idle_times(pool, 0, -1) == 0);
+	CHECK(dbi_pool_checkin(pool, first) == 0);
+	loop_ping_result = 0;
+	first = dbi_pool_checkout(pool, 0);
+	loop_ping_result = 1;
+	CHECK(first != NULL);
+	CHECK(dbi_pool_get_stats(pool, &stats) == 0);
+	CHECK(stats.numconns == 2 && stats.failed == 1 && stats.created == 3);
+	CHECK(dbi_pool_checkin(pool, first) == 0);
+	CHECK(dbi_pool_checkin(pool, second) == 0);
+	CHECK(dbi_pool_set_idle_times(pool, -1, -1) == 0);
+
+	/* warm-up opens the connections the limit leaves */
+	CHECK(dbi_pool_set_limits(pool, 1, 4) == 0);
+	CHECK(dbi_pool_warmup(pool, 1, 1, 2, 1000) == -1);
+	CHECK(dbi_pool_warmup(pool, 5, 2, 2, 1000) == 2);
+	CHECK(dbi_pool_get_stats(pool, &stats) == 0);
+	CHECK(stats.numconns == 4 && stats.idle == 4 && stats.created == 5);
+	CHECK(dbi_pool_warmup(pool, 1, 1, 0, 1000) == 0);
+	dbi_pool_free(pool);
+
+	/* idle connections are reaped on checkin, but not below the
+	   minimum */
+	pool = dbi_pool_new_r("loop", inst);
+	CHECK(pool != NULL);
+	CHECK(dbi_pool_set_limits(pool, 1, 2) == 0);
+	CHECK(dbi_pool_set_idle_times(pool, -1, 0) == 0);
+	first = dbi_pool_checkout(pool, 0);
+	second = dbi_pool_checkout(pool, 0);
+	CHECK(first != NULL && second != NULL);
+	CHECK(dbi_pool_checkin(pool, first) == 0);
+	CHECK(dbi_pool_checkin(pool, second) == 0);
+	CHECK(dbi_pool_get_stats(pool, &stats) == 0);
+	CHECK(stats.reaped == 1 && stats.numconns == 1 && stats.idle == 1);
+
+	/* failed connects are counted and reported */
+	spare = dbi_pool_new_r("loop", inst);
+	CHECK(spare != NULL);
+	dbi_conn_set_option_numeric(dbi_pool_get_template(spare), "loop_fail", 1);
+	CHECK(dbi_pool_checkout(spare, 0) == NULL);
+	CHECK(dbi_pool_warmup(spare, 2, 1, 1, 1000) == -1);
+	CHECK(dbi_pool_get_stats(spare, &stats) == 0);
+	CHECK(stats.numconns == 0 && stats.failed == 3);
+	dbi_pool_free(spare);
+
+	/* a connection checked out when its pool is freed is closed when
+	   it comes back, the instance frees the pools which are left */
+	first = dbi_pool_checkout(pool, 0);
+	CHECK(first != NULL);
+	dbi_pool_free(pool);
+	result = dbi_conn_query(first, "SELECT 1");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(dbi_pool_checkin(pool, first) == 0);
+	CHECK(dbi_pool_new_r("loop", inst) != NULL);
+
+	dbi_shutdown_r(inst);
+}
+
+static int write_file(const char *path, const char *contents) {
+	FILE *fp = fopen(path, "w");
+
+	if (!fp) {
+		return -1;
+	}
+	fputs(contents, fp);
+	return fclose(fp);
+}
+
+static void free_driver_files(dbi_inst_t *inst) {
+	dbi_driver_file_t *file;
+
+	while ((file = inst->driver_files) != NULL) {
+		inst->driver_files = file->next;
+		_free_driver_file(file);
+	}
+}
+
+static void test_manifest(void) {
+	char dir[] = "/tmp/test_dbi.XXXXXX";
+	char alpha[64];
+	char beta[64];
+	char manifest[64];
+	dbi_info_t info = { "alpha", "", "", "", "1.0", "" };
+	dbi_driver_t driver;
+	dbi_driver_file_t named;
+	dbi_driver_file_t unnamed;
+	dbi_driver_file_t *file;
+	dbi_inst_t inst;
+	struct stat filestat;
+	struct utimbuf times;
+
+	if (!mkdtemp(dir)) {
+		printf("No temporary directory, skipping the manifest checks.\n");
+		return;
+	}
+	snprintf(alpha, sizeof(alpha), "%s/libdbdalpha%s", dir, DRIVER_EXT);
+	snprintf(beta, sizeof(beta), "%s/libdbdbeta%s", dir, DRIVER_EXT);
+	snprintf(manifest, sizeof(manifest), "%s/libdbi.manifest", dir);
+	CHECK(write_file(alpha, "alpha driver") == 0);
+	CHECK(write_file(beta, "beta driver") == 0);
+	CHECK(stat(alpha, &filestat) == 0);
+
+	/* a driver which loaded, and one which did not */
+	memset(&named, 0, sizeof(named));
+	named.filename = alpha;
+	named.name = "alpha";
+	named.version = "1.0";
+	named.mtime = (long)filestat.st_mtime;
+	named.size = (unsigned long)filestat.st_size;
+	named.from_manifest = 1;
+	named.next = &unnamed;
+	memset(&unnamed, 0, sizeof(unnamed));
+	unnamed.filename = beta;
+
+	memset(&inst, 0, sizeof(inst));
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	inst.driver_files = &named;
+	_write_driver_manifest(&inst, dir, NULL);
+
+	memset(&inst, 0, sizeof(inst));
+	CHECK(_read_driver_manifest(&inst, dir) == 2);
+	file = inst.driver_files;
+	CHECK(file && file->from_manifest && file->name && file->version);
+	if (!file || !file->name || !file->version || !file->next) {
+		free_driver_files(&inst);
+		return;
+	}
+	CHECK(strcmp(file->name, "alpha") == 0 && strcmp(file->version, "1.0") == 0);
+	CHECK(strcmp(file->filename, alpha) == 0);
+	CHECK(file->mtime == named.mtime && file->size == 12);
+	file = file->next;
+	CHECK(file->from_manifest && file->name == NULL && file->version == NULL);
+	CHECK(strcmp(file->filename, beta) == 0);
+	CHECK(file->size == 11 && file->next == NULL);
+
+	/* an entry holds while the file and the driver loaded from it
+	   match it */
+	memset(&driver, 0, sizeof(driver));
+	driver.info = &info;
+	file = inst.driver_files;
+	CHECK(_driver_file_changed(file, &driver) == 0);
+	CHECK(_driver_file_changed(file, NULL) == 1);
+	info.version = "1.1";
+	CHECK(_driver_file_changed(file, &driver) == 1);
+	info.version = "1.0";
+	CHECK(_driver_file_changed(file->next, NULL) == 0);
+	CHECK(_driver_file_changed(file->next, &driver) == 1);
+	CHECK(write_file(alpha, "alpha driver, rebuilt") == 0);
+	CHECK(_driver_file_changed(file, &driver) == 1);
+	named.from_manifest = 0;
+	CHECK(_driver_file_changed(&named, &driver) == 1);
+	free_driver_files(&inst);
+
+	/* a manifest older than the directory is not read, and the files
+	   without an exact entry are listed without a name */
+	times.actime = times.modtime = time(NULL)-60;
+	CHECK(utime(manifest, &times) == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	inst.driver_files = &named;
+	_write_driver_manifest(&inst, dir, NULL);
+	memset(&inst, 0, sizeof(inst));
+	CHECK(_read_driver_manifest(&inst, dir) == 2);
+	CHECK(inst.driver_files && inst.driver_files->name == NULL);
+	free_driver_files(&inst);
+
+	/* nor is one which is damaged or names files outside of the
+	   directory */
+	CHECK(write_file(manifest, "libdbi driver manifest 0\n") == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	CHECK(write_file(manifest, "libdbi driver manifest 1\nalpha\t1.0\t0\t12\n") == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	CHECK(write_file(manifest, "libdbi driver manifest 1\nalpha\t1.0\t0\t12\t../libdbdalpha" DRIVER_EXT "\n") == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	CHECK(write_file(manifest, "libdbi driver manifest 1\nalpha\t1.0\t0\t12\tlibdbdalpha.txt\n") == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == -1);
+	CHECK(inst.driver_files == NULL);
+	CHECK(write_file(manifest, "libdbi driver manifest 1\n") == 0);
+	CHECK(_read_driver_manifest(&inst, dir) == 0);
+
+	remove(manifest);
+	remove(alpha);
+	remove(beta);
+	rmdir(dir);
+}
+
+static void test_stats(void) {
+	const char *columns[] = { "a" };
+	dbi_histogram histogram;
+	dbi_conn_stats stats;
+	dbi_conn_stats total;
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_stmt stmt;
+	dbi_batch batch;
+	dbi_result result;
+	unsigned long long numbuckets;
+	unsigned long long bytes;
+	unsigned int idx;
+
+	/* latencies up to DBI_HISTOGRAM_SUBBUCKETS microseconds have a
+	   bucket each, above, each power of two has four */
+	memset(&histogram, 0, sizeof(histogram));
+	CHECK(dbi_histogram_percentile(&histogram, 50.0) == 0);
+	CHECK(dbi_histogram_percentile(NULL, 50.0) == 0);
+	histogram.buckets[2] = 5; /* 2 us */
+	histogram.buckets[9] = 4; /* 10-11 us */
+	histogram.buckets[DBI_HISTOGRAM_BUCKETS-1] = 1;
+	histogram.count = 10;
+	histogram.max = 5000000;
+	CHECK(dbi_histogram_percentile(&histogram, 0.0) == 2);
+	CHECK(dbi_histogram_percentile(&histogram, 50.0) == 2);
+	CHECK(dbi_histogram_percentile(&histogram, 60.0) == 11);
+	CHECK(dbi_histogram_percentile(&histogram, 90.0) == 11);
+	CHECK(dbi_histogram_percentile(&histogram, 99.0) == 5000000);
+	CHECK(dbi_histogram_percentile(&histogram, 100.0) == 5000000);
+
+	/* and never more than the longest one */
+	memset(&histogram, 0, sizeof(histogram));
+	histogram.buckets[17] = 1; /* 40-47 us */
+	histogram.count = 1;
+	histogram.max = 42;
+	CHECK(dbi_histogram_percentile(&histogram, 50.0) == 42);
+	histogram.buckets[16] = 1; /* 32-39 us */
+	histogram.count = 2;
+	CHECK(dbi_histogram_percentile(&histogram, 50.0) == 39);
+
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	conn = dbi_conn_new_r("loop", inst);
+	CHECK(conn != NULL);
+	if (!conn) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+	dbi_conn_set_option_numeric(conn, "LatencyHistograms", 1);
+	CHECK(dbi_conn_connect(conn) == 0);
+
+	/* statements and the fields of fetched rows */
+	result = dbi_conn_query(conn, "SELECT 3");
+	CHECK(result != NULL);
+	while (dbi_result_next_row(result))
+		;
+	dbi_result_free(result);
+	bytes = strlen("SELECT 3")+3*strlen("row");
+	CHECK(dbi_conn_query(conn, "SELECT FAIL") == NULL);
+	bytes += strlen("SELECT FAIL");
+
+	/* emulated prepared statements and batches are counted as the
+	   statements they send */
+	stmt = dbi_conn_prepare(conn, "INSERT INTO t VALUES (?)");
+	CHECK(stmt != NULL);
+	CHECK(dbi_stmt_bind_int(stmt, 1, 5) == 0);
+	result = dbi_stmt_execute(stmt);
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(dbi_stmt_free(stmt) == 0);
+	CHECK(strcmp(loop_last(conn), "INSERT INTO t VALUES (5)") == 0);
+	bytes += strlen("INSERT INTO t VALUES (5)");
+	batch = dbi_conn_batch_new(conn, "t", columns, 1);
+	for (idx = 1; idx <= 2; idx++) {
+		CHECK(dbi_batch_append_int(batch, idx) == 0);
+		CHECK(dbi_batch_end_row(batch) == 0);
+	}
+	result = dbi_batch_flush(batch);
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	dbi_batch_free(batch);
+	bytes += strlen("INSERT INTO t (a) VALUES (1),(2)");
+
+	CHECK(dbi_conn_get_stats(conn, &stats) == 0);
+	CHECK(stats.queries == 4 && stats.errors == 1);
+	CHECK(stats.rows == 3 && stats.bytes == bytes);
+	CHECK(stats.connect.count == 1);
+	CHECK(stats.query.count == 4 && stats.fetch_row.count == 3);
+	for (numbuckets = 0, idx = 0; idx < DBI_HISTOGRAM_BUCKETS; idx++) {
+		numbuckets += stats.query.buckets[idx];
+	}
+	CHECK(numbuckets == 4);
+	CHECK(stats.query.total >= stats.query.max);
+	CHECK(dbi_histogram_percentile(&stats.query, 100.0) == stats.query.max);
+	CHECK(dbi_conn_get_stats(conn, NULL) == -1);
+
+	/* the instance adds up its connections, also the closed ones */
+	dbi_conn_close(conn);
+	conn = loop_open(inst, "loop");
+	CHECK(conn != NULL);
+	result = dbi_conn_query(conn, "SELECT 0");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(dbi_conn_get_stats(conn, &stats) == 0);
+	CHECK(stats.queries == 1 && stats.query.count == 0);
+	CHECK(dbi_get_stats_r(&total, inst) == 0);
+	CHECK(total.queries == 5 && total.errors == 1 && total.rows == 3);
+	CHECK(total.bytes == bytes+strlen("SELECT 0"));
+	CHECK(total.query.count == 4);
+
+	dbi_shutdown_r(inst);
+}
+
+typedef struct {
+	unsigned int starts;
+	unsigned int ends;
+	unsigned int fetches;
+	unsigned int frees;
+	char statement[64];
+	size_t length;
+	dbi_query_trace trace;
+	unsigned long long numrows_fetched;
+	dbi_result result; /* the last one passed to a callback */
+} trace_log_t;
+
+static void trace_query_start(dbi_conn conn, const char *statement, size_t length, void *user_argument) {
+	trace_log_t *log = user_argument;
+
+	log->starts++;
+	snprintf(log->statement, sizeof(log->statement), "%s", statement);
+	log->length = length;
+}
+
+static void trace_query_end(dbi_conn conn, dbi_result result, const dbi_query_trace *trace, void *user_argument) {
+	trace_log_t *log = user_argument;
+
+	log->ends++;
+	log->trace = *trace;
+	log->result = result;
+}
+
+static void trace_fetch(dbi_conn conn, dbi_result result, unsigned long long numrows, unsigned long long duration, void *user_argument) {
+	trace_log_t *log = user_argument;
+
+	log->fetches++;
+	log->numrows_fetched += numrows;
+	log->result = result;
+}
+
+static void trace_result_free(dbi_conn conn, dbi_result result, void *user_argument) {
+	trace_log_t *log = user_argument;
+
+	log->frees++;
+	log->result = result;
+}
+
+static void test_trace(void) {
+	dbi_trace_callbacks callbacks = { trace_query_start, trace_query_end, trace_fetch, trace_result_free };
+	dbi_trace_callbacks end_only = { NULL, trace_query_end, NULL, NULL };
+	trace_log_t log;
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_pool pool;
+	dbi_pending pending;
+	dbi_result result;
+
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	conn = loop_open(inst, "loopasync");
+	CHECK(conn != NULL);
+	if (!conn) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+	CHECK(dbi_conn_set_trace(NULL, &callbacks, &log) == -1);
+	memset(&log, 0, sizeof(log));
+	CHECK(dbi_conn_set_trace(conn, &callbacks, &log) == 0);
+
+	/* a query, its rows, and freeing its result */
+	result = dbi_conn_query(conn, "SELECT 2");
+	CHECK(result != NULL);
+	CHECK(log.starts == 1 && log.ends == 1);
+	CHECK(strcmp(log.statement, "SELECT 2") == 0 && log.length == 8);
+	CHECK(log.result == result && !log.trace.failed);
+	CHECK(log.trace.numrows_matched == 2 && log.trace.numrows_affected == 0);
+	CHECK(dbi_result_next_row(result) == 1);
+	CHECK(dbi_result_next_row(result) == 1);
+	CHECK(dbi_result_first_row(result) == 1);
+	CHECK(log.fetches == 2 && log.numrows_fetched == 2);
+	log.result = NULL;
+	dbi_result_free(result);
+	CHECK(log.frees == 1 && log.result == result);
+
+	/* a failed one */
+	CHECK(dbi_conn_query(conn, "SELECT FAIL") == NULL);
+	CHECK(log.starts == 2 && log.ends == 2);
+	CHECK(log.trace.failed && log.result == NULL && log.trace.numrows_matched == 0);
+
+	/* asynchronous queries end when their result is collected */
+	pending = dbi_conn_query_async(conn, "INSERT INTO t VALUES (1),(2)");
+	CHECK(pending != NULL);
+	CHECK(log.starts == 3 && log.ends == 2);
+	CHECK(strcmp(log.statement, "INSERT INTO t VALUES (1),(2)") == 0);
+	result = dbi_conn_get_async_result(pending);
+	CHECK(result != NULL);
+	CHECK(log.ends == 3 && log.result == result && log.trace.numrows_affected == 2);
+	dbi_result_free(result);
+
+	/* callbacks which are NULL are left out, and the trace ends when
+	   it is set to NULL */
+	memset(&log, 0, sizeof(log));
+	CHECK(dbi_conn_set_trace(conn, &end_only, &log) == 0);
+	result = dbi_conn_query(conn, "SELECT 1");
+	CHECK(result != NULL);
+	CHECK(dbi_result_next_row(result) == 1);
+	dbi_result_free(result);
+	CHECK(log.starts == 0 && log.ends == 1 && log.fetches == 0 && log.frees == 0);
+	CHECK(dbi_conn_set_trace(conn, NULL, NULL) == 0);
+	result = dbi_conn_query(conn, "SELECT 1");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(log.ends == 1);
+	dbi_conn_close(conn);
+
+	/* connections of a pool are traced like its template */
+	pool = dbi_pool_new_r("loop", inst);
+	CHECK(pool != NULL);
+	memset(&log, 0, sizeof(log));
+	CHECK(dbi_conn_set_trace(dbi_pool_get_template(pool), &callbacks, &log) == 0);
+	conn = dbi_pool_checkout(pool, 0);
+	CHECK(conn != NULL);
+	result = dbi_conn_query(conn, "SELECT 0");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(log.starts == 1 && log.ends == 1 && log.frees == 1);
+	CHECK(dbi_pool_checkin(pool, conn) == 0);
+
+	dbi_shutdown_r(inst);
+}
+
+/* reads a line of the slow query log from fd, waiting at most five
+   seconds for the writer */
+static int read_log_line(int fd, char *line, size_t size) {
+	struct pollfd pfd;
+	size_t used = 0;
+
+	while (used < size-1) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 5000) <= 0 || read(fd, line+used, 1) != 1) {
+			break;
+		}
+		if (line[used++] == '\n') {
+			line[used] = '\0';
+			return 0;
+		}
+	}
+	line[used] = '\0';
+	return -1;
+}
+
+static void test_slowlog(void) {
+	char statement[600];
+	char expected[700];
+	char line[1024];
+	char byte = 0;
+	dbi_inst inst;
+	dbi_conn conn;
+	dbi_conn fast;
+	dbi_result result;
+	unsigned int numlines;
+	unsigned int numdropped;
+	unsigned int idx;
+	size_t filled;
+	int fds[2];
+	int flags;
+
+	if (pipe(fds) < 0) {
+		printf("No pipe, skipping the slow query log checks.\n");
+		return;
+	}
+	inst = loop_instance();
+	CHECK(inst != NULL);
+	if (!inst) {
+		return;
+	}
+	conn = dbi_conn_new_r("loop", inst);
+	fast = dbi_conn_new_r("loop", inst);
+	CHECK(conn != NULL && fast != NULL);
+	if (!conn || !fast) {
+		dbi_shutdown_r(inst);
+		return;
+	}
+	dbi_conn_set_option(conn, "dbname", "testdb");
+	dbi_conn_set_option_numeric(conn, "SlowQueryMs", 0);
+	dbi_conn_set_option_numeric(conn, "SlowQueryFd", fds[1]);
+	dbi_conn_set_option_numeric(fast, "SlowQueryMs", 60000);
+	dbi_conn_set_option_numeric(fast, "SlowQueryFd", fds[1]);
+	CHECK(dbi_conn_connect(conn) == 0 && dbi_conn_connect(fast) == 0);
+
+	/* one line per query */
+	result = dbi_conn_query(conn, "SELECT 2");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(read_log_line(fds[0], line, sizeof(line)) == 0);
+	CHECK(strncmp(line, "libdbi: [slow] ", 15) == 0);
+	CHECK(strstr(line, " ms, 2 rows matched, 0 affected, conn ") != NULL);
+	snprintf(expected, sizeof(expected), "conn %p, driver loop, db testdb: SELECT 2\n", conn);
+	CHECK(strstr(line, expected) != NULL);
+
+	/* failed queries are marked, and line breaks joined */
+	CHECK(dbi_conn_query(conn, "SELECT\nFAIL") == NULL);
+	CHECK(read_log_line(fds[0], line, sizeof(line)) == 0);
+	CHECK(strstr(line, " ms, 0 rows matched, 0 affected, failed, conn ") != NULL);
+	CHECK(strstr(line, ", db testdb: SELECT FAIL\n") != NULL);
+
+	/* queries below the threshold are left out, so the next line is
+	   of the long statement, which is cut */
+	result = dbi_conn_query(fast, "SELECT 0");
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	strcpy(statement, "SELECT 0 ");
+	memset(statement+9, 'x', sizeof(statement)-10);
+	statement[sizeof(statement)-1] = '\0';
+	result = dbi_conn_query(conn, statement);
+	CHECK(result != NULL);
+	dbi_result_free(result);
+	CHECK(read_log_line(fds[0], line, sizeof(line)) == 0);
+	snprintf(expected, sizeof(expected), "db testdb: %.479s...\n", statement);
+	CHECK(strstr(line, expected) != NULL);
+
+	/* the writer of the instance blocks on a full pipe, the queries
+	   do not. Entries which do not fit into the ring are counted */
+	dbi_conn_close(fast);
+	if (((dbi_inst_t *)inst)->slowlog) {
+		flags = fcntl(fds[1], F_GETFL);
+		fcntl(fds[1], F_SETFL, flags | O_NONBLOCK);
+		for (filled = 0; write(fds[1], &byte, 1) == 1; filled++)
+			;
+		fcntl(fds[1], F_SETFL, flags);
+		for (idx = 0; idx < 200; idx++) {
+			result = dbi_conn_query(conn, "SELECT 1");
+			CHECK(result != NULL);
+			dbi_result_free(result);
+		}
+		for (; filled > 0 && read(fds[0], &byte, 1) == 1; filled--)
+			;
+
+		/* shutting down writes the entries left */
+		dbi_shutdown_r(inst);
+		close(fds[1]);
+		numlines = numdropped = 0;
+		while (read_log_line(fds[0], line, sizeof(line)) == 0) {
+			if (strstr(line, " slow queries were not logged")) {
+				CHECK(sscanf(line, "libdbi: [slow] %u slow", &numdropped) == 1);
+			}
+			else {
+				CHECK(strstr(line, "db testdb: SELECT 1\n") != NULL);
+				numlines++;
+			}
+		}
+		CHECK(numlines == 128 && numdropped == 72);
+	}
+	else {
+		dbi_shutdown_r(inst);
+		close(fds[1]);
+	}
+	close(fds[0]);
+}
 
 int main(int argc, char **argv) {
 	dbi_driver driver;
@@ -17,6 +1503,24 @@ int main(int argc, char **argv) {
 	int numdrivers;
 
 	printf("\nlibdbi test program: $Id$\nLibrary version: %s\n\n", dbi_version());
+
+	test_codecs();
+	test_number_parsers();
+	test_placeholders();
+	test_render_param();
+	test_copy_decoding();
+	test_batch();
+	test_async();
+	test_pool();
+	test_manifest();
+	test_stats();
+	test_trace();
+	test_slowlog();
+	if (failures) {
+		printf("%d checks of the helper functions failed!\n", failures);
+		return 1;
+	}
+	printf("Helper functions checked.\n\n");
 	
 	printf("libdbi driver directory? [%s] ", DBI_DRIVER_DIR);
 	fgets(driverdir, 256, stdin);